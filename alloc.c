@@ -0,0 +1,430 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "alloc.h"
+#include "env.h"
+#include "err.h"
+
+#ifdef ALLOCSTATS
+
+#undef free
+
+#define NSITEBUCKETS	256
+#define MINBUCKETS	1024
+
+/*
+ * Allocation accounting, by call site.
+ *
+ * The blocks allocated are found by their address in a hash table,
+ * so that the blocks allocated elsewhere, e.g. by the C library, can
+ * still be freed with free(): they're just not accounted for.  A
+ * reallocation counts as the release of the block at the site it was
+ * allocated at and as an allocation at the site of realloc_or_die().
+ *
+ * The statistics are printed by the "allocstats" builtin, and at exit
+ * to the file $ISH_ALLOCSTATS, or the standard error if it's empty.
+ * The variable is the one of the shell, e.g. set in ~/.ishrc.
+ * "allocstats -m" sets a mark, and "allocstats -l" reports the blocks
+ * still live among those allocated since the mark: in a long session,
+ * these are the leaks.
+ */
+typedef struct site {
+        const char *file;
+        int line;
+        unsigned long count;    /* allocations */
+        unsigned long long bytes;
+        unsigned long live;     /* blocks */
+        size_t livebytes;
+        size_t peak;            /* live bytes */
+        unsigned long leaks;    /* blocks live since the mark */
+        size_t leakbytes;
+        struct site *next;      /* in its bucket */
+} site_t;
+
+typedef struct block {
+        void *ptr;
+        size_t size;
+        site_t *site;
+        unsigned long long seq; /* allocation number */
+        struct block *next;     /* in its bucket */
+} block_t;
+
+static struct {
+        pthread_mutex_t lock;
+        _Bool init;
+        pid_t pid;              /* of the shell */
+        site_t *sites[NSITEBUCKETS];
+        site_t **all;           /* sites in order of creation */
+        size_t nsites;
+        size_t sitescap;
+        block_t **blocks;
+        size_t nbuckets;
+        size_t nblocks;
+        unsigned long long seq;
+        unsigned long long mark;
+} alloc = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void report(FILE *, _Bool);
+
+static void
+lock(void)
+{
+
+        pthread_mutex_lock(&alloc.lock);
+}
+
+static void
+unlock(void)
+{
+
+        pthread_mutex_unlock(&alloc.lock);
+}
+
+/*
+ * Return true if the statistics are printed when this process exits.
+ */
+_Bool
+alloc_reporting(void)
+{
+
+        return (alloc.init && getpid() == alloc.pid &&
+            env_get("ISH_ALLOCSTATS") != NULL);
+}
+
+/*
+ * Print the statistics at exit, from the shell only.
+ */
+static void
+atexitreport(void)
+{
+        const char *path;
+        FILE *fp;
+
+        if (!alloc_reporting())
+                return;
+        path = env_get("ISH_ALLOCSTATS");
+        if (*path == '\0')
+                fp = stderr;
+        else if ((fp = fopen(path, "a")) == NULL)
+                return;
+        alloc.mark = 0;
+        fprintf(fp, "ish %ld:\n", (long)alloc.pid);
+        report(fp, 0);
+        report(fp, 1);
+        if (fp != stderr)
+                fclose(fp);
+}
+
+/*
+ * Initialize the accounting at the first allocation, with the lock
+ * held.
+ */
+static void
+init(void)
+{
+
+        alloc.init = 1;
+        alloc.pid = getpid();
+        alloc.nbuckets = MINBUCKETS;
+        if ((alloc.blocks = calloc(alloc.nbuckets, sizeof(*alloc.blocks)))
+            == NULL)
+                err_sys("calloc");
+        /* A child mustn't inherit the lock held by another thread. */
+        pthread_atfork(lock, unlock, unlock);
+        atexit(atexitreport);
+}
+
+static inline size_t
+hashptr(const void *ptr, size_t n)
+{
+        uintptr_t h = (uintptr_t)ptr;
+
+        h ^= h >> 17;
+        h *= 0x9e3779b97f4a7c15ULL;
+        return ((h >> 16) & (n - 1));
+}
+
+static site_t *
+getsite(const char *file, int line)
+{
+        site_t **pp;
+        site_t *sp;
+        size_t h;
+
+        h = ((uintptr_t)file + line * 31) & (NSITEBUCKETS - 1);
+        for (pp = &alloc.sites[h]; (sp = *pp) != NULL; pp = &sp->next)
+                if (sp->line == line && (sp->file == file ||
+                    !strcmp(sp->file, file)))
+                        return (sp);
+
+        if ((sp = calloc(1, sizeof(*sp))) == NULL)
+                err_sys("calloc");
+        sp->file = file;
+        sp->line = line;
+        *pp = sp;
+        if (alloc.nsites == alloc.sitescap) {
+                alloc.sitescap = alloc.sitescap ? alloc.sitescap * 2: 256;
+                alloc.all = realloc(alloc.all,
+                    alloc.sitescap * sizeof(*alloc.all));
+                if (alloc.all == NULL)
+                        err_sys("realloc");
+        }
+        alloc.all[alloc.nsites++] = sp;
+
+        return (sp);
+}
+
+static void
+rehash(void)
+{
+        block_t **blocks;
+        block_t *next;
+        size_t n;
+        size_t h;
+
+        n = alloc.nbuckets * 2;
+        if ((blocks = calloc(n, sizeof(*blocks))) == NULL)
+                err_sys("calloc");
+        for (size_t i = 0; i < alloc.nbuckets; i++)
+                for (block_t *bp = alloc.blocks[i]; bp; bp = next) {
+                        next = bp->next;
+                        h = hashptr(bp->ptr, n);
+                        bp->next = blocks[h];
+                        blocks[h] = bp;
+                }
+        free(alloc.blocks);
+        alloc.blocks = blocks;
+        alloc.nbuckets = n;
+}
+
+static void
+track(void *ptr, size_t size, const char *file, int line)
+{
+        block_t *bp;
+        site_t *sp;
+        size_t h;
+
+        if (!alloc.init)
+                init();
+        if ((bp = malloc(sizeof(*bp))) == NULL)
+                err_sys("malloc");
+        sp = getsite(file, line);
+        sp->count++;
+        sp->bytes += size;
+        sp->live++;
+        if ((sp->livebytes += size) > sp->peak)
+                sp->peak = sp->livebytes;
+
+        bp->ptr = ptr;
+        bp->size = size;
+        bp->site = sp;
+        bp->seq = ++alloc.seq;
+        if (++alloc.nblocks > alloc.nbuckets)
+                rehash();
+        h = hashptr(ptr, alloc.nbuckets);
+        bp->next = alloc.blocks[h];
+        alloc.blocks[h] = bp;
+}
+
+/*
+ * Stop accounting for the block "ptr" if it's known.
+ */
+static void
+untrack(void *ptr)
+{
+        block_t **pp;
+        block_t *bp;
+
+        if (ptr == NULL || !alloc.init)
+                return;
+        for (pp = &alloc.blocks[hashptr(ptr, alloc.nbuckets)];
+             (bp = *pp) != NULL; pp = &bp->next)
+                if (bp->ptr == ptr)
+                        break;
+        if (bp == NULL)
+                return;
+        *pp = bp->next;
+        alloc.nblocks--;
+        bp->site->live--;
+        bp->site->livebytes -= bp->size;
+        free(bp);
+}
+
+void *
+alloc_malloc(size_t size, const char *file, int line)
+{
+        void *ptr;
+
+        if ((ptr = malloc(size)) == NULL)
+                err_sys("malloc");
+        lock();
+        track(ptr, size, file, line);
+        unlock();
+
+        return (ptr);
+}
+
+void *
+alloc_realloc(void *ptr, size_t size, const char *file, int line)
+{
+        void *nptr;
+
+        /* The block is lost for the accounting if this fails. */
+        lock();
+        untrack(ptr);
+        unlock();
+        if ((nptr = realloc(ptr, size)) == NULL)
+                err_sys("realloc");
+        lock();
+        track(nptr, size, file, line);
+        unlock();
+
+        return (nptr);
+}
+
+char *
+alloc_strdup(const char *s, const char *file, int line)
+{
+        size_t len;
+        char *d;
+
+        len = strlen(s) + 1;
+        d = alloc_malloc(len, file, line);
+        memcpy(d, s, len);
+
+        return (d);
+}
+
+void
+alloc_free(void *ptr)
+{
+
+        lock();
+        untrack(ptr);
+        unlock();
+        free(ptr);
+}
+
+static int
+cmpsites(const void *p1, const void *p2)
+{
+        const site_t *s1 = *(site_t *const *)p1;
+        const site_t *s2 = *(site_t *const *)p2;
+
+        if (s1->leakbytes != s2->leakbytes)
+                return (s1->leakbytes < s2->leakbytes ? 1: -1);
+        if (s1->livebytes != s2->livebytes)
+                return (s1->livebytes < s2->livebytes ? 1: -1);
+        return (s1->peak < s2->peak ? 1: s1->peak > s2->peak ? -1: 0);
+}
+
+/*
+ * Print the statistics of the sites, by decreasing live bytes, or
+ * the blocks still live since the mark if "leaks" is true.
+ */
+static void
+report(FILE *fp, _Bool leaks)
+{
+        unsigned long long bytes;
+        unsigned long count;
+        site_t **sites;
+        char site[64];
+        size_t live;
+
+        lock();
+        if (!alloc.init) {
+                unlock();
+                return;
+        }
+        for (size_t i = 0; i < alloc.nsites; i++) {
+                alloc.all[i]->leaks = 0;
+                alloc.all[i]->leakbytes = 0;
+        }
+        if (leaks)
+                for (size_t i = 0; i < alloc.nbuckets; i++)
+                        for (block_t *bp = alloc.blocks[i]; bp;
+                             bp = bp->next)
+                                if (bp->seq > alloc.mark) {
+                                        bp->site->leaks++;
+                                        bp->site->leakbytes += bp->size;
+                                }
+        if ((sites = malloc((alloc.nsites + 1) * sizeof(*sites))) == NULL)
+                err_sys("malloc");
+        memcpy(sites, alloc.all, alloc.nsites * sizeof(*sites));
+        qsort(sites, alloc.nsites, sizeof(*sites), cmpsites);
+
+        if (leaks)
+                fprintf(fp, "%-24s %10s %12s\n", "SITE", "LEAKS", "BYTES");
+        else
+                fprintf(fp, "%-24s %10s %14s %10s %12s %12s\n", "SITE",
+                    "ALLOCS", "BYTES", "LIVE", "LIVEBYTES", "PEAK");
+        bytes = count = live = 0;
+        for (size_t i = 0; i < alloc.nsites; i++) {
+                const site_t *sp = sites[i];
+                if (leaks && sp->leaks == 0)
+                        continue;
+                snprintf(site, sizeof(site), "%s:%d", sp->file, sp->line);
+                if (leaks) {
+                        fprintf(fp, "%-24s %10lu %12zu\n", site, sp->leaks,
+                            sp->leakbytes);
+                        count += sp->leaks;
+                        live += sp->leakbytes;
+                } else {
+                        fprintf(fp, "%-24s %10lu %14llu %10lu %12zu %12zu\n",
+                            site, sp->count, sp->bytes, sp->live,
+                            sp->livebytes, sp->peak);
+                        count += sp->count;
+                        bytes += sp->bytes;
+                        live += sp->livebytes;
+                }
+        }
+        if (leaks)
+                fprintf(fp, "%-24s %10lu %12zu\n", "total", count, live);
+        else
+                fprintf(fp, "%-24s %10lu %14llu %10zu %12zu\n", "total",
+                    count, bytes, alloc.nblocks, live);
+        free(sites);
+        unlock();
+}
+
+/*
+ * The allocstats builtin.
+ */
+int
+allocstatscmd(int argc, char *argv[])
+{
+        _Bool leaks;
+
+        if (argc > 1)
+                goto usage;
+        leaks = 0;
+        if (argc == 1) {
+                if (!strcmp(argv[0], "-m")) {
+                        lock();
+                        alloc.mark = alloc.seq;
+                        unlock();
+                        return (0);
+                }
+                if (strcmp(argv[0], "-l"))
+                        goto usage;
+                leaks = 1;
+        }
+
+        report(stdout, leaks);
+        fflush(stdout);
+        return (0);
+
+usage:
+        fprintf(stderr, "usage: allocstats [-l | -m]\n");
+        return (2);
+}
+
+#endif  /* ALLOCSTATS */
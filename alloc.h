@@ -0,0 +1,31 @@
+#ifndef ISH_ALLOC_H_
+#define ISH_ALLOC_H_
+
+/*
+ * With ALLOCSTATS, the allocations made by the *_or_die() functions and
+ * the calls to free() go through an accounting layer which keeps the
+ * statistics of each call site.  Included by utils.h.
+ */
+#ifdef ALLOCSTATS
+
+#include <stddef.h>
+#include <stdlib.h>     /* before free() is redefined */
+
+#include "utils.h"      /* before its functions are */
+
+extern void *alloc_malloc(size_t, const char *, int);
+extern void *alloc_realloc(void *, size_t, const char *, int);
+extern char *alloc_strdup(const char *, const char *, int);
+extern void alloc_free(void *);
+extern int allocstatscmd(int, char **);
+extern _Bool alloc_reporting(void);
+
+#define malloc_or_die(size)	alloc_malloc((size), __FILE__, __LINE__)
+#define realloc_or_die(ptr, size)					\
+        alloc_realloc((ptr), (size), __FILE__, __LINE__)
+#define strdup_or_die(s)	alloc_strdup((s), __FILE__, __LINE__)
+#define free(ptr)		alloc_free(ptr)
+
+#endif  /* ALLOCSTATS */
+
+#endif  /* !ISH_ALLOC_H_ */
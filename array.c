@@ -53,3 +53,35 @@ array_append(array_t *a, void *elm)
 
         a->buf[a->len++] = elm;
 }
+
+/*
+ * Remove the element at index "i" and return it.
+ */
+void *
+array_remove(array_t *a, int i)
+{
+        void *elm;
+
+        elm = array_get(a, i);
+        memmove(a->buf + i, a->buf + i + 1, (a->len - i - 1)*sizeof(*a->buf));
+        a->len--;
+
+        return (elm);
+}
+
+/*
+ * Return the NULL-terminated buffer of the array and free the array
+ * itself.  The caller becomes the owner of the elements.
+ */
+void **
+array_detach(array_t *a)
+{
+        void **buf;
+
+        assert(a);
+        buf = realloc_or_die(a->buf, (a->len + 1)*sizeof(*buf));
+        buf[a->len] = NULL;
+        free(a);
+
+        return (buf);
+}
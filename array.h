@@ -11,5 +11,7 @@ extern array_t *array_new(void);
 extern void array_free(array_t *);
 extern void *array_get(array_t *, int);
 extern void array_append(array_t *, void *);
+extern void *array_remove(array_t *, int);
+extern void **array_detach(array_t *);
 
 #endif  /* ISH_ARRAY_H_ */
@@ -0,0 +1,217 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <dirent.h>
+#include <err.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "err.h"
+
+#ifndef BENCH_CFLAGS
+#define BENCH_CFLAGS	"unknown"
+#endif
+
+#define MINTIME		0.5     /* default seconds of a measure */
+
+/*
+ * The results are written as JSON, one object per benchmark with its
+ * metrics, and summarized on the standard error:
+ *
+ *	{"suite": "micro", "time": 1700000000, "cflags": "-O3",
+ *	 "results": [{"name": "parse", "ns_per_op": 1234, ...}, ...]}
+ */
+static struct {
+        FILE *out;
+        double mintime;
+        char **names;           /* benchmarks selected, all if none */
+        int nnames;
+        int nresults;
+        _Bool open;             /* a result is being written */
+} bench;
+
+double
+bench_now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+static void
+usage(const char *suite, const char *more)
+{
+
+        fprintf(stderr, "usage: %s [-t seconds] [-o file] %s[name ...]\n",
+            suite, more);
+        exit(2);
+}
+
+/*
+ * Parse the options common to the benchmark programs and start the
+ * output of the suite.  The options of "opts" are given to "optfn",
+ * which returns -1 if the argument is invalid, and are described by
+ * "more" in the usage.
+ */
+void
+bench_init(int argc, char *argv[], const char *suite, const char *opts,
+    int (*optfn)(int, char *), const char *more)
+{
+        char optstr[64];
+        int c;
+
+        snprintf(optstr, sizeof(optstr), "o:t:%s", opts ? opts: "");
+        bench.out = stdout;
+        bench.mintime = MINTIME;
+        while ((c = getopt(argc, argv, optstr)) != -1) {
+                switch (c) {
+                case 'o':
+                        if ((bench.out = fopen(optarg, "w")) == NULL)
+                                err_sys("%s", optarg);
+                        break;
+                case 't':
+                        if ((bench.mintime = atof(optarg)) <= 0)
+                                usage(suite, more ? more: "");
+                        break;
+                default:
+                        if (c == '?' || optfn == NULL ||
+                            optfn(c, optarg) == -1)
+                                usage(suite, more ? more: "");
+                }
+        }
+        bench.names = argv + optind;
+        bench.nnames = argc - optind;
+
+        fprintf(bench.out, "{\"suite\": \"%s\", \"time\": %ld, "
+            "\"cflags\": \"%s\",\n \"results\": [", suite, (long)time(NULL),
+            BENCH_CFLAGS);
+}
+
+/*
+ * Return true if the benchmark "name" is to be run.
+ */
+_Bool
+bench_selected(const char *name)
+{
+
+        if (bench.nnames == 0)
+                return (1);
+        for (int i = 0; i < bench.nnames; i++)
+                if (!strcmp(bench.names[i], name))
+                        return (1);
+        return (0);
+}
+
+static void
+closeresult(void)
+{
+
+        if (!bench.open)
+                return;
+        fputs("}", bench.out);
+        fputs("\n", stderr);
+        bench.open = 0;
+}
+
+/*
+ * Start the result of the benchmark "name".  Its metrics follow.
+ */
+void
+bench_result(const char *name)
+{
+
+        closeresult();
+        fprintf(bench.out, "%s\n  {\"name\": \"%s\"", bench.nresults++ ? ",":
+            "", name);
+        fprintf(stderr, "%-24s", name);
+        bench.open = 1;
+}
+
+void
+bench_metric(const char *key, double val)
+{
+
+        fprintf(bench.out, ", \"%s\": %.15g", key, val);
+        fprintf(stderr, " %s=%.6g", key, val);
+}
+
+/*
+ * Run "fn" with a number of operations growing until they take the
+ * minimum time, and report the time per operation.  An operation
+ * processing "bytes" bytes gets its throughput reported too.
+ */
+void
+bench_run(const char *name, benchfn_t fn, void *arg, double bytes)
+{
+        double elapsed;
+        double start;
+        long n;
+
+        if (!bench_selected(name))
+                return;
+
+        fn(arg, 1);             /* warm up */
+        for (n = 1; ; n *= elapsed * 10 < bench.mintime ? 10: 2) {
+                start = bench_now();
+                fn(arg, n);
+                if ((elapsed = bench_now() - start) >= bench.mintime)
+                        break;
+        }
+
+        bench_result(name);
+        bench_metric("iterations", n);
+        bench_metric("ns_per_op", elapsed / n * 1e9);
+        bench_metric("ops_per_sec", n / elapsed);
+        if (bytes > 0)
+                bench_metric("mb_per_sec", bytes * n / elapsed / 1e6);
+}
+
+/*
+ * End the output of the suite.
+ *
+ * Return the exit status of the program.
+ */
+int
+bench_end(void)
+{
+
+        closeresult();
+        fputs("\n]}\n", bench.out);
+        if (fclose(bench.out) == EOF) {
+                perror("bench");
+                return (1);
+        }
+        return (0);
+}
+
+/*
+ * Remove the temporary directory "dir" along with its files.
+ */
+void
+bench_rmtmp(const char *dir)
+{
+        char path[PATH_MAX];
+        struct dirent *de;
+        DIR *dp;
+        int n;
+
+        if ((dp = opendir(dir)) == NULL) {
+                warn("%s", dir);
+                return;
+        }
+        while ((de = readdir(dp)) != NULL) {
+                if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+                        continue;
+                n = snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+                if (n >= 0 && (size_t)n < sizeof(path))
+                        unlink(path);
+        }
+        closedir(dp);
+        if (rmdir(dir) == -1)
+                warn("%s", dir);
+}
@@ -0,0 +1,19 @@
+#ifndef ISH_BENCH_H_
+#define ISH_BENCH_H_
+
+/*
+ * A benchmark runs "n" operations of its kind each time it's called.
+ */
+typedef void (*benchfn_t)(void *, long);
+
+extern double bench_now(void);
+extern void bench_init(int, char **, const char *, const char *,
+    int (*)(int, char *), const char *);
+extern _Bool bench_selected(const char *);
+extern void bench_run(const char *, benchfn_t, void *, double);
+extern void bench_result(const char *);
+extern void bench_metric(const char *, double);
+extern int bench_end(void);
+extern void bench_rmtmp(const char *);
+
+#endif  /* !ISH_BENCH_H_ */
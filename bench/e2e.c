@@ -0,0 +1,481 @@
+#define _GNU_SOURCE
+
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "err.h"
+
+#define MAXSHELLS	8
+#define MAXMETRICS	128
+#define NCMDS		2000    /* default commands of the workloads */
+#define VOLUME		512     /* default MB through the big pipeline */
+#define REPEAT		3       /* runs of each workload, the best is kept */
+#define THRESHOLD	10      /* default % of a regression */
+#define PATHSETUP_CSH	"setenv PATH /usr/bin:/bin\n"
+#define PATHSETUP_SH	"PATH=/usr/bin:/bin; export PATH\n"
+
+/*
+ * End-to-end benchmarks of the shell run on generated scripts, each
+ * run with the other shells found for comparison.  Only the first
+ * shell is compared with the baseline.
+ */
+typedef struct shell {
+        const char *path;
+        const char *name;
+        _Bool csh;              /* csh syntax */
+} shell_t;
+
+typedef struct metric {
+        char name[64];          /* "shell/workload metric" */
+        double val;
+} metric_t;
+
+static struct {
+        shell_t shells[MAXSHELLS];
+        int nshells;
+        int ncmds;
+        int volume;
+        const char *baseline;   /* compared with */
+        const char *save;       /* written */
+        double threshold;
+        char dir[PATH_MAX];     /* of the scripts */
+        char self[PATH_MAX];
+        metric_t metrics[MAXMETRICS];
+        int nmetrics;
+        const char *result;     /* current */
+} e2e;
+
+static int
+option(int c, char *arg)
+{
+
+        switch (c) {
+        case 'b':
+                e2e.baseline = arg;
+                return (0);
+        case 'B':
+                e2e.save = arg;
+                return (0);
+        case 'm':
+                return ((e2e.volume = atoi(arg)) > 0 ? 0: -1);
+        case 'n':
+                return ((e2e.ncmds = atoi(arg)) > 0 ? 0: -1);
+        case 'r':
+                return ((e2e.threshold = atof(arg)) > 0 ? 0: -1);
+        case 's':
+                if (e2e.nshells == MAXSHELLS)
+                        return (-1);
+                e2e.shells[e2e.nshells++].path = arg;
+                return (0);
+        default:
+                return (-1);
+        }
+}
+
+static void
+addshell(const char *path)
+{
+        shell_t *sh;
+
+        for (int i = 0; i < e2e.nshells; i++)
+                if (!strcmp(e2e.shells[i].path, path))
+                        return;
+        if (e2e.nshells == MAXSHELLS || access(path, X_OK) == -1)
+                return;
+        sh = &e2e.shells[e2e.nshells++];
+        sh->path = path;
+}
+
+static void
+result(const char *name)
+{
+
+        e2e.result = name;
+        bench_result(name);
+}
+
+/*
+ * Report a metric of the current result, and keep it for the baseline.
+ */
+static void
+metric(const char *name, double val)
+{
+        metric_t *m;
+
+        bench_metric(name, val);
+        if (e2e.nmetrics == MAXMETRICS)
+                return;
+        m = &e2e.metrics[e2e.nmetrics++];
+        snprintf(m->name, sizeof(m->name), "%s %s", e2e.result, name);
+        m->val = val;
+}
+
+/*
+ * Write a script of "n" times "line", after the PATH setup.
+ */
+static char *
+script(const shell_t *sh, const char *name, const char *line, int n,
+    const char *end)
+{
+        static char path[PATH_MAX + 64];
+        FILE *fp;
+
+        snprintf(path, sizeof(path), "%s/%s.%s", e2e.dir, name, sh->name);
+        if ((fp = fopen(path, "w")) == NULL)
+                err_sys("%s", path);
+        fputs(sh->csh ? PATHSETUP_CSH: PATHSETUP_SH, fp);
+        for (int i = 0; i < n; i++)
+                fputs(line, fp);
+        if (end)
+                fputs(end, fp);
+        if (fclose(fp) == EOF)
+                err_sys("%s", path);
+
+        return (path);
+}
+
+/*
+ * Run the script with the shell, with the directory of the scripts as
+ * home and current directory so that no startup file is read.
+ *
+ * Return the best wall time of REPEAT runs, and the peak RSS of the
+ * shell in "*rssp", which includes its commands: wait4() tells no
+ * better.
+ */
+static double
+run(const shell_t *sh, const char *path, long *rssp)
+{
+        struct rusage ru;
+        double best;
+        double start;
+        double t;
+        int status;
+        pid_t pid;
+        int fd;
+
+        best = 0;
+        *rssp = 0;
+        for (int i = 0; i < REPEAT; i++) {
+                start = bench_now();
+                if ((pid = fork()) == -1)
+                        err_sys("fork");
+                if (pid == 0) {
+                        if (chdir(e2e.dir) == -1 ||
+                            (fd = open("/dev/null", O_RDWR)) == -1)
+                                _exit(127);
+                        dup2(fd, STDIN_FILENO);
+                        dup2(fd, STDOUT_FILENO);
+                        setenv("HOME", e2e.dir, 1);
+                        if (sh->csh && strcmp(sh->name, "ish"))
+                                execl(sh->path, sh->path, "-f", path,
+                                    (char *)NULL);
+                        else
+                                execl(sh->path, sh->path, path, (char *)NULL);
+                        _exit(127);
+                }
+                if (wait4(pid, &status, 0, &ru) == -1)
+                        err_sys("wait4");
+                t = bench_now() - start;
+                if (!WIFEXITED(status) || WEXITSTATUS(status) == 127)
+                        fprintf(stderr, "%s: %s failed\n", sh->path, path);
+                if (i == 0 || t < best)
+                        best = t;
+                if (ru.ru_maxrss > *rssp)
+                        *rssp = ru.ru_maxrss;
+        }
+
+        return (best);
+}
+
+static void
+runcmds(const shell_t *sh, const char *name, const char *line, int n,
+    const char *end)
+{
+        char res[64];
+        long rss;
+        double t;
+
+        t = run(sh, script(sh, name, line, n, end), &rss);
+        snprintf(res, sizeof(res), "%s/%s", sh->name, name);
+        result(res);
+        metric("cmds_per_sec", n / t);
+        metric("max_rss_kb", rss);
+}
+
+static int
+cmpdouble(const void *p1, const void *p2)
+{
+        double d1 = *(const double *)p1;
+        double d2 = *(const double *)p2;
+
+        return (d1 < d2 ? -1: d1 > d2);
+}
+
+/*
+ * Measure the latency of each command: each one appends the time it
+ * starts at to a file, so that the delay between two of them is the
+ * time the shell takes to start the next command, plus the run of
+ * the command itself.
+ */
+static void
+latency(const shell_t *sh)
+{
+        char stamps[PATH_MAX + 16];
+        char line[2 * PATH_MAX + 32];
+        char res[64];
+        double *delays;
+        long long ns;
+        long long prev;
+        FILE *fp;
+        long rss;
+        int n;
+
+        snprintf(stamps, sizeof(stamps), "%s/stamps", e2e.dir);
+        snprintf(line, sizeof(line), "%s -T >> %s\n", e2e.self, stamps);
+        unlink(stamps);
+        run(sh, script(sh, "latency", line, e2e.ncmds, NULL), &rss);
+
+        if ((fp = fopen(stamps, "r")) == NULL)
+                err_sys("%s", stamps);
+        delays = malloc(REPEAT * e2e.ncmds * sizeof(*delays));
+        if (delays == NULL)
+                err_sys("malloc");
+        n = 0;
+        prev = -1;
+        while (fscanf(fp, "%lld", &ns) == 1) {
+                if (prev != -1 && ns > prev && n < REPEAT * e2e.ncmds)
+                        delays[n++] = (ns - prev) / 1e3;
+                prev = ns;
+        }
+        fclose(fp);
+        unlink(stamps);
+        if (n == 0) {
+                free(delays);
+                return;
+        }
+        qsort(delays, n, sizeof(*delays), cmpdouble);
+
+        snprintf(res, sizeof(res), "%s/latency", sh->name);
+        result(res);
+        metric("p50_us", delays[n / 2]);
+        metric("p99_us", delays[n * 99 / 100]);
+        free(delays);
+}
+
+/*
+ * Run pipelines of "nstages" stages.
+ */
+static void
+pipelines(const shell_t *sh, int nstages)
+{
+        char name[32];
+        char res[64];
+        char *line;
+        size_t len;
+        long rss;
+        double t;
+        int n;
+
+        len = strlen("echo x") + nstages * strlen(" | cat") + 16;
+        if ((line = malloc(len)) == NULL)
+                err_sys("malloc");
+        strcpy(line, "echo x");
+        for (int i = 1; i < nstages; i++)
+                strcat(line, " | cat");
+        strcat(line, " > /dev/null\n");
+
+        n = e2e.ncmds / nstages > 10 ? e2e.ncmds / nstages: 10;
+        snprintf(name, sizeof(name), "pipeline%d", nstages);
+        t = run(sh, script(sh, name, line, n, NULL), &rss);
+        snprintf(res, sizeof(res), "%s/%s", sh->name, name);
+        result(res);
+        metric("pipelines_per_sec", n / t);
+        metric("max_rss_kb", rss);
+        free(line);
+}
+
+/*
+ * Move a large volume of data through a pipeline.  The middle stages
+ * are dd, which the shell can't optimize away like cat.
+ */
+static void
+volume(const shell_t *sh)
+{
+        char line[128];
+        char res[64];
+        long rss;
+        double t;
+
+        snprintf(line, sizeof(line), "head -c %dM /dev/zero | dd bs=128k "
+            "status=none | dd bs=128k status=none > /dev/null\n", e2e.volume);
+        t = run(sh, script(sh, "volume", line, 1, NULL), &rss);
+        snprintf(res, sizeof(res), "%s/volume", sh->name);
+        result(res);
+        metric("mb_per_sec", e2e.volume * 1.048576 / t);
+        metric("max_rss_kb", rss);
+}
+
+static void
+runshell(const shell_t *sh)
+{
+        static const int nstages[] = {2, 8, 32, 64};
+
+        if (bench_selected("spawn"))
+                runcmds(sh, "spawn", "/bin/true\n", e2e.ncmds, NULL);
+        if (bench_selected("background"))
+                runcmds(sh, "background", "true &\n", e2e.ncmds,
+                    sh->csh ? NULL: "wait\n");
+        if (bench_selected("builtins"))
+                runcmds(sh, "builtins", "echo hello > /dev/null\ncd /\n"
+                    "cd /tmp\n", e2e.ncmds / 3, NULL);
+        if (bench_selected("latency"))
+                latency(sh);
+        if (bench_selected("pipeline"))
+                for (size_t i = 0; i < sizeof(nstages)/sizeof(*nstages); i++)
+                        pipelines(sh, nstages[i]);
+        if (bench_selected("volume"))
+                volume(sh);
+}
+
+/*
+ * Return true if a bigger value of the metric is better.
+ */
+static _Bool
+higherbetter(const char *name)
+{
+
+        return (strstr(name, "_per_sec") != NULL);
+}
+
+/*
+ * Compare the metrics of the first shell with the baseline.
+ *
+ * Return the number of regressions: metrics worse by more than the
+ * threshold.
+ */
+static int
+compare(const char *path)
+{
+        char name[64];
+        char line[256];
+        double base;
+        double diff;
+        FILE *fp;
+        int n;
+
+        if ((fp = fopen(path, "r")) == NULL) {
+                fprintf(stderr, "no baseline: %s: %s\n", path,
+                    strerror(errno));
+                return (0);
+        }
+        n = 0;
+        while (fgets(line, sizeof(line), fp) != NULL) {
+                char *sp = strrchr(line, ' ');
+                if (sp == NULL || sp - line >= (int)sizeof(name))
+                        continue;
+                memcpy(name, line, sp - line);
+                name[sp - line] = '\0';
+                base = atof(sp + 1);
+                for (int i = 0; i < e2e.nmetrics; i++) {
+                        const metric_t *m = &e2e.metrics[i];
+                        if (strcmp(m->name, name) || base == 0)
+                                continue;
+                        diff = (m->val - base) / base * 100;
+                        if (higherbetter(name))
+                                diff = -diff;
+                        if (diff > e2e.threshold) {
+                                fprintf(stderr, "regression: %s: %.6g -> "
+                                    "%.6g (%+.1f%%)\n", name, base, m->val,
+                                    higherbetter(name) ? -diff: diff);
+                                n++;
+                        }
+                }
+        }
+        fclose(fp);
+
+        return (n);
+}
+
+static void
+save(const char *path)
+{
+        size_t len;
+        FILE *fp;
+
+        if ((fp = fopen(path, "w")) == NULL)
+                err_sys("%s", path);
+        len = strlen(e2e.shells[0].name);
+        for (int i = 0; i < e2e.nmetrics; i++)
+                if (!strncmp(e2e.metrics[i].name, e2e.shells[0].name, len) &&
+                    e2e.metrics[i].name[len] == '/')
+                        fprintf(fp, "%s %.6g\n", e2e.metrics[i].name,
+                            e2e.metrics[i].val);
+        if (fclose(fp) == EOF)
+                err_sys("%s", path);
+}
+
+int
+main(int argc, char *argv[])
+{
+        struct timespec ts;
+        const char *base;
+        ssize_t len;
+        int status;
+
+        /* The command of the latency workload. */
+        if (argc == 2 && !strcmp(argv[1], "-T")) {
+                clock_gettime(CLOCK_MONOTONIC, &ts);
+                printf("%lld\n", (long long)ts.tv_sec * 1000000000 +
+                    ts.tv_nsec);
+                return (0);
+        }
+
+        e2e.ncmds = NCMDS;
+        e2e.volume = VOLUME;
+        e2e.threshold = THRESHOLD;
+        bench_init(argc, argv, "e2e", "b:B:m:n:r:s:", option,
+            "[-s shell] [-n count] [-m MB] [-b baseline] [-B baseline] "
+            "[-r percent] ");
+        if (e2e.nshells == 0)
+                addshell("./ish");
+        addshell("/bin/sh");
+        addshell("/bin/csh");
+        for (int i = 0; i < e2e.nshells; i++) {
+                shell_t *sh = &e2e.shells[i];
+                base = strrchr(sh->path, '/');
+                sh->name = base ? base + 1: sh->path;
+                sh->csh = strstr(sh->name, "csh") || !strcmp(sh->name, "ish");
+        }
+
+        if ((len = readlink("/proc/self/exe", e2e.self,
+            sizeof(e2e.self) - 1)) == -1)
+                err_sys("/proc/self/exe");
+        e2e.self[len] = '\0';
+        snprintf(e2e.dir, sizeof(e2e.dir), "/tmp/ish-e2e.XXXXXX");
+        if (mkdtemp(e2e.dir) == NULL)
+                err_sys("mkdtemp");
+
+        for (int i = 0; i < e2e.nshells; i++)
+                runshell(&e2e.shells[i]);
+
+        status = bench_end();
+        bench_rmtmp(e2e.dir);
+        if (e2e.save)
+                save(e2e.save);
+        if (e2e.baseline && compare(e2e.baseline) > 0)
+                status = 1;
+
+        return (status);
+}
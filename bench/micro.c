@@ -0,0 +1,254 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "array.h"
+#include "bench.h"
+#include "cmd.h"
+#include "env.h"
+#include "err.h"
+#include "jobs.h"
+#include "main.h"
+#include "utils.h"
+
+#define PARSELINES	10000   /* lines of the parsed input */
+#define NVARS		10000   /* variables of the environment benchmarks */
+#define JOBBATCH	64      /* jobs alive at once in the job table */
+#define ARRAYLEN	1024    /* elements appended to each array */
+
+extern cmd_t *root;
+extern int yyparse(void);
+extern void yyrestart(FILE *);
+
+/*
+ * Micro-benchmarks of the modules of the shell, linked with its objects
+ * but not with main.o: nothing is ever run.
+ */
+void
+evalstr(const char *s)
+{
+
+        UNUSED(s);
+}
+
+typedef struct input {
+        char *buf;
+        size_t len;
+} input_t;
+
+/*
+ * Return "nlines" lines of commands of all the kinds the parser knows.
+ */
+static input_t *
+mkinput(int nlines)
+{
+        static const char *lines[] = {
+                "ls -l /usr/share/doc%d\n",
+                "grep -v pattern%d file.txt | sort -n | uniq -c > out%d.txt\n",
+                "cc -O2 -c src%d.c -o obj%d.o ; echo done ; true\n",
+                "find . -name *.c |*4 wc -l >>& errors%d.log &\n",
+                "cat big%d.log |+ wc -l |+ md5sum | tr a-z A-Z\n",
+                "setenv PATH /usr/local/bin:/usr/bin:/bin%d\n",
+                "tr a-z A-Z <<< herestring%d\n",
+                "sed s/a/b/ < in%d.txt >> out%d.txt ; cd /tmp\n",
+        };
+        input_t *in;
+        FILE *fp;
+
+        in = malloc_or_die(sizeof(*in));
+        if ((fp = open_memstream(&in->buf, &in->len)) == NULL)
+                err_sys("open_memstream");
+        for (int i = 0; i < nlines; i++)
+                fprintf(fp, lines[i % (sizeof(lines)/sizeof(lines[0]))], i, i);
+        fclose(fp);
+
+        return (in);
+}
+
+/*
+ * Return the first command line of "s", parsed.
+ */
+static cmd_t *
+parse(const char *s)
+{
+        cmd_t *c;
+        FILE *fp;
+
+        if ((fp = fmemopen((void *)s, strlen(s), "r")) == NULL)
+                err_sys("fmemopen");
+        root = NULL;
+        yyrestart(fp);
+        while (yyparse(), root == NULL)
+                continue;
+        if (root == (void *)-1)
+                err_quit("can't parse: %s", s);
+        c = root;
+        root = NULL;
+        fclose(fp);
+
+        return (c);
+}
+
+static void
+bench_parse(void *arg, long n)
+{
+        input_t *in = arg;
+        FILE *fp;
+
+        while (n-- > 0) {
+                if ((fp = fmemopen(in->buf, in->len, "r")) == NULL)
+                        err_sys("fmemopen");
+                root = NULL;
+                yyrestart(fp);
+                for (;;) {
+                        yyparse();
+                        if (root == (void *)-1)
+                                break;
+                        cmd_free(root);
+                        root = NULL;
+                }
+                fclose(fp);
+        }
+}
+
+static void
+bench_cmdstr(void *arg, long n)
+{
+
+        while (n-- > 0)
+                free(cmd_str(arg));
+}
+
+static void
+bench_args(void *arg, long n)
+{
+        char **argv;
+        int argc;
+
+        while (n-- > 0) {
+                argv = cmd_args(arg, &argc);
+                cmd_freeargs(argv);
+        }
+}
+
+static void
+bench_envset(void *arg, long n)
+{
+        char name[16];
+
+        UNUSED(arg);
+        for (long i = 0; i < n; i++) {
+                snprintf(name, sizeof(name), "VAR%05ld", i % NVARS);
+                env_set(name, "value");
+        }
+}
+
+static void
+bench_envget(void *arg, long n)
+{
+        char name[16];
+
+        UNUSED(arg);
+        for (long i = 0; i < n; i++) {
+                snprintf(name, sizeof(name), "VAR%05ld", i * 7919 % NVARS);
+                if (env_get(name) == NULL)
+                        err_quit("%s not set", name);
+        }
+}
+
+static void
+bench_execargs(void *arg, long n)
+{
+        char **envp;
+
+        UNUSED(arg);
+        while (n-- > 0) {
+                envp = env_execargs();
+                for (char **p = envp; *p; p++)
+                        free(*p);
+                free(envp);
+        }
+}
+
+/*
+ * Fill arrays of ARRAYLEN elements, growing from empty.
+ */
+static void
+bench_append(void *arg, long n)
+{
+        array_t *a;
+
+        while (n > 0) {
+                a = array_new();
+                for (int i = 0; i < ARRAYLEN && n > 0; i++, n--)
+                        array_append(a, arg);
+                free(array_detach(a));
+        }
+}
+
+/*
+ * Make and free batches of jobs: the table grows while they're made,
+ * and shrinks when the jobs are reaped.  As the table moves when it
+ * grows, the jobs are found from the last one made, which is the first
+ * of the list.
+ */
+static void
+bench_jobs(void *arg, long n)
+{
+        long ids[JOBBATCH];
+        job_t *last;
+        int m;
+
+        UNUSED(arg);
+        while (n > 0) {
+                m = n < JOBBATCH ? n: JOBBATCH;
+                for (int i = 0; i < m; i++)
+                        last = makejob(1 + i % 3, strdup_or_die("true"));
+                m = jobids(ids, JOBBATCH);
+                for (int i = m - 1; i >= 0; i--)
+                        freejob(last + ids[i] - ids[0]);
+                reapjobs(1);
+                n -= m;
+        }
+}
+
+int
+main(int argc, char *argv[])
+{
+        input_t *in;
+        cmd_t *pipeline;
+        cmd_t *words;
+
+        bench_init(argc, argv, "micro", NULL, NULL, NULL);
+
+        if (bench_selected("parse")) {
+                in = mkinput(PARSELINES);
+                bench_run("parse", bench_parse, in, in->len);
+        }
+        if (bench_selected("cmd_str")) {
+                pipeline = parse("cat a b c | grep -v x > /dev/null | "
+                    "sort -r -n |*4 tr a-z A-Z |+ wc -l |& tee out.log >> "
+                    "all.log &\n");
+                bench_run("cmd_str", bench_cmdstr, pipeline, 0);
+        }
+        if (bench_selected("create_args")) {
+                env_set("HOME", "/home/user");
+                env_set("USER", "user");
+                words = parse("echo $HOME/a $USER-b c d e f g h i j k l m n "
+                    "o p ${HOME}/bin $USER.$HOME\n");
+                bench_run("create_args", bench_args, words, 0);
+        }
+
+        bench_run("array_append", bench_append, &argc, 0);
+        bench_run("job_churn", bench_jobs, NULL, 0);
+
+        /* Last, as they leave NVARS variables behind them. */
+        bench_envset(NULL, NVARS);
+        bench_run("env_set", bench_envset, NULL, 0);
+        bench_run("env_get", bench_envget, NULL, 0);
+        bench_run("env_execargs", bench_execargs, NULL, 0);
+
+        return (bench_end());
+}
@@ -0,0 +1,510 @@
+#define _GNU_SOURCE
+
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/ptrace.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "err.h"
+
+#define NCYCLES		200     /* default prompt cycles of each step */
+#define TIMEOUT		5000    /* ms waited for the shell */
+#define NOTIFYWAIT	100     /* ms given to an asynchronous notification */
+#define SETTLE		5       /* ms without syscall ending a cycle */
+#define MAXOUT		65536   /* output of the shell kept */
+#define READY		"ready\r\n"
+#define DONE		"Done\t"
+
+#ifndef CTRL
+#define CTRL(c)		((c) & 037)
+#endif
+
+/*
+ * Interactive benchmarks of the shell run on a pseudo-terminal, as a
+ * user would: each step types a line and measures the time from the
+ * key ending it to the next prompt.
+ *
+ * The prompt is recognized by the line editor drawing it on an empty
+ * line: "\r", the prompt and the erasure of the rest of the line.
+ *
+ * With -c, the shell is traced to count its syscalls by a process in
+ * between, which makes it much slower: the latencies of that run are
+ * only indicative.
+ */
+typedef struct step {
+        const char *name;
+        double *lat;            /* us */
+        long *nsys;
+        int n;
+} step_t;
+
+static step_t steps[] = {
+        {"prompt"}, {"builtin"}, {"fg"}, {"pipeline"}, {"bg"},
+        {"suspend"}, {"resume"}, {"interrupt"}, {"notify"},
+};
+
+#define NSTEPS		(sizeof(steps)/sizeof(steps[0]))
+
+static struct {
+        const char *shell;
+        char marker[_POSIX_HOST_NAME_MAX + 16];
+        int ncycles;
+        _Bool count;
+        int master;
+        pid_t pid;              /* the shell, or its tracer */
+        volatile long *nsys;    /* syscalls of the shell */
+        char out[MAXOUT];
+        size_t outlen;
+        char dir[PATH_MAX];
+        char self[PATH_MAX];
+        int nasync;             /* notifications made at once */
+} pty;
+
+static int
+option(int c, char *arg)
+{
+
+        switch (c) {
+        case 'c':
+                pty.count = 1;
+                return (0);
+        case 'n':
+                return ((pty.ncycles = atoi(arg)) > 0 ? 0: -1);
+        case 'p':
+                if (strlen(arg) >= sizeof(pty.marker))
+                        return (-1);
+                strcpy(pty.marker, arg);
+                return (0);
+        case 's':
+                pty.shell = arg;
+                return (0);
+        default:
+                return (-1);
+        }
+}
+
+static step_t *
+getstep(const char *name)
+{
+
+        for (size_t i = 0; i < NSTEPS; i++)
+                if (!strcmp(steps[i].name, name))
+                        return (&steps[i]);
+        err_quit("no step %s", name);
+        return (NULL);
+}
+
+/*
+ * Tell the harness that the command runs, or runs again.
+ */
+static void
+oncont(int signo)
+{
+
+        (void)signo;
+        write(STDOUT_FILENO, "ready\n", 6);
+}
+
+/*
+ * A foreground command waiting to be stopped, continued and
+ * interrupted, telling when it's ready for each.
+ */
+static void
+waitsignals(void)
+{
+
+        signal(SIGCONT, oncont);
+        oncont(0);
+        alarm(TIMEOUT / 1000 * 2);
+        for (;;)
+                pause();
+}
+
+static void
+send(const char *s, size_t len)
+{
+        ssize_t n;
+
+        for (; len > 0; s += n, len -= n)
+                if ((n = write(pty.master, s, len)) == -1)
+                        err_sys("write");
+}
+
+/*
+ * Wait up to "ms" ms for "s" in the output of the shell, and drop the
+ * output up to it.
+ *
+ * Return the time it was read at, or -1 on timeout.
+ */
+static double
+expect(const char *s, int ms)
+{
+        struct pollfd pfd;
+        double deadline;
+        size_t len;
+        ssize_t n;
+        char *p;
+        int left;
+
+        len = strlen(s);
+        deadline = bench_now() + ms / 1e3;
+        for (;;) {
+                if ((p = memmem(pty.out, pty.outlen, s, len)) != NULL) {
+                        p += len;
+                        pty.outlen -= p - pty.out;
+                        memmove(pty.out, p, pty.outlen);
+                        return (bench_now());
+                }
+                if (pty.outlen > MAXOUT / 2) {
+                        /* Keep what could start a match. */
+                        memmove(pty.out, pty.out + pty.outlen - len,
+                            len);
+                        pty.outlen = len;
+                }
+
+                if ((left = (deadline - bench_now()) * 1e3) < 0)
+                        return (-1);
+                pfd.fd = pty.master;
+                pfd.events = POLLIN;
+                if ((n = poll(&pfd, 1, left)) == -1 && errno != EINTR)
+                        err_sys("poll");
+                if (n <= 0)
+                        continue;
+                n = read(pty.master, pty.out + pty.outlen,
+                    sizeof(pty.out) - pty.outlen);
+                if (n == -1 && errno != EINTR)
+                        err_quit("the shell has exited");
+                if (n > 0)
+                        pty.outlen += n;
+        }
+}
+
+static double
+waitfor(const char *s, const char *what)
+{
+        double t;
+
+        if ((t = expect(s, TIMEOUT)) == -1)
+                err_quit("timeout waiting for %s", what);
+        return (t);
+}
+
+/*
+ * Return the number of syscalls of the shell once it hasn't made any
+ * for a while, which means it's waiting.
+ */
+static long
+settle(void)
+{
+        long n;
+
+        if (!pty.count)
+                return (0);
+        do {
+                n = *pty.nsys;
+                usleep(SETTLE * 1000);
+        } while (*pty.nsys != n);
+
+        return (n);
+}
+
+static void
+record(step_t *sp, double start, double end, long nsys)
+{
+
+        sp->lat[sp->n] = (end - start) * 1e6;
+        sp->nsys[sp->n] = nsys;
+        sp->n++;
+}
+
+/*
+ * Type "keys" and measure the time until "s" is printed, after "skip"
+ * if it isn't NULL.
+ */
+static void
+measure(const char *name, const char *keys, const char *skip, const char *s)
+{
+        double start;
+        long nsys;
+
+        nsys = settle();
+        start = bench_now();
+        send(keys, strlen(keys));
+        if (skip)
+                waitfor(skip, name);
+        record(getstep(name), start, waitfor(s, name), settle() - nsys);
+}
+
+/*
+ * Run a command line, ended by the return key.  The editor draws the
+ * line a last time before the end of line it echoes, which looks like
+ * a prompt if the line is empty.
+ */
+static void
+cycle(const char *name, const char *line)
+{
+
+        send(line, strlen(line));
+        measure(name, "\r", "\r\n", pty.marker);
+}
+
+/*
+ * Stop a foreground command, continue it and interrupt it, which runs
+ * through the job control of the shell.
+ */
+static void
+stopcont(void)
+{
+        char line[PATH_MAX + 8];
+
+        snprintf(line, sizeof(line), "%s -W\r", pty.self);
+        send(line, strlen(line));
+        waitfor(READY, "the command to stop");
+        measure("suspend", (char []){CTRL('Z'), '\0'}, NULL, pty.marker);
+        measure("resume", "fg\r", "\r\n", READY);
+        measure("interrupt", (char []){CTRL('C'), '\0'}, NULL, pty.marker);
+}
+
+/*
+ * Measure the delay between the end of a background job and its
+ * report, which comes with the next prompt at worst: the return key
+ * is hit if the report doesn't come first.
+ */
+static void
+notify(void)
+{
+        char path[PATH_MAX + 16];
+        char line[2 * PATH_MAX + 32];
+        long long ns;
+        double t;
+        FILE *fp;
+
+        snprintf(path, sizeof(path), "%s/stamps", pty.dir);
+        snprintf(line, sizeof(line), "%s -T > %s &\r", pty.self, path);
+        send(line, strlen(line));
+        if ((t = expect(DONE, NOTIFYWAIT)) != -1)
+                pty.nasync++;
+        else {
+                send("\r", 1);
+                t = waitfor(DONE, "the notification");
+        }
+        waitfor(pty.marker, "the prompt after the notification");
+
+        if ((fp = fopen(path, "r")) == NULL)
+                err_sys("%s", path);
+        if (fscanf(fp, "%lld", &ns) != 1)
+                err_quit("%s: no stamp", path);
+        fclose(fp);
+        record(getstep("notify"), ns / 1e9, t, 0);
+}
+
+/*
+ * Count the syscalls of the shell, the child being traced.
+ */
+static void
+trace(pid_t pid)
+{
+        _Bool entering;
+        int status;
+        int signo;
+
+        if (waitpid(pid, &status, 0) == -1 || !WIFSTOPPED(status))
+                _exit(1);
+        ptrace(PTRACE_SETOPTIONS, pid, 0, PTRACE_O_TRACESYSGOOD |
+            PTRACE_O_TRACEEXEC | PTRACE_O_EXITKILL);
+        signo = 0;
+        entering = 1;
+        for (;;) {
+                if (ptrace(PTRACE_SYSCALL, pid, 0, signo) == -1 ||
+                    waitpid(pid, &status, 0) == -1)
+                        _exit(1);
+                if (WIFEXITED(status) || WIFSIGNALED(status))
+                        _exit(0);
+                signo = 0;
+                if (WSTOPSIG(status) == (SIGTRAP | 0x80)) {
+                        if (entering)
+                                (*pty.nsys)++;
+                        entering = !entering;
+                } else if (status >> 16 == 0)
+                        signo = WSTOPSIG(status);       /* not an exec */
+        }
+}
+
+/*
+ * Start the shell on a new terminal, as the leader of its session, or
+ * as the child of the tracer.
+ */
+static void
+spawn(void)
+{
+        struct winsize ws = {.ws_row = 24, .ws_col = 80};
+        char path[PATH_MAX + 16];
+        const char *slave;
+        pid_t pid;
+        int fd;
+
+        if ((pty.master = posix_openpt(O_RDWR | O_NOCTTY)) == -1 ||
+            grantpt(pty.master) == -1 || unlockpt(pty.master) == -1 ||
+            (slave = ptsname(pty.master)) == NULL)
+                err_sys("posix_openpt");
+        pty.nsys = mmap(NULL, sizeof(*pty.nsys), PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (pty.nsys == MAP_FAILED)
+                err_sys("mmap");
+
+        if ((pty.pid = fork()) == -1)
+                err_sys("fork");
+        if (pty.pid > 0)
+                return;
+
+        if (setsid() == -1)
+                err_sys("setsid");
+        if ((fd = open(slave, O_RDWR)) == -1 || ioctl(fd, TIOCSCTTY, 0) == -1)
+                err_sys("%s", slave);
+        ioctl(fd, TIOCSWINSZ, &ws);
+        dup2(fd, STDIN_FILENO);
+        dup2(fd, STDOUT_FILENO);
+        dup2(fd, STDERR_FILENO);
+        close(fd);
+        close(pty.master);
+        snprintf(path, sizeof(path), "%s/history", pty.dir);
+        setenv("ISH_HISTFILE", path, 1);
+        setenv("HOME", pty.dir, 1);
+        setenv("TERM", "dumb", 1);
+        if (chdir(pty.dir) == -1)
+                err_sys("%s", pty.dir);
+
+        if (pty.count) {
+                if ((pid = fork()) == -1)
+                        err_sys("fork");
+                if (pid > 0) {
+                        signal(SIGHUP, SIG_IGN);
+                        trace(pid);
+                }
+                if (ptrace(PTRACE_TRACEME, 0, 0, 0) == -1)
+                        err_sys("ptrace");
+        }
+        execl(pty.shell, pty.shell, (char *)NULL);
+        err_sys("%s", pty.shell);
+}
+
+static int
+cmpdouble(const void *p1, const void *p2)
+{
+        double d1 = *(const double *)p1;
+        double d2 = *(const double *)p2;
+
+        return (d1 < d2 ? -1: d1 > d2);
+}
+
+static void
+report(step_t *sp)
+{
+        double nsys;
+
+        if (sp->n == 0 || !bench_selected(sp->name))
+                return;
+        nsys = 0;
+        for (int i = 0; i < sp->n; i++)
+                nsys += sp->nsys[i];
+        qsort(sp->lat, sp->n, sizeof(*sp->lat), cmpdouble);
+
+        bench_result(sp->name);
+        bench_metric("p50_us", sp->lat[sp->n / 2]);
+        bench_metric("p99_us", sp->lat[sp->n * 99 / 100]);
+        bench_metric("max_us", sp->lat[sp->n - 1]);
+        if (pty.count && strcmp(sp->name, "notify"))
+                bench_metric("syscalls", nsys / sp->n);
+        if (!strcmp(sp->name, "notify"))
+                bench_metric("async_pct", 100.0 * pty.nasync / sp->n);
+}
+
+int
+main(int argc, char *argv[])
+{
+        struct timespec ts;
+        char host[_POSIX_HOST_NAME_MAX + 1];
+        ssize_t len;
+        int status;
+
+        /* The commands run by the shell. */
+        if (argc == 2 && !strcmp(argv[1], "-T")) {
+                clock_gettime(CLOCK_MONOTONIC, &ts);
+                printf("%lld\n", (long long)ts.tv_sec * 1000000000 +
+                    ts.tv_nsec);
+                return (0);
+        }
+        if (argc == 2 && !strcmp(argv[1], "-W"))
+                waitsignals();
+
+        pty.shell = "./ish";
+        pty.ncycles = NCYCLES;
+        bench_init(argc, argv, "pty", "cn:p:s:", option,
+            "[-c] [-n count] [-p prompt] [-s shell] ");
+        if (pty.marker[0] == '\0') {
+                if (gethostname(host, sizeof(host)) == -1)
+                        err_sys("gethostname");
+                host[sizeof(host) - 1] = '\0';
+                snprintf(pty.marker, sizeof(pty.marker), "\r%s%% \x1b[K",
+                    host);
+        }
+        if ((len = readlink("/proc/self/exe", pty.self,
+            sizeof(pty.self) - 1)) == -1)
+                err_sys("/proc/self/exe");
+        pty.self[len] = '\0';
+        if (pty.shell[0] != '/' && realpath(pty.shell, pty.dir) != NULL)
+                pty.shell = strdup(pty.dir);
+        snprintf(pty.dir, sizeof(pty.dir), "/tmp/ish-pty.XXXXXX");
+        if (mkdtemp(pty.dir) == NULL)
+                err_sys("mkdtemp");
+        for (size_t i = 0; i < NSTEPS; i++) {
+                steps[i].lat = malloc(pty.ncycles * sizeof(*steps[i].lat));
+                steps[i].nsys = malloc(pty.ncycles * sizeof(*steps[i].nsys));
+                if (steps[i].lat == NULL || steps[i].nsys == NULL)
+                        err_sys("malloc");
+        }
+
+        spawn();
+        waitfor(pty.marker, "the first prompt");
+        for (int i = 0; i < pty.ncycles; i++) {
+                if (bench_selected("prompt"))
+                        cycle("prompt", "");
+                if (bench_selected("builtin"))
+                        cycle("builtin", "cd /tmp");
+                if (bench_selected("fg"))
+                        cycle("fg", "/bin/true");
+                if (bench_selected("pipeline"))
+                        cycle("pipeline", "echo x | cat");
+                if (bench_selected("bg"))
+                        cycle("bg", "/bin/true &");
+                if (bench_selected("suspend") || bench_selected("resume") ||
+                    bench_selected("interrupt"))
+                        stopcont();
+                if (bench_selected("notify"))
+                        notify();
+        }
+
+        close(pty.master);
+        /* The shell dies with its tracer. */
+        kill(pty.pid, pty.count ? SIGKILL: SIGHUP);
+        waitpid(pty.pid, &status, 0);
+        bench_rmtmp(pty.dir);
+        for (size_t i = 0; i < NSTEPS; i++)
+                report(&steps[i]);
+
+        return (bench_end());
+}
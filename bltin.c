@@ -1,15 +1,30 @@
+#define _XOPEN_SOURCE 700
+
+#include <sys/stat.h>
+
 #include <ctype.h>
 #include <err.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include "alloc.h"
 #include "bltin.h"
+#include "cmd.h"
+#include "copy.h"
 #include "env.h"
 #include "jobs.h"
+#include "match.h"
+#include "memo.h"
+#include "pipe.h"
+#include "stats.h"
+#include "trace.h"
 #include "utils.h"
+#include "watch.h"
 
 static int exitcmd(int, char **);
 static int cdcmd(int, char **);
@@ -19,32 +34,86 @@ static int bgcmd(int, char **);
 static int fgcmd(int, char **);
 static int setenvcmd(int, char **);
 static int unsetenvcmd(int, char **);
+static int echocmd(int, char **);
+static int printfcmd(int, char **);
+static int testcmd(int, char **);
+static int bracketcmd(int, char **);
+static int truecmd(int, char **);
+static int falsecmd(int, char **);
+static int catcmd(int, char **);
+static int setpipecmd(int, char **);
 
 static struct {
         const char *name;
         const builtin_t func;
+        const int flags;
 } builtins[] = {
-        {"exit", exitcmd},
-        {"cd", cdcmd},
-        {"jobs", jobscmd},
-        {"kill", killcmd},
-        {"bg", bgcmd},
-        {"fg", fgcmd},
-        {"setenv", setenvcmd},
-        {"unsetenv", unsetenvcmd},
+        {"exit", exitcmd, 0},
+        {"cd", cdcmd, 0},
+        {"jobs", jobscmd, 0},
+        {"kill", killcmd, 0},
+        {"bg", bgcmd, 0},
+        {"fg", fgcmd, 0},
+        {"setenv", setenvcmd, 0},
+        {"unsetenv", unsetenvcmd, 0},
+        {"echo", echocmd, BLT_NOSTDIN},
+        {"printf", printfcmd, BLT_NOSTDIN},
+        {"test", testcmd, BLT_NOSTDIN},
+        {"[", bracketcmd, BLT_NOSTDIN},
+        {"true", truecmd, BLT_NOSTDIN},
+        {"false", falsecmd, BLT_NOSTDIN},
+        {"match", matchcmd, BLT_FORK},
+        {"cat", catcmd, BLT_FORK},
+        {"memo", memocmd, 0},
+        {"watch", watchcmd, BLT_FORK},
+        {"setpipe", setpipecmd, 0},
+        {"stats", statscmd, 0},
+        {"settrace", settracecmd, 0},
+#ifdef ALLOCSTATS
+        {"allocstats", allocstatscmd, 0},
+#endif
 };
 
 #define NELELMS(x)	(sizeof(x)/sizeof((x)[0]))
 
-builtin_t
-lookupbltin(const char *name)
+static int
+lookup(const char *name)
 {
 
         for (size_t i = 0; i < NELELMS(builtins); i++)
                 if (!strcmp(name, builtins[i].name))
-                        return (builtins[i].func);
+                        return (i);
+
+        return (-1);
+}
+
+builtin_t
+lookupbltin(const char *name)
+{
+        int i;
 
-        return (NULL);
+        return ((i = lookup(name)) == -1 ? NULL: builtins[i].func);
+}
+
+/*
+ * Return the BLT_* flags of the given builtin, or 0 if it isn't one.
+ */
+int
+bltinflags(const char *name)
+{
+        int i;
+
+        return ((i = lookup(name)) == -1 ? 0: builtins[i].flags);
+}
+
+/*
+ * Return the name of the builtin "i", or NULL past the last one.
+ */
+const char *
+bltinname(size_t i)
+{
+
+        return (i < NELELMS(builtins) ? builtins[i].name: NULL);
 }
 
 static inline int
@@ -89,15 +158,23 @@ cdcmd(int argc, char *argv[])
         return (0);
 }
 
+/*
+ * jobs [-p]
+ *
+ * With -p, show the statistics of the pipes of the jobs run with
+ * "pipestat" instead.
+ */
 static int
 jobscmd(int argc, char *argv[])
 {
 
-        UNUSED(argv);
-        if (argc > 0)
-                return (usage("jobs"));
+        if (argc > 1 || (argc == 1 && strcmp(argv[0], "-p")))
+                return (usage("jobs [-p]"));
         reapjobs(1);
-        prjobs();
+        if (argc == 1)
+                prmeters();
+        else
+                prjobs();
 
         return (0);
 }
@@ -201,3 +278,585 @@ unsetenvcmd(int argc, char *argv[])
         
         return (0);        
 }
+
+/*
+ * Output the character escaped by the backslash at "p" and return the
+ * end of the escape sequence.  With "octal0", octal numbers start with
+ * a zero as in the %b arguments of printf.
+ */
+static const char *
+putescape(const char *p, _Bool octal0)
+{
+        static const char escapes[] = "\\\\a\ab\bf\fn\nr\rt\tv\v";
+        const char *e;
+        int c;
+
+        p++;
+        if (*p >= '0' && *p <= '7') {
+                int n = 0;
+                if (octal0 && *p == '0')
+                        p++;
+                for (c = 0; n < 3 && *p >= '0' && *p <= '7'; n++)
+                        c = c*8 + *p++ - '0';
+                putchar(c);
+                return (p);
+        }
+        for (e = escapes; *e; e += 2)
+                if (*e == *p) {
+                        putchar(e[1]);
+                        return (p + 1);
+                }
+
+        putchar('\\');
+        return (*p ? p + 1: p);
+}
+
+/*
+ * Write the arguments.  As in GNU echo, the leading arguments made of
+ * the flags -n (no newline), -e (interpret the escapes, \c ending the
+ * output) and -E (don't) are options.
+ */
+static int
+echocmd(int argc, char *argv[])
+{
+        _Bool newline;
+        _Bool escapes;
+        const char *p;
+
+        newline = 1;
+        escapes = 0;
+        for (; argc > 0 && argv[0][0] == '-' && argv[0][1] != '\0' &&
+            argv[0][1 + strspn(argv[0] + 1, "neE")] == '\0'; argc--, argv++)
+                for (p = argv[0] + 1; *p; p++) {
+                        if (*p == 'n')
+                                newline = 0;
+                        else
+                                escapes = *p == 'e';
+                }
+
+        for (int i = 0; i < argc; i++) {
+                if (i > 0)
+                        putchar(' ');
+                if (!escapes) {
+                        fputs(argv[i], stdout);
+                        continue;
+                }
+                for (p = argv[i]; *p; ) {
+                        if (*p != '\\')
+                                putchar(*p++);
+                        else if (p[1] == 'c')
+                                goto out;
+                        else
+                                p = putescape(p, 1);
+                }
+        }
+        if (newline)
+                putchar('\n');
+out:
+        return (ferror(stdout) ? 1: 0);
+}
+
+/*
+ * Convert a numeric argument of printf.  A leading quote gives the
+ * value of the following character.
+ */
+static intmax_t
+getnum(const char *s, int *errp)
+{
+        intmax_t n;
+        char *end;
+
+        if (*s == '\'' || *s == '"')
+                return ((unsigned char)s[1]);
+
+        errno = 0;
+        n = strtoimax(s, &end, 0);
+        if (end == s || *end != '\0' || errno) {
+                warnx("printf: %s: invalid number", s);
+                *errp = 1;
+        }
+
+        return (n);
+}
+
+static long double
+getfloat(const char *s, int *errp)
+{
+        long double n;
+        char *end;
+
+        if (*s == '\'' || *s == '"')
+                return ((unsigned char)s[1]);
+
+        errno = 0;
+        n = strtold(s, &end);
+        if (end == s || *end != '\0' || errno) {
+                warnx("printf: %s: invalid number", s);
+                *errp = 1;
+        }
+
+        return (n);
+}
+
+/*
+ * Format the arguments like printf(1).  The format is reused as long
+ * as there are arguments left.
+ */
+static int
+printfcmd(int argc, char *argv[])
+{
+        const char *fmt;
+        char spec[64];
+        int err;
+        int used;
+
+        if (argc == 0)
+                return (usage("printf format [arg ...]"));
+        fmt = *argv++;
+        argc--;
+
+        err = 0;
+        for (;;) {
+                used = 0;
+                for (const char *p = fmt; *p; ) {
+                        if (*p == '\\') {
+                                p = putescape(p, 0);
+                                continue;
+                        }
+                        if (*p != '%') {
+                                putchar(*p++);
+                                continue;
+                        }
+                        if (p[1] == '%') {
+                                putchar('%');
+                                p += 2;
+                                continue;
+                        }
+
+                        /* Copy the conversion specification. */
+                        size_t n = strspn(p + 1, "-+ #0123456789.") + 1;
+                        if (n + 3 > sizeof(spec) || p[n] == '\0') {
+                                warnx("printf: invalid format: %s", p);
+                                return (1);
+                        }
+                        int conv = p[n];
+                        const char *arg = used < argc ? argv[used++]: NULL;
+                        memcpy(spec, p, n);
+                        p += n + 1;
+
+                        switch (conv) {
+                        case 'd': case 'i':
+                                strcpy(spec + n, "jd");
+                                printf(spec, arg ? getnum(arg, &err): 0);
+                                break;
+                        case 'o': case 'u': case 'x': case 'X':
+                                spec[n] = 'j';
+                                spec[n + 1] = conv;
+                                spec[n + 2] = '\0';
+                                printf(spec, (uintmax_t)(arg ?
+                                    getnum(arg, &err): 0));
+                                break;
+                        case 'e': case 'E': case 'f': case 'F':
+                        case 'g': case 'G': case 'a': case 'A':
+                                spec[n] = 'L';
+                                spec[n + 1] = conv;
+                                spec[n + 2] = '\0';
+                                printf(spec, arg ? getfloat(arg, &err): 0.0L);
+                                break;
+                        case 'c':
+                                strcpy(spec + n, "c");
+                                if (arg && *arg)
+                                        printf(spec, *arg);
+                                break;
+                        case 's':
+                                strcpy(spec + n, "s");
+                                printf(spec, arg ? arg: "");
+                                break;
+                        case 'b':
+                                for (const char *q = arg ? arg: "";
+                                     *q; ) {
+                                        if (*q == '\\') {
+                                                if (q[1] == 'c')
+                                                        return (err);
+                                                q = putescape(q, 1);
+                                        } else
+                                                putchar(*q++);
+                                }
+                                break;
+                        default:
+                                warnx("printf: %%%c: invalid conversion",
+                                    conv);
+                                return (1);
+                        }
+                }
+                if (used == 0 || used >= argc)
+                        break;
+                argc -= used;
+                argv += used;
+        }
+
+        return (err || ferror(stdout) ? 1: 0);
+}
+
+/*
+ * Arguments of the expression evaluated by test.
+ */
+static struct {
+        char **argv;
+        int argc;
+        int i;                  /* next argument */
+        _Bool err;              /* syntax error */
+} texp;
+
+static int toexpr(void);
+
+static inline const char *
+tpeek(int off)
+{
+
+        return (texp.i + off < texp.argc ? texp.argv[texp.i + off]: NULL);
+}
+
+static _Bool
+isbinop(const char *s)
+{
+        static const char *const ops[] = {
+                "=", "!=", "-eq", "-ne", "-lt", "-le", "-gt", "-ge",
+                "-nt", "-ot", "-ef", NULL
+        };
+
+        if (s == NULL)
+                return (0);
+        for (const char *const *op = ops; *op; op++)
+                if (!strcmp(s, *op))
+                        return (1);
+
+        return (0);
+}
+
+static long long
+tnum(const char *s)
+{
+        long long n;
+        char *end;
+
+        errno = 0;
+        n = strtoll(s, &end, 10);
+        while (isspace((unsigned char)*end))
+                end++;
+        if (end == s || *end != '\0' || errno) {
+                warnx("test: %s: integer expected", s);
+                texp.err = 1;
+        }
+
+        return (n);
+}
+
+static int
+tbinary(const char *a, const char *op, const char *b)
+{
+        struct stat sa;
+        struct stat sb;
+
+        if (!strcmp(op, "="))
+                return (!strcmp(a, b));
+        if (!strcmp(op, "!="))
+                return (strcmp(a, b) != 0);
+        if (op[1] == 'n' || op[1] == 'o' || !strcmp(op, "-ef")) {
+                if (stat(a, &sa) == -1 || stat(b, &sb) == -1)
+                        return (0);
+                if (!strcmp(op, "-ef"))
+                        return (sa.st_dev == sb.st_dev &&
+                            sa.st_ino == sb.st_ino);
+                if (sa.st_mtim.tv_sec != sb.st_mtim.tv_sec)
+                        return ((sa.st_mtim.tv_sec > sb.st_mtim.tv_sec) ==
+                            (op[1] == 'n'));
+                if (sa.st_mtim.tv_nsec == sb.st_mtim.tv_nsec)
+                        return (0);
+                return ((sa.st_mtim.tv_nsec > sb.st_mtim.tv_nsec) ==
+                    (op[1] == 'n'));
+        }
+
+        long long x = tnum(a);
+        long long y = tnum(b);
+        if (!strcmp(op, "-eq"))
+                return (x == y);
+        if (!strcmp(op, "-ne"))
+                return (x != y);
+        if (!strcmp(op, "-lt"))
+                return (x < y);
+        if (!strcmp(op, "-le"))
+                return (x <= y);
+        if (!strcmp(op, "-gt"))
+                return (x > y);
+        return (x >= y);
+}
+
+static int
+tunary(int op, const char *arg)
+{
+        struct stat sb;
+
+        switch (op) {
+        case 'n':
+                return (*arg != '\0');
+        case 'z':
+                return (*arg == '\0');
+        case 't':
+                return (isatty((int)tnum(arg)));
+        case 'r':
+                return (access(arg, R_OK) == 0);
+        case 'w':
+                return (access(arg, W_OK) == 0);
+        case 'x':
+                return (access(arg, X_OK) == 0);
+        case 'h': /* FALLTHROUGH */
+        case 'L':
+                return (lstat(arg, &sb) == 0 && S_ISLNK(sb.st_mode));
+        }
+
+        if (stat(arg, &sb) == -1)
+                return (0);
+        switch (op) {
+        case 'e':
+                return (1);
+        case 'f':
+                return (S_ISREG(sb.st_mode));
+        case 'd':
+                return (S_ISDIR(sb.st_mode));
+        case 'b':
+                return (S_ISBLK(sb.st_mode));
+        case 'c':
+                return (S_ISCHR(sb.st_mode));
+        case 'p':
+                return (S_ISFIFO(sb.st_mode));
+        case 'S':
+                return (S_ISSOCK(sb.st_mode));
+        case 's':
+                return (sb.st_size > 0);
+        case 'g':
+                return ((sb.st_mode & S_ISGID) != 0);
+        case 'u':
+                return ((sb.st_mode & S_ISUID) != 0);
+        case 'k':
+                return ((sb.st_mode & S_ISVTX) != 0);
+        }
+
+        return (0);
+}
+
+static int
+tprimary(void)
+{
+        const char *a;
+        int v;
+
+        if ((a = tpeek(0)) == NULL) {
+                warnx("test: argument expected");
+                texp.err = 1;
+                return (0);
+        }
+
+        /* A binary operator takes precedence over anything else. */
+        if (isbinop(tpeek(1)) && tpeek(2)) {
+                texp.i += 3;
+                return (tbinary(a, texp.argv[texp.i - 2],
+                    texp.argv[texp.i - 1]));
+        }
+
+        if (!strcmp(a, "(") && tpeek(1)) {
+                texp.i++;
+                v = toexpr();
+                if ((a = tpeek(0)) == NULL || strcmp(a, ")")) {
+                        if (!texp.err)
+                                warnx("test: ) expected");
+                        texp.err = 1;
+                        return (0);
+                }
+                texp.i++;
+                return (v);
+        }
+
+        if (a[0] == '-' && a[1] && !a[2] &&
+            strchr("nztrwxhLefdbcpSsguk", a[1]) && tpeek(1)) {
+                texp.i += 2;
+                return (tunary(a[1], texp.argv[texp.i - 1]));
+        }
+
+        texp.i++;
+        return (*a != '\0');
+}
+
+static int
+tnexpr(void)
+{
+        const char *a;
+
+        if ((a = tpeek(0)) && !strcmp(a, "!") && tpeek(1)) {
+                texp.i++;
+                return (!tnexpr());
+        }
+
+        return (tprimary());
+}
+
+static int
+taexpr(void)
+{
+        const char *a;
+        int v;
+
+        v = tnexpr();
+        if ((a = tpeek(0)) && !strcmp(a, "-a")) {
+                texp.i++;
+                return (taexpr() && v);
+        }
+
+        return (v);
+}
+
+static int
+toexpr(void)
+{
+        const char *a;
+        int v;
+
+        v = taexpr();
+        if ((a = tpeek(0)) && !strcmp(a, "-o")) {
+                texp.i++;
+                return (toexpr() || v);
+        }
+
+        return (v);
+}
+
+/*
+ * Evaluate a conditional expression like test(1).
+ *
+ * Return 0 if it's true, 1 if it's false and 2 on error.
+ */
+static int
+testcmd(int argc, char *argv[])
+{
+        int v;
+
+        if (argc == 0)
+                return (1);
+
+        texp.argv = argv;
+        texp.argc = argc;
+        texp.i = 0;
+        texp.err = 0;
+        v = toexpr();
+        if (texp.err)
+                return (2);
+        if (texp.i < argc) {
+                warnx("test: %s: unexpected argument", argv[texp.i]);
+                return (2);
+        }
+
+        return (!v);
+}
+
+static int
+bracketcmd(int argc, char *argv[])
+{
+
+        if (argc == 0 || strcmp(argv[argc - 1], "]")) {
+                warnx("[: missing ]");
+                return (2);
+        }
+
+        return (testcmd(argc - 1, argv));
+}
+
+static int
+truecmd(int argc, char *argv[])
+{
+
+        UNUSED(argc);
+        UNUSED(argv);
+        return (0);
+}
+
+static int
+falsecmd(int argc, char *argv[])
+{
+
+        UNUSED(argc);
+        UNUSED(argv);
+        return (1);
+}
+
+/*
+ * Concatenate files to the standard output.  See copy_fd().  The
+ * options are left to the external cat.
+ */
+static int
+catcmd(int argc, char *argv[])
+{
+        int status;
+        int fd;
+
+        for (int i = 0; i < argc; i++)
+                if (argv[i][0] == '-' && argv[i][1] != '\0')
+                        cmd_exec(argv - 1);
+
+        status = 0;
+        for (int i = 0; i < argc || (i == 0 && argc == 0); i++) {
+                const char *name = argc == 0 ? "-": argv[i];
+                if (!strcmp(name, "-"))
+                        fd = STDIN_FILENO;
+                else if ((fd = open(name, O_RDONLY|O_CLOEXEC)) == -1) {
+                        warn("cat: %s", name);
+                        status = 1;
+                        continue;
+                }
+                if (copy_fd(fd, STDOUT_FILENO) == -1) {
+                        warn("cat: %s", name);
+                        status = 1;
+                }
+                if (fd != STDIN_FILENO)
+                        close(fd);
+        }
+
+        return (status);
+}
+
+/*
+ * Set the size of the pipes of the pipelines with -s, and the maximum
+ * size they can grow to when their readers are too slow with -g.  A
+ * size of 0 restores the default.  Without options, show them.
+ */
+static int
+setpipecmd(int argc, char *argv[])
+{
+        const char *end;
+        long size;
+        long max;
+
+        pipe_getconf(&size, &max);
+        if (argc == 0) {
+                printf("size %ld\ngrow %ld\n", size, max);
+                return (0);
+        }
+        if (argc % 2)
+                return (usage("setpipe [-s size] [-g max]"));
+
+        for (int i = 0; i < argc; i += 2) {
+                long n = pipe_parsesize(argv[i + 1], &end);
+                if (n == -1 || *end != '\0') {
+                        warnx("setpipe: %s: invalid size", argv[i + 1]);
+                        return (1);
+                }
+                if (!strcmp(argv[i], "-s"))
+                        size = n;
+                else if (!strcmp(argv[i], "-g"))
+                        max = n;
+                else
+                        return (usage("setpipe [-s size] [-g max]"));
+        }
+        pipe_setconf(size, max);
+
+        return (0);
+}
@@ -1,8 +1,18 @@
 #ifndef ISH_BLTIN_H_
 #define ISH_BLTIN_H_
 
+#include <stddef.h>
+
 typedef int (*builtin_t)(int, char **);
 
+/*
+ * Flags of the builtins.
+ */
+#define BLT_NOSTDIN	0x01	/* doesn't read its standard input */
+#define BLT_FORK	0x02	/* always run from a child process */
+
 extern builtin_t lookupbltin(const char *);
+extern int bltinflags(const char *);
+extern const char *bltinname(size_t);
 
 #endif  /* !ISH_BLTIN_H_ */
@@ -1,5 +1,6 @@
-#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
 
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
@@ -8,6 +9,8 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <libgen.h>
+#include <limits.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -17,11 +20,23 @@
 #include "cmd.h"
 #include "err.h"
 #include "env.h"
+#include "expand.h"
 #include "jobs.h"
+#include "main.h"
+#include "meter.h"
+#include "par.h"
+#include "pipe.h"
+#include "stats.h"
+#include "trace.h"
 #include "utils.h"
+#include "wildcard.h"
 
 extern char **environ;
 
+static const char batchname[] = "batch";
+
+static int runbatch(int, char **);
+
 cmd_t *
 cmd_new(void)
 {
@@ -34,8 +49,14 @@ cmd_new(void)
         c->next = NULL;
         c->filein = NULL;
         c->fileout = NULL;
+        c->herein = NULL;
+        c->heredelim = NULL;
         c->redirerr = 0;
         c->append = 0;
+        c->pipesize = 0;
+        c->replicas = 1;
+        c->ordered = 0;
+        c->flags = 0;
 
         return (c);
 }
@@ -54,6 +75,8 @@ cmd_free(cmd_t *c)
                         free(c->filein);
                 if (c->fileout)
                         free(c->fileout);
+                free(c->herein);
+                free(c->heredelim);
                 free(c);
                 c = n;
         }
@@ -107,6 +130,7 @@ lookupcmd(const char *name)
              (name[1] == '/' || (name[1] == '.' && name[2] == '/'))))
                 return (name);
 
+        STATS_INC(ST_PATHLOOKUPS);
         if ((pathenv = env_get("PATH")) == NULL)
                 goto err;
 
@@ -131,6 +155,7 @@ lookupcmd(const char *name)
                 if ((dirfd = open(pathname, O_RDONLY)) == -1)
                         continue;
 
+                STATS_INC(ST_PROBES);
                 retval = faccessat(dirfd, name, F_OK, AT_EACCESS);
                 close(dirfd);                
                 if (retval == 0) {
@@ -140,27 +165,259 @@ lookupcmd(const char *name)
                 }
         }
 err:
+        STATS_INC(ST_EXECFAILS);
         err_quit("%s: command not found", name);
         return (NULL);          /* NOTREACHED */
 }
 
-static void
-runcmd(int argc, char **argv)
+/*
+ * Execute the external command named by "argv[0]", even if there's a
+ * builtin of the same name.  Doesn't return.
+ */
+void
+cmd_exec(char **argv)
 {
         const char *pathname;
-        builtin_t func;
-
-        if ((func = lookupbltin(argv[0])) != NULL)
-                exit(func(argc-1, argv+1));
+        uint64_t start;
 
+        start = stats_now();
         pathname = lookupcmd(argv[0]);
+        if (trace_enabled()) {
+                trace_event("resolve", TR_COMPLETE, getpid(), start,
+                    stats_now() - start, pathname);
+                trace_event("exec", TR_INSTANT, getpid(), stats_now(), 0,
+                    pathname);
+        }
         argv[0] = basename(argv[0]);
         execve(pathname, argv, env_execargs());
 
         // Only executed if execve fails.
+        STATS_INC(ST_EXECFAILS);
         err_sys("%s", pathname);
 }
 
+static void
+runcmd(int argc, char **argv)
+{
+        builtin_t func;
+
+        if (argc == 0)
+                exit(0);
+        if (!strcmp(argv[0], batchname))
+                exit(runbatch(argc, argv));
+        if ((func = lookupbltin(argv[0])) != NULL) {
+                STATS_INC(ST_BUILTINS);
+                exit(func(argc-1, argv+1));
+        }
+        cmd_exec(argv);
+}
+
+/*
+ * Argument vectors of a "batch" command.
+ */
+typedef struct batch {
+        char ***argv;           /* NULL-terminated vector of each batch */
+        int n;                  /* number of batches */
+        _Bool parallel;         /* run all the batches at the same time */
+} batch_t;
+
+/*
+ * Return the number of bytes taken by the environment of the executed
+ * commands.
+ */
+static size_t
+envsize(void)
+{
+        char **env;
+        size_t size;
+
+        env = env_execargs();
+        size = sizeof(*env);
+        for (char **p = env; *p; p++) {
+                size += strlen(*p) + 1 + sizeof(*p);
+                free(*p);
+        }
+        free(env);
+
+        return (size);
+}
+
+static void
+freebatches(batch_t *b)
+{
+
+        for (int i = 0; i < b->n; i++)
+                free(b->argv[i]);
+        free(b->argv);
+        b->argv = NULL;
+        b->n = 0;
+}
+
+/*
+ * Split the arguments of "batch [-p] [-n fixed] command [arg ...]"
+ * into the fewest argument vectors that execve() accepts.
+ *
+ * The command and its first "fixed" arguments are repeated in each
+ * vector.  By default, they are the leading arguments starting with a
+ * dash, up to and including "--".  The remaining arguments are
+ * distributed in order so that the size of each vector and the
+ * environment stays below ARG_MAX.
+ *
+ * Return 0 on success and -1 on failure.
+ */
+static int
+makebatches(int argc, char **argv, batch_t *b)
+{
+        size_t limit;
+        size_t fixedsize;
+        size_t size;
+        long argmax;
+        long nfixed;
+        long room;
+        int first;
+        int i;
+
+        b->parallel = 0;
+        nfixed = -1;
+        for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+                char *end;
+                if (!strcmp(argv[i], "-p"))
+                        b->parallel = 1;
+                else if (!strcmp(argv[i], "-n") && i+1 < argc) {
+                        nfixed = strtol(argv[++i], &end, 10);
+                        if (*end != '\0' || nfixed < 0)
+                                goto usage;
+                } else
+                        goto usage;
+        }
+        if (i == argc)
+                goto usage;
+
+        first = i++;
+        if (nfixed == -1) {
+                for (nfixed = 0; i + nfixed < argc; nfixed++) {
+                        if (argv[i + nfixed][0] != '-')
+                                break;
+                        if (!strcmp(argv[i + nfixed], "--")) {
+                                nfixed++;
+                                break;
+                        }
+                }
+        }
+        if (i + nfixed > argc)
+                nfixed = argc - i;
+        i += nfixed;
+
+        if ((argmax = sysconf(_SC_ARG_MAX)) == -1)
+                argmax = _POSIX_ARG_MAX;
+        room = argmax - (long)envsize() - 2048; /* keep some headroom */
+        if (room <= 0) {
+                fprintf(stderr, "%s: %s: environment too large\n",
+                        batchname, argv[first]);
+                return (-1);
+        }
+        limit = room;
+        fixedsize = sizeof(char *);
+        for (int j = first; j < i; j++)
+                fixedsize += strlen(argv[j]) + 1 + sizeof(char *);
+
+        b->argv = NULL;
+        b->n = 0;
+        do {
+                int start = i;
+                char **v;
+
+                size = fixedsize;
+                for (; i < argc; i++) {
+                        size_t len = strlen(argv[i]) + 1 + sizeof(char *);
+                        if (size + len > limit)
+                                break;
+                        size += len;
+                }
+                if (size > limit || (i == start && i < argc)) {
+                        fprintf(stderr, "%s: %s: argument list too long\n",
+                                batchname, argv[first]);
+                        freebatches(b);
+                        return (-1);
+                }
+
+                v = malloc_or_die((i - first + 1) * sizeof(*v));
+                memcpy(v, argv + first, (nfixed + 1) * sizeof(*v));
+                memcpy(v + nfixed + 1, argv + start,
+                       (i - start) * sizeof(*v));
+                v[nfixed + 1 + i - start] = NULL;
+                b->argv = realloc_or_die(b->argv,
+                                         (b->n + 1) * sizeof(*b->argv));
+                b->argv[b->n++] = v;
+        } while (i < argc);
+
+        return (0);
+usage:
+        fprintf(stderr, "usage: %s [-p] [-n fixed] command [arg ...]\n",
+                batchname);
+        return (-1);
+}
+
+static int
+nargs(char **argv)
+{
+        int n;
+
+        for (n = 0; argv[n]; n++)
+                ;
+        return (n);
+}
+
+/*
+ * Run all the batches and wait for them.
+ *
+ * Return 0 if all of them succeeded and 1 otherwise.
+ */
+static int
+runbatches(batch_t *b)
+{
+        int status;
+        int failed;
+        int n;
+
+        failed = 0;
+        for (int i = 0; i < b->n; i += n) {
+                n = b->parallel ? b->n: 1;
+                for (int j = i; j < i + n; j++)
+                        if (fork_or_die() == 0)
+                                runcmd(nargs(b->argv[j]), b->argv[j]);
+                for (int j = 0; j < n; j++) {
+                        if (wait(&status) == -1)
+                                err_sys("wait");
+                        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+                                failed = 1;
+                }
+        }
+
+        return (failed);
+}
+
+/*
+ * Execute a "batch" command.
+ *
+ * Like any external command, it's run from its own process, which
+ * then runs all the batches.  Since this process opens the
+ * redirections, the batches share the same files.
+ */
+static int
+runbatch(int argc, char **argv)
+{
+        batch_t b;
+        int status;
+
+        if (makebatches(argc, argv, &b) == -1)
+                return (2);
+        status = runbatches(&b);
+        freebatches(&b);
+
+        return (status);
+}
+
 static void
 redirect(int from, int to)
 {
@@ -170,52 +427,134 @@ redirect(int from, int to)
 }
 
 /*
- * Remove quotes and escape characters.
+ * Process substitutions of a command.  Their commands are run as part
+ * of the job of the command, and each one is connected to it by a pipe.
  */
-static char *
-process_arg(const char *arg)
+typedef struct subst {
+        job_t *jp;
+        _Bool background;
+        int *fds;               /* shell side of the pipes */
+        int n;
+} subst_t;
+
+/*
+ * Return true if the given argument is a process substitution, that
+ * is "<(cmd)" or ">(cmd)".
+ */
+_Bool
+cmd_isprocsubst(const char *w)
 {
-        char *s;
         size_t len;
-        size_t i;
 
-        assert(*arg);
-        len = strlen(arg);
-        if (arg[0] == '\'' || arg[0] == '\"') {
-                assert(len > 1 && arg[len-1] == arg[0]);
-                arg++;
-                len -= 2;
-        }
+        if ((w[0] != '<' && w[0] != '>') || w[1] != '(')
+                return (0);
+        len = strlen(w);
+        return (w[len - 1] == ')');
+}
 
-        s = malloc_or_die(len+1);
-        i = 0;
-        for (size_t j = 0; j < len; j++)
-                if (arg[j] != '\\')
-                        s[i++] = arg[j];
+static int
+countsubst(const cmd_t *c)
+{
+        int n;
 
-        s[i] = '\0';
+        n = 0;
+        for (int i = 0; i < c->args->len; i++)
+                if (cmd_isprocsubst(array_get(c->args, i)))
+                        n++;
 
-        return (s);
+        return (n);
+}
+
+static void
+initsubst(subst_t *sp, job_t *jp, _Bool background, int n)
+{
+
+        sp->jp = jp;
+        sp->background = background;
+        sp->fds = n > 0 ? malloc_or_die(n * sizeof(*sp->fds)): NULL;
+        sp->n = 0;
 }
 
 /*
- * Return NULL-terminated array of the command arguments.
+ * Close the shell side of the pipes once the command has been forked.
+ */
+static void
+closesubst(subst_t *sp)
+{
+
+        for (int i = 0; i < sp->n; i++)
+                close_or_die(sp->fds[i]);
+        free(sp->fds);
+        sp->fds = NULL;
+        sp->n = 0;
+}
+
+/*
+ * Spawn the command of the process substitution "w" and return the
+ * pathname the command should open to read its output, or to write
+ * its input for ">(cmd)".
  *
- * The first element is a copy of the command name.  In the subsequent
- * ones, quotes and escape characters are removed.
+ * The shell side of the pipe is close-on-exec until it's inherited by
+ * the command in inheritsubst().
  */
-static char **
-create_args(const cmd_t *c)
+static char *
+spawnsubst(const char *w, subst_t *sp)
 {
-        char **argv;
+        char path[32];
+        char *cmd;
+        int fd[2];
+        int mine;               /* index of the shell side in fd */
 
-        argv = malloc_or_die(sizeof(*argv) * (c->args->len + 2));
-        argv[0] = strdup_or_die(c->name);
-        argv[c->args->len + 1] = NULL;
-        for (int i = 0; i < c->args->len; i++)
-                argv[i+1] = process_arg(array_get(c->args, i));
+        mine = w[0] == '<' ? 0: 1;
+        if (pipe2(fd, O_CLOEXEC) == -1)
+                err_sys("pipe2");
+
+        if (forkshell(sp->background, sp->jp) == 0) {
+                /* child */
+                for (int i = 0; i < sp->n; i++)
+                        close_or_die(sp->fds[i]);
+                redirect(mine ? STDIN_FILENO: STDOUT_FILENO, fd[!mine]);
+                close_or_die(fd[0]);
+                close_or_die(fd[1]);
+
+                cmd = strdup_or_die(w + 2);
+                cmd[strlen(cmd) - 1] = '\0';
+                evalstr(cmd);
+                exit(0);
+        }
+
+        close_or_die(fd[!mine]);
+        sp->fds[sp->n++] = fd[mine];
+        snprintf(path, sizeof(path), "/dev/fd/%d", fd[mine]);
+
+        return (strdup_or_die(path));
+}
+
+/*
+ * Return NULL-terminated array of the command arguments and store
+ * their number in "argcp".
+ *
+ * The command name and its arguments are expanded.  See
+ * expand_word().  Process substitutions are spawned if "sp" isn't
+ * NULL.
+ */
+static char **
+create_args(const cmd_t *c, int *argcp, subst_t *sp)
+{
+        array_t *args;
+
+        args = array_new();
+        expand_word(c->name, args);
+        for (int i = 0; i < c->args->len; i++) {
+                const char *w = array_get(c->args, i);
+                if (sp && cmd_isprocsubst(w))
+                        array_append(args, spawnsubst(w, sp));
+                else
+                        expand_word(w, args);
+        }
+        *argcp = args->len;
 
-        return (argv);
+        return ((char **)array_detach(args));
 }
 
 /*
@@ -231,8 +570,117 @@ free_args(char **argv)
         free(argv);
 }
 
+/*
+ * Return the expanded words of the command, without spawning its
+ * process substitutions.  They are freed by cmd_freeargs().
+ */
+char **
+cmd_args(const cmd_t *c, int *argcp)
+{
+
+        return (create_args(c, argcp, NULL));
+}
+
+void
+cmd_freeargs(char **argv)
+{
+
+        free_args(argv);
+}
+
+/*
+ * Return the expanded text of the here-document or here-string of the
+ * command.  A here-string is followed by a newline.
+ */
+static char *
+heretext(const cmd_t *c)
+{
+        array_t *words;
+        size_t len;
+        char *s;
+
+        if (c->heredelim) {
+                if (c->heredelim[0] == '\'' || c->heredelim[0] == '"')
+                        return (strdup_or_die(c->herein));
+                return (expand_text(c->herein));
+        }
+
+        words = array_new();
+        expand_word(c->herein, words);
+        len = 1;
+        for (int i = 0; i < words->len; i++)
+                len += strlen(array_get(words, i)) + 1;
+        s = malloc_or_die(len);
+        len = 0;
+        for (int i = 0; i < words->len; i++) {
+                const char *w = array_get(words, i);
+                size_t n = strlen(w);
+                if (i > 0)
+                        s[len++] = ' ';
+                memcpy(s + len, w, n);
+                len += n;
+        }
+        s[len++] = '\n';
+        s[len] = '\0';
+        array_free(words);
+
+        return (s);
+}
+
+/*
+ * Return a descriptor of a sealed memory file holding the here-document
+ * or here-string of the command, positioned at its beginning.  Unlike a
+ * pipe, it doesn't need a writer process and can be seeked or mapped.
+ */
+static int
+herefd(const cmd_t *c)
+{
+        char *text;
+        size_t len;
+        ssize_t n;
+        int fd;
+
+        fd = memfd_create("ish-here", MFD_CLOEXEC|MFD_ALLOW_SEALING);
+        if (fd == -1)
+                err_sys("memfd_create");
+
+        text = heretext(c);
+        len = strlen(text);
+        for (size_t off = 0; off < len; off += n) {
+                n = write(fd, text + off, len - off);
+                if (n == -1) {
+                        if (errno == EINTR) {
+                                n = 0;
+                                continue;
+                        }
+                        err_sys("write");
+                }
+        }
+        free(text);
+
+        if (fcntl(fd, F_ADD_SEALS,
+            F_SEAL_SHRINK|F_SEAL_GROW|F_SEAL_WRITE|F_SEAL_SEAL) == -1)
+                err_sys("fcntl");
+        if (lseek(fd, 0, SEEK_SET) == -1)
+                err_sys("lseek");
+
+        return (fd);
+}
+
+/*
+ * Let the command inherit the shell side of its process substitutions.
+ */
+static void
+inheritsubst(const subst_t *sp)
+{
+
+        for (int i = 0; i < sp->n; i++)
+                if (fcntl(sp->fds[i], F_SETFD, 0) == -1)
+                        err_sys("fcntl");
+}
+
 static void
-handle_redirects(cmd_t *c)
+redirectin(cmd_t *c)
 {
         int fd;
 
@@ -242,6 +690,18 @@ handle_redirects(cmd_t *c)
                 close_or_die(fd);
         }
 
+        if (c->herein) {
+                fd = herefd(c);
+                redirect(STDIN_FILENO, fd);
+                close_or_die(fd);
+        }
+}
+
+static void
+redirectout(cmd_t *c)
+{
+        int fd;
+
         if (c->fileout) {
                 int flags = O_WRONLY|O_CREAT;
                 mode_t mode = S_IWUSR|S_IRUSR;
@@ -255,6 +715,118 @@ handle_redirects(cmd_t *c)
         }
 }
 
+static void
+handle_redirects(cmd_t *c, const subst_t *sp)
+{
+
+        if (sp)
+                inheritsubst(sp);
+        redirectin(c);
+        redirectout(c);
+}
+
+/*
+ * Save the standard input, output and error into "fds".  We might
+ * redirect them since we're executing a builtin directly from the
+ * shell.
+ */
+static void
+savefds(int fds[3])
+{
+
+        for (int i = 0; i < 3; i++)
+                fds[i] = dup_or_die(i);
+}
+
+static void
+restorefds(const int fds[3])
+{
+
+        for (int i = 0; i < 3; i++)
+                redirect(i, fds[i]);
+}
+
+static void
+closefds(const int fds[3])
+{
+
+        for (int i = 0; i < 3; i++)
+                close_or_die(fds[i]);
+}
+
+static inline _Bool
+hasredirs(const cmd_t *c)
+{
+
+        return (c->filein || c->fileout || c->herein);
+}
+
+/*
+ * Run a builtin directly from the shell.
+ *
+ * If "outfd" isn't -1, the standard output is redirected to it before
+ * handling the redirections of the command, and so is the standard
+ * error for a "|&" pipe.
+ */
+static void
+runbltin(cmd_t *c, builtin_t func, int argc, char **argv, int outfd)
+{
+        int fds[3];
+
+        savefds(fds);
+        if (outfd != -1) {
+                redirect(STDOUT_FILENO, outfd);
+                if (c->mode == C_PIPEERR)
+                        redirect(STDERR_FILENO, outfd);
+        }
+        handle_redirects(c, NULL);
+
+        STATS_INC(ST_BUILTINS);
+        setlaststatus(func(argc-1, argv+1));
+
+        // Flush output buffer before continuing.
+        fflush(stdout);
+
+        restorefds(fds);
+        closefds(fds);
+}
+
+/*
+ * Execute a sequence of builtins marked by the optimizer.  The
+ * standard descriptors are saved once for all of them, and only
+ * restored after a builtin with redirections.
+ *
+ * Return the last command of the sequence.
+ */
+static cmd_t *
+execbltins(cmd_t *c)
+{
+        builtin_t func;
+        char **argv;
+        int argc;
+        int fds[3];
+
+        savefds(fds);
+        for (;; c = c->next) {
+                argv = create_args(c, &argc, NULL);
+                if (argc > 0 && (func = lookupbltin(argv[0])) != NULL) {
+                        handle_redirects(c, NULL);
+                        STATS_INC(ST_BUILTINS);
+                        setlaststatus(func(argc-1, argv+1));
+                        fflush(stdout);
+                        if (hasredirs(c))
+                                restorefds(fds);
+                }
+                free_args(argv);
+                wildcard_flush();
+                if (c->next == NULL || !(c->next->flags & CF_BLTSEQ))
+                        break;
+        }
+        closefds(fds);
+
+        return (c);
+}
+
 /*
  * Execute a single command.
  */
@@ -262,54 +834,58 @@ static void
 exec(cmd_t *c)
 {
         char **argv;
+        int argc;
+        int nsubst;
+        subst_t sub;
         job_t *jp;
         _Bool background;
 
         background = c->mode == C_BGRD;
-        argv = create_args(c);
-        if (!background) {
-                // Don't create a new process if it's a builtin.
-                builtin_t func = lookupbltin(c->name);
-                if (func) {
-                        /*
-                         * We need to save the standard input, output
-                         * and error. We might redirect them since
-                         * we're executing a builtin directly from the
-                         * shell.
-                         */
-                        int fdin = dup_or_die(STDIN_FILENO);
-                        int fdout = dup_or_die(STDOUT_FILENO);
-                        int fderr = dup_or_die(STDERR_FILENO);
-
-                        handle_redirects(c);
-
-                        func(c->args->len, argv+1);
-
-                        // Flush output buffer before continuing.
-                        fflush(stdout);
-
-                        // Restore.
-                        redirect(STDIN_FILENO, fdin);
-                        redirect(STDOUT_FILENO, fdout);
-                        redirect(STDERR_FILENO, fderr);
-
-                        close_or_die(fdin);
-                        close_or_die(fdout);
-                        close_or_die(fderr);
-
+        nsubst = countsubst(c);
+        argv = NULL;
+        if (nsubst == 0) {
+                argv = create_args(c, &argc, NULL);
+                if (argc == 0) {
                         free_args(argv);
                         return;
                 }
         }
+        if (!background && nsubst == 0) {
+                /*
+                 * Don't create a new process if it's a builtin, unless
+                 * it might read its input for long: it couldn't be
+                 * interrupted or suspended from the shell.  It's then
+                 * run without exec'ing anything.
+                 */
+                builtin_t func = lookupbltin(argv[0]);
+                if (func && !(bltinflags(argv[0]) & BLT_FORK)) {
+                        runbltin(c, func, argc, argv, -1);
+                        free_args(argv);
+                        return;
+                }
+        }
+
+        /*
+         * The shell would exit right after this command: there's no
+         * need to wait for it.
+         */
+        if (c->flags & CF_EXEC) {
+                handle_redirects(c, NULL);
+                runcmd(argc, argv); /* doesn't return */
+        }
 
-        jp = makejob(1, cmd_str(c));
+        jp = makejob(1 + nsubst, cmd_str(c));
+        initsubst(&sub, jp, background, nsubst);
+        if (argv == NULL)
+                argv = create_args(c, &argc, &sub);
         if (forkshell(background, jp) == 0) {
                 /* child */
-                handle_redirects(c);
-                runcmd(c->args->len+1, argv); /* doesn't return */
+                handle_redirects(c, &sub);
+                runcmd(argc, argv); /* doesn't return */
         }
 
         // Parent.
+        closesubst(&sub);
         free_args(argv);
         if (!background)                
                 waitforjob(jp);
@@ -317,43 +893,283 @@ exec(cmd_t *c)
                 prbgrd(jp);
 }
 
+/*
+ * Run a command whose words are already expanded like exec() does in
+ * the foreground, and return its exit status.
+ */
+int
+cmd_execv(char **argv)
+{
+        builtin_t func;
+        job_t *jp;
+        char *cmd;
+        size_t len;
+        int argc;
+
+        argc = nargs(argv);
+        assert(argc > 0);
+        func = lookupbltin(argv[0]);
+        if (func && !(bltinflags(argv[0]) & BLT_FORK)) {
+                STATS_INC(ST_BUILTINS);
+                setlaststatus(func(argc-1, argv+1));
+                fflush(stdout);
+                return (laststatus());
+        }
+
+        len = 0;
+        for (int i = 0; i < argc; i++)
+                len += strlen(argv[i]) + 1;
+        cmd = malloc_or_die(len);
+        len = 0;
+        for (int i = 0; i < argc; i++) {
+                size_t n = strlen(argv[i]);
+                memcpy(cmd + len, argv[i], n);
+                len += n;
+                cmd[len++] = ' ';
+        }
+        cmd[len - 1] = '\0';
+
+        jp = makejob(1, cmd);
+        if (forkshell(0, jp) == 0)
+                runcmd(argc, argv); /* doesn't return */
+        waitforjob(jp);
+
+        return (laststatus());
+}
+
+/*
+ * Run the first command of a pipeline from the shell if it's a builtin
+ * that doesn't read its input, such as echo.  Its output is kept in a
+ * memory file, which is returned to become the input of the next
+ * command.  This saves a fork and a pipe.
+ *
+ * Return -1 if the command must be forked.
+ */
+static int
+runfirst(cmd_t *c)
+{
+        char **argv;
+        int argc;
+        int fd;
+
+        /*
+         * The name is checked before its expansion, which could run
+         * a command substitution.  A builtin name needs none anyway.
+         */
+        if (countsubst(c) > 0 || c->mode == C_TEE ||
+            !(bltinflags(c->name) & BLT_NOSTDIN))
+                return (-1);
+        if ((fd = memfd_create("ish-pipe", MFD_CLOEXEC)) == -1)
+                return (-1);
+
+        argv = create_args(c, &argc, NULL);
+        runbltin(c, lookupbltin(c->name), argc, argv, fd);
+        free_args(argv);
+
+        if (lseek(fd, 0, SEEK_SET) == -1)
+                err_sys("lseek");
+
+        return (fd);
+}
+
+static inline _Bool
+ispipe(cmode_t mode)
+{
+
+        return (mode == C_PIPE || mode == C_PIPEERR || mode == C_TEE);
+}
+
+/*
+ * Fork the helper process of a "|+" fan-out, which copies the pipe
+ * "in" to the "n" branches.  See pipe_tee().
+ *
+ * Return the read ends of the pipes of the branches.
+ */
+static int *
+spawntee(int in, int n, job_t *jp, _Bool background)
+{
+        int *rfds;
+        int *wfds;
+        int fd[2];
+
+        rfds = malloc_or_die(n * sizeof(*rfds));
+        wfds = malloc_or_die(n * sizeof(*wfds));
+        for (int i = 0; i < n; i++) {
+                if (pipe2(fd, O_CLOEXEC) == -1)
+                        err_sys("pipe2");
+                pipe_resize(fd[1], 0);
+                rfds[i] = fd[0];
+                wfds[i] = fd[1];
+        }
+
+        if (forkshell(background, jp) == 0) {
+                /* child */
+                signal(SIGPIPE, SIG_IGN);
+                for (int i = 0; i < n; i++)
+                        close_or_die(rfds[i]);
+                exit(pipe_tee(in, wfds, n));
+        }
+
+        close_or_die(in);
+        for (int i = 0; i < n; i++)
+                close_or_die(wfds[i]);
+        free(wfds);
+
+        return (rfds);
+}
+
+/*
+ * Fork the interposer of the pipe "i" of a metered job, which reads
+ * the pipe "in", and return the read end of the pipe it writes to.
+ */
+static int
+spawnmeter(job_t *jp, int i, int in, long size, _Bool background)
+{
+        meter_t *m = jp->meter;
+        int fd[2];
+
+        if (pipe2(fd, O_CLOEXEC) == -1)
+                err_sys("pipe2");
+        pipe_resize(fd[1], size);
+
+        if (forkshell(background, jp) == 0) {
+                /* child */
+                signal(SIGPIPE, SIG_IGN);
+                close_or_die(fd[0]);
+                exit(meter_run(m, i, in, fd[1]));
+        }
+
+        close_or_die(in);
+        close_or_die(fd[1]);
+
+        return (fd[0]);
+}
+
+/*
+ * Command of a replicated stage, run by each replica with runreplica().
+ * The redirections of the stage are handled once, by the splitter for
+ * its input and by the merger for its output, so the standard error of
+ * a replica goes to its output if it's redirected along with it.
+ */
+typedef struct replica {
+        cmd_t *c;
+        subst_t *sp;
+        int argc;
+        char **argv;
+} replica_t;
+
+static void
+runreplica(void *arg)
+{
+        replica_t *rp = arg;
+
+        if (rp->c->mode == C_PIPEERR || (rp->c->fileout && rp->c->redirerr))
+                redirect(STDERR_FILENO, STDOUT_FILENO);
+        inheritsubst(rp->sp);
+        runcmd(rp->argc, rp->argv);
+}
+
 /*
  * Execute the pipeline command.
  *
+ * After "cmd |+ a |+ b", the output of cmd is read by both a and b.
+ * Every branch but the last one writes to the standard output, the
+ * last one may be followed by other pipes.
+ *
+ * A stage with replicas, after "|*N", is run by a splitter, a merger
+ * and its replicas, which all get the descriptors of the stage.  See
+ * par.c.
+ *
+ * If "metered" is true, the data of each pipe goes through an
+ * interposer process which keeps its statistics.  See meter.c.
+ *
  * Return the last command in the pipeline.
  */
 static cmd_t *
-execpipe(cmd_t *c)
+execpipe(cmd_t *c, _Bool metered)
 {
         int fd[2];
         int nprocs;
+        int nsubst;
+        int nhelpers;
+        int npipes;
+        int nforks;
         int prevfd;
+        int *parfds;
+        int *branches;
+        int nbranches;
+        int nextbranch;
         char **argv;
+        int argc;
         cmd_t *last;
+        cmd_t *prev;
+        subst_t sub;
+        replica_t rep;
         job_t *jp;
         _Bool background;
 
         nprocs = 1;
-        for (last = c;
-             last->mode == C_PIPEERR || last->mode == C_PIPE;
-             last = last->next)
+        nsubst = countsubst(c);
+        nhelpers = 0;
+        npipes = 0;
+        for (prev = NULL, last = c; ispipe(last->mode);
+             prev = last, last = last->next) {
                 nprocs++;
+                if (last->mode != C_TEE || !prev || prev->mode != C_TEE)
+                        npipes++;
+                nsubst += countsubst(last->next);
+                if (last->next->replicas > 1)
+                        nhelpers += last->next->replicas + 1;
+                if (last->mode == C_TEE && (!prev || prev->mode != C_TEE))
+                        nhelpers++;
+        }
 
         background = last->mode == C_BGRD;
-        jp = makejob(nprocs, cmd_str(c));
-        prevfd = -1;
-        for (int i = 0; i < nprocs; i++, c = c->next) {
-                argv = create_args(c);
-                if (i < nprocs-1 && pipe(fd) == -1)
-                        err_sys("pipe");
-
-                if (forkshell(background, jp) == 0) {
+        metered = metered || meter_enabled();
+        jp = makejob(nprocs + nsubst + nhelpers + (metered ? npipes: 0),
+            cmd_str(c));
+        if (metered)
+                jp->meter = meter_new(npipes);
+        npipes = 0;
+        /* A metered pipeline keeps the pipe of its first command. */
+        if ((prevfd = metered ? -1: runfirst(c)) != -1) {
+                c = c->next;
+                nprocs--;
+        }
+        branches = NULL;
+        nbranches = nextbranch = 0;
+        for (int i = 0; i < nprocs; i++, prev = c, c = c->next) {
+                _Bool branch = i > 0 && prev->mode == C_TEE;
+                _Bool source = c->mode == C_TEE && !branch;
+                _Bool piped = i < nprocs-1 && (!branch || c->mode != C_TEE);
+
+                if (branch)
+                        prevfd = branches[nextbranch++];
+                initsubst(&sub, jp, background, countsubst(c));
+                argv = create_args(c, &argc, &sub);
+                if (piped) {
+                        if (pipe(fd) == -1)
+                                err_sys("pipe");
+                        pipe_resize(fd[1], c->pipesize);
+                }
+
+                nforks = 1;
+                parfds = NULL;
+                if (c->replicas > 1) {
+                        nforks = PAR_REPLICA + c->replicas;
+                        parfds = par_open(c->replicas);
+                }
+                for (int role = 0; role < nforks; role++) {
+                        if (forkshell(background, jp) != 0)
+                                continue;
                         /* child */
+                        for (int j = nextbranch; j < nbranches; j++)
+                                close_or_die(branches[j]);
                         if (prevfd != -1 && prevfd != STDIN_FILENO) {
                                 redirect(STDIN_FILENO, prevfd);
                                 close_or_die(prevfd);
                         }
-                        if (i < nprocs-1) {
+                        if (piped) {
                                 close_or_die(fd[0]); /* unused */
                                 if (fd[1] != STDOUT_FILENO) {
                                         redirect(STDOUT_FILENO, fd[1]);
@@ -362,47 +1178,118 @@ execpipe(cmd_t *c)
                                 if (c->mode == C_PIPEERR)
                                         redirect(STDERR_FILENO, STDOUT_FILENO);
                         }
-                        handle_redirects(c);
-                        runcmd(c->args->len+1, argv); /* doesn't return */
+                        if (parfds) {
+                                if (role == PAR_SPLITTER)
+                                        redirectin(c);
+                                else if (role == PAR_MERGER)
+                                        redirectout(c);
+                                rep.c = c;
+                                rep.sp = &sub;
+                                rep.argc = argc;
+                                rep.argv = argv;
+                                par_run(parfds, c->replicas, role, c->ordered,
+                                    runreplica, &rep);
+                        }
+                        handle_redirects(c, &sub);
+                        runcmd(argc, argv); /* doesn't return */
                 }
+                if (parfds)
+                        par_close(parfds, c->replicas);
 
                 /* parent */
+                closesubst(&sub);
                 if (prevfd != -1)
                         close_or_die(prevfd);
-                if (i < nprocs-1) {
+                prevfd = -1;
+                if (piped) {
                         prevfd = fd[0];
                         close_or_die(fd[1]);
                 }
                 free_args(argv);
+
+                if (piped && jp->meter) {
+                        meter_label(jp->meter, npipes, c->name,
+                            source ? "(tee)": c->next->name);
+                        prevfd = spawnmeter(jp, npipes++, prevfd,
+                            c->pipesize, background);
+                }
+
+                if (source) {
+                        cmd_t *b;
+                        nbranches = 0;
+                        for (b = c; b->mode == C_TEE; b = b->next)
+                                nbranches++;
+                        free(branches);
+                        branches = spawntee(prevfd, nbranches, jp,
+                            background);
+                        nextbranch = 0;
+                        prevfd = -1;
+                }
         }
+        free(branches);
 
-        if (!background)
-                waitforjob(jp);
-        else
+        if (background)
                 prbgrd(jp);
+        else if (pipe_autogrow()) {
+                void *gs = pipe_growstart(jp);
+                waitjobpoll(jp, pipe_growtick, gs, 100);
+                pipe_growend(gs);
+        } else
+                waitforjob(jp);
 
         return (last);
 }
 
+/*
+ * Remove the "pipestat" prefix of a pipeline, which asks for its pipes
+ * to be metered.  Return true if it was there.
+ */
+static _Bool
+unprefix(cmd_t *c)
+{
+
+        if (strcmp(c->name, "pipestat") || c->args->len == 0)
+                return (0);
+        free(c->name);
+        c->name = array_remove(c->args, 0);
+
+        return (1);
+}
+
 void
 cmd_run(cmd_t *c)
 {
 
         for (; c; c = c->next) {
+                _Bool metered = unprefix(c);
+
                 switch (c->mode) {
-                case C_SEQ:     /* FALLTHROUGH */
+                case C_SEQ:
+                        if (c->flags & CF_BLTSEQ) {
+                                c = execbltins(c);
+                                continue;
+                        }
+                        /* FALLTHROUGH */
                 case C_BGRD:
                         exec(c);
                         break;
                 case C_PIPE:    /* FALLTHROUGH */
                 case C_PIPEERR:
+                case C_TEE:
                         assert(c->next);
-                        c = execpipe(c);
+                        c = execpipe(c, metered);
                         break;
                 default:
                         err_quit("unknown command mode: %d", c->mode);
                         break;
                 }
+
+                /*
+                 * The directory listings read for the pathname
+                 * expansion are shared by all the words of a job.
+                 * Later jobs might see changes made by this one.
+                 */
+                wildcard_flush();
         }
 
 }
@@ -440,6 +1327,10 @@ redirlen(const cmd_t *c)
         len = 0;
         if (c->filein)
                 len += strlen(c->filein) + 2; /* add a prefix space */
+        if (c->heredelim)
+                len += strlen(c->heredelim) + 3;
+        else if (c->herein)
+                len += strlen(c->herein) + 4;
         if (c->fileout) {
                 len += 2;       /* add a prefix space */
                 if (c->append)
@@ -452,14 +1343,31 @@ redirlen(const cmd_t *c)
         return (len);
 }
 
+/*
+ * Format the replicas of the command after "|", e.g. "*4o" for "|*4o".
+ */
+static size_t
+replicastr(const cmd_t *c, char buf[16])
+{
+
+        if (c->replicas <= 1) {
+                buf[0] = '\0';
+                return (0);
+        }
+        return (snprintf(buf, 16, "*%d%s", c->replicas, c->ordered ? "o": ""));
+}
+
 static size_t
 seplen(const cmd_t *c)
 {
+        char rep[16];
 
         if (c->next) {
                 if (c->mode == C_SEQ || c->mode == C_BGRD)
                         return (2);
-                else if (c->mode == C_PIPE)
+                else if (c->mode == C_PIPE && c->next->replicas > 1)
+                        return (3 + replicastr(c->next, rep));
+                else if (c->mode == C_PIPE || c->mode == C_TEE)
                         return (3);
                 else if (c->mode == C_PIPEERR)
                         return (4);
@@ -510,6 +1418,19 @@ cmd_str(const cmd_t *c)
                                 buf[len++] = '<';
                                 len += strappend(c->filein, buf + len);
                         }
+                        if (c->herein || c->heredelim) {
+                                buf[len++] = ' ';
+                                buf[len++] = '<';
+                                buf[len++] = '<';
+                                if (c->heredelim) {
+                                        len += strappend(c->heredelim,
+                                            buf + len);
+                                } else {
+                                        buf[len++] = '<';
+                                        len += strappend(c->herein,
+                                            buf + len);
+                                }
+                        }
                         if (c->fileout) {
                                 buf[len++] = ' ';
                                 buf[len++] = '>';
@@ -534,10 +1455,18 @@ cmd_str(const cmd_t *c)
                                 break;
                         case C_PIPE: /* FALLTHROUGH */
                         case C_PIPEERR:
+                        case C_TEE:
                                 buf[len++] = ' ';
                                 buf[len++] = '|';
                                 if (c->mode == C_PIPEERR)
                                         buf[len++] = '&';
+                                else if (c->mode == C_TEE)
+                                        buf[len++] = '+';
+                                else {
+                                        char rep[16];
+                                        replicastr(c->next, rep);
+                                        len += strappend(rep, buf + len);
+                                }
                                 break;
                         default:
                                 err_quit("unexpected mode: %d", c->mode);
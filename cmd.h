@@ -7,9 +7,16 @@ typedef enum {
         C_SEQ,
         C_BGRD,
         C_PIPE,
-        C_PIPEERR
+        C_PIPEERR,
+        C_TEE                   /* "|+": output shared with the next ones */
 } cmode_t;
 
+/*
+ * Flags set by the optimizer.  See optimize().
+ */
+#define CF_BLTSEQ	0x01	/* in a sequence of builtins run together */
+#define CF_EXEC		0x02	/* replace the shell instead of forking */
+
 typedef struct cmd {
         char *name;
         array_t *args;
@@ -17,14 +24,25 @@ typedef struct cmd {
         struct cmd *next;
         char *filein;        
         char *fileout;
+        char *herein;           /* here-document body or here-string */
+        char *heredelim;        /* here-document delimiter */
         _Bool redirerr;
         _Bool append;        
+        int pipesize;           /* size of the pipe to the next command */
+        int replicas;           /* copies run in parallel, after "|*N" */
+        _Bool ordered;          /* their outputs keep the input order */
+        int flags;
 } cmd_t;
 
 extern cmd_t *cmd_new(void);
 extern void cmd_free(cmd_t *);
 extern cmd_t *cmd_last(const cmd_t *);
 extern void cmd_run(cmd_t *);
+extern int cmd_execv(char **);
+extern void cmd_exec(char **);
 extern char *cmd_str(const cmd_t *);
+extern char **cmd_args(const cmd_t *, int *);
+extern void cmd_freeargs(char **);
+extern _Bool cmd_isprocsubst(const char *);
 
 #endif  /* ISH_CMD_H_ */
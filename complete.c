@@ -0,0 +1,433 @@
+#define _GNU_SOURCE
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bltin.h"
+#include "complete.h"
+#include "env.h"
+#include "jobs.h"
+#include "utils.h"
+
+#define MAXPATHDIRS	64      /* directories of the PATH looked into */
+#define MAXLISTINGS	16      /* directory listings cached */
+#define MAXJOBS		64      /* jobs completed */
+
+/*
+ * Sorted names, all stored in one block.
+ */
+typedef struct names {
+        char **v;
+        size_t n;
+        char *pool;
+} names_t;
+
+typedef struct listing {
+        char *path;
+        dev_t dev;              /* of the directory listed */
+        ino_t ino;
+        struct timespec mtime;
+        names_t *names;         /* directories end with a slash */
+        unsigned long used;     /* time of the last use */
+} listing_t;
+
+/*
+ * The commands of the PATH are listed by a thread, so that the shell
+ * doesn't wait for it at startup nor when a directory of the PATH has
+ * changed.  The table in use is replaced once the thread is done.
+ */
+static struct {
+        names_t *cmds;          /* commands of the PATH */
+        char *path;             /* PATH of the table being built */
+        char *dirs[MAXPATHDIRS];
+        struct timespec mtimes[MAXPATHDIRS];
+        int ndirs;
+        pthread_t builder;
+        _Bool building;
+        listing_t listings[MAXLISTINGS];
+        unsigned long clock;
+        const char **matches;   /* result of the last completion */
+        size_t nmatches;
+        size_t cap;
+        char jobs[MAXJOBS][24];
+} comp;
+
+static int
+cmpnames(const void *p1, const void *p2)
+{
+
+        return (strcmp(*(char *const *)p1, *(char *const *)p2));
+}
+
+static void
+freenames(names_t *t)
+{
+
+        if (t == NULL)
+                return;
+        free(t->v);
+        free(t->pool);
+        free(t);
+}
+
+/*
+ * List the directories "dirs".  Only the executable regular files are
+ * kept if "cmds" is true; otherwise the directories get a trailing
+ * slash.
+ */
+static names_t *
+readnames(char *const *dirs, int ndirs, _Bool cmds)
+{
+        struct dirent *de;
+        struct stat sb;
+        size_t poollen;
+        size_t poolcap;
+        size_t *offs;
+        size_t cap;
+        size_t len;
+        names_t *t;
+        _Bool isdir;
+        DIR *dir;
+        size_t n;
+
+        t = malloc_or_die(sizeof(*t));
+        t->pool = NULL;
+        poollen = poolcap = 0;
+        offs = NULL;
+        n = cap = 0;
+        for (int i = 0; i < ndirs; i++) {
+                if ((dir = opendir(dirs[i])) == NULL)
+                        continue;
+                while ((de = readdir(dir)) != NULL) {
+                        if (!strcmp(de->d_name, ".") ||
+                            !strcmp(de->d_name, ".."))
+                                continue;
+                        isdir = de->d_type == DT_DIR;
+                        if (cmds || de->d_type == DT_LNK ||
+                            de->d_type == DT_UNKNOWN) {
+                                if (fstatat(dirfd(dir), de->d_name, &sb, 0)
+                                    == -1) {
+                                        if (cmds)
+                                                continue;
+                                        sb.st_mode = 0;
+                                }
+                                if (cmds && (!S_ISREG(sb.st_mode) ||
+                                    !(sb.st_mode & 0111)))
+                                        continue;
+                                isdir = S_ISDIR(sb.st_mode);
+                        }
+
+                        len = strlen(de->d_name);
+                        if (poollen + len + 2 > poolcap) {
+                                poolcap = poolcap ? poolcap * 2: 4096;
+                                t->pool = realloc_or_die(t->pool, poolcap);
+                        }
+                        if (n == cap) {
+                                cap = cap ? cap * 2: 256;
+                                offs = realloc_or_die(offs,
+                                    cap * sizeof(*offs));
+                        }
+                        offs[n++] = poollen;
+                        memcpy(t->pool + poollen, de->d_name, len);
+                        poollen += len;
+                        if (isdir && !cmds)
+                                t->pool[poollen++] = '/';
+                        t->pool[poollen++] = '\0';
+                }
+                closedir(dir);
+        }
+
+        /* The pool doesn't move anymore. */
+        t->v = malloc_or_die((n ? n: 1) * sizeof(*t->v));
+        for (size_t i = 0; i < n; i++)
+                t->v[i] = t->pool + offs[i];
+        free(offs);
+        qsort(t->v, n, sizeof(*t->v), cmpnames);
+        t->n = 0;
+        for (size_t i = 0; i < n; i++)
+                if (t->n == 0 || strcmp(t->v[t->n - 1], t->v[i]))
+                        t->v[t->n++] = t->v[i];
+
+        return (t);
+}
+
+static void *
+buildcmds(void *arg)
+{
+
+        UNUSED(arg);
+        return (readnames(comp.dirs, comp.ndirs, 1));
+}
+
+static _Bool
+samets(const struct timespec *t1, const struct timespec *t2)
+{
+
+        return (t1->tv_sec == t2->tv_sec && t1->tv_nsec == t2->tv_nsec);
+}
+
+/*
+ * Take the table of the commands once it's built, and start building
+ * it again if the PATH or one of its directories has changed.  The
+ * thread only uses the directories while the table is being built.
+ *
+ * This is called before each prompt, and before each completion as
+ * the table may be out of date after a long prompt.
+ */
+void
+complete_refresh(void)
+{
+        const char *path;
+        struct stat sb;
+        _Bool changed;
+        void *t;
+        char *p;
+
+        if (comp.building) {
+                if (pthread_tryjoin_np(comp.builder, &t) != 0)
+                        return;
+                comp.building = 0;
+                freenames(comp.cmds);
+                comp.cmds = t;
+        }
+
+        if ((path = env_get("PATH")) == NULL)
+                path = "";
+        changed = comp.path == NULL || strcmp(comp.path, path);
+        for (int i = 0; i < comp.ndirs && !changed; i++)
+                if (stat(comp.dirs[i], &sb) == 0 &&
+                    !samets(&sb.st_mtim, &comp.mtimes[i]))
+                        changed = 1;
+        if (!changed)
+                return;
+
+        free(comp.path);
+        for (int i = 0; i < comp.ndirs; i++)
+                free(comp.dirs[i]);
+        comp.path = strdup_or_die(path);
+        comp.ndirs = 0;
+        for (p = comp.path; *p != '\0' && comp.ndirs < MAXPATHDIRS;
+             p += *p == ':') {
+                size_t len = strcspn(p, ":");
+                comp.dirs[comp.ndirs] = malloc_or_die(len + 2);
+                memcpy(comp.dirs[comp.ndirs], len ? p: ".", len ? len: 1);
+                comp.dirs[comp.ndirs][len ? len: 1] = '\0';
+                /* A change during the listing is seen next time. */
+                if (stat(comp.dirs[comp.ndirs], &sb) == 0)
+                        comp.mtimes[comp.ndirs] = sb.st_mtim;
+                else
+                        memset(&comp.mtimes[comp.ndirs], 0,
+                            sizeof(comp.mtimes[comp.ndirs]));
+                comp.ndirs++;
+                p += len;
+        }
+
+        if ((errno = pthread_create(&comp.builder, NULL, buildcmds, NULL))
+            == 0)
+                comp.building = 1;
+        else {
+                freenames(comp.cmds);
+                comp.cmds = readnames(comp.dirs, comp.ndirs, 1);
+        }
+}
+
+/*
+ * Return the cached listing of the directory "path", read again if the
+ * directory has changed or if the path names another one, or NULL if
+ * it can't be read.
+ */
+static const names_t *
+listdir(const char *path)
+{
+        listing_t *lp;
+        listing_t *oldest;
+        struct stat sb;
+
+        if (stat(path, &sb) == -1 || !S_ISDIR(sb.st_mode))
+                return (NULL);
+
+        oldest = comp.listings;
+        for (lp = comp.listings; lp < comp.listings + MAXLISTINGS; lp++) {
+                if (lp->path && !strcmp(lp->path, path))
+                        break;
+                if (lp->used < oldest->used)
+                        oldest = lp;
+        }
+        if (lp == comp.listings + MAXLISTINGS) {
+                lp = oldest;
+                free(lp->path);
+                lp->path = strdup_or_die(path);
+                freenames(lp->names);
+                lp->names = NULL;
+        } else if (lp->dev != sb.st_dev || lp->ino != sb.st_ino ||
+            !samets(&lp->mtime, &sb.st_mtim)) {
+                /* Changed, or another directory, e.g. "." after a cd. */
+                freenames(lp->names);
+                lp->names = NULL;
+        }
+        if (lp->names == NULL) {
+                lp->names = readnames((char *const *)&path, 1, 0);
+                lp->dev = sb.st_dev;
+                lp->ino = sb.st_ino;
+                lp->mtime = sb.st_mtim;
+        }
+        lp->used = ++comp.clock;
+
+        return (lp->names);
+}
+
+static void
+addmatch(const char *s)
+{
+
+        if (comp.nmatches == comp.cap) {
+                comp.cap = comp.cap ? comp.cap * 2: 64;
+                comp.matches = realloc_or_die(comp.matches,
+                    comp.cap * sizeof(*comp.matches));
+        }
+        comp.matches[comp.nmatches++] = s;
+}
+
+/*
+ * Return the index of the first name of the table not before "prefix".
+ */
+static size_t
+search(const names_t *t, const char *prefix, size_t len)
+{
+        size_t lo;
+        size_t hi;
+
+        lo = 0;
+        hi = t->n;
+        while (lo < hi) {
+                size_t mid = (lo + hi) / 2;
+                if (strncmp(t->v[mid], prefix, len) < 0)
+                        lo = mid + 1;
+                else
+                        hi = mid;
+        }
+
+        return (lo);
+}
+
+static _Bool
+contains(const names_t *t, const char *name)
+{
+        size_t i;
+
+        if (t == NULL)
+                return (0);
+        i = search(t, name, strlen(name) + 1);
+        return (i < t->n && !strcmp(t->v[i], name));
+}
+
+/*
+ * Add the names of the table starting with "prefix".
+ */
+static void
+addprefixed(const names_t *t, const char *prefix, size_t len)
+{
+        size_t lo;
+
+        if (t == NULL)
+                return;
+        for (lo = search(t, prefix, len);
+             lo < t->n && !strncmp(t->v[lo], prefix, len); lo++)
+                if (prefix[0] == '.' || t->v[lo][0] != '.')
+                        addmatch(t->v[lo]);
+}
+
+/*
+ * Return true if the word starting at "start" is in command position:
+ * first on the line or after a separator.
+ */
+static _Bool
+iscmdpos(const char *line, size_t start)
+{
+        size_t end;
+
+        for (end = start; end > 0 && line[end - 1] == ' '; end--)
+                continue;
+        if (end == 0)
+                return (1);
+        if (strchr(";&|", line[end - 1]))
+                return (1);
+        while (end > 0 && line[end - 1] != ' ')
+                end--;
+        return (line[end] == '|');     /* |*4 and such */
+}
+
+/*
+ * Complete the word ending at "len" in "line": a command name in
+ * command position, a job number after a "%", and a file name
+ * otherwise.
+ *
+ * Return the number of candidates, stored in "*matchesp" until the
+ * next call.  They are made of the part of the word starting at
+ * "*startp" and of the rest.  Directories end with a slash.
+ */
+size_t
+complete(const char *line, size_t len, size_t *startp, const char ***matchesp)
+{
+        const char *name;
+        long ids[MAXJOBS];
+        size_t start;
+        char *word;
+        char *slash;
+        int n;
+
+        comp.nmatches = 0;
+        *matchesp = NULL;
+        for (start = len; start > 0 && !strchr(" \t|;&<>", line[start - 1]);
+             start--)
+                continue;
+        word = malloc_or_die(len - start + 1);
+        memcpy(word, line + start, len - start);
+        word[len - start] = '\0';
+
+        if (word[0] == '%') {
+                n = jobids(ids, MAXJOBS);
+                for (int i = n - 1; i >= 0; i--) {
+                        snprintf(comp.jobs[i], sizeof(comp.jobs[i]), "%%%ld",
+                            ids[i]);
+                        if (!strncmp(comp.jobs[i], word, len - start))
+                                addmatch(comp.jobs[i]);
+                }
+        } else if (iscmdpos(line, start) && strchr(word, '/') == NULL) {
+                complete_refresh();
+                if (comp.cmds == NULL && comp.building) {
+                        /* Only at startup. */
+                        void *t;
+                        pthread_join(comp.builder, &t);
+                        comp.building = 0;
+                        comp.cmds = t;
+                }
+                for (size_t i = 0; (name = bltinname(i)) != NULL; i++)
+                        if (!strncmp(name, word, len - start) &&
+                            !contains(comp.cmds, name))
+                                addmatch(name);
+                addprefixed(comp.cmds, word, len - start);
+        } else {
+                if ((slash = strrchr(word, '/')) != NULL) {
+                        name = slash + 1;
+                        start += name - word;
+                        *slash = '\0';
+                        addprefixed(listdir(slash == word ? "/": word), name,
+                            strlen(name));
+                } else
+                        addprefixed(listdir("."), word, len - start);
+        }
+        free(word);
+
+        *startp = start;
+        *matchesp = comp.matches;
+        return (comp.nmatches);
+}
@@ -0,0 +1,9 @@
+#ifndef ISH_COMPLETE_H_
+#define ISH_COMPLETE_H_
+
+#include <stddef.h>
+
+extern void complete_refresh(void);
+extern size_t complete(const char *, size_t, size_t *, const char ***);
+
+#endif  /* !ISH_COMPLETE_H_ */
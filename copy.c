@@ -0,0 +1,125 @@
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "copy.h"
+#include "utils.h"
+
+#define COPYBUFSIZ	(1024*1024)     /* read()/write() buffer size */
+#define COPYCHUNK	(1024*1024*1024) /* bytes per system call */
+
+/*
+ * Methods to copy data between two descriptors, from the cheapest.
+ * Each one returns the number of bytes copied by a single call, 0 at
+ * the end of the input, or -1 on error.
+ */
+static ssize_t
+byrange(int from, int to)
+{
+
+        return (copy_file_range(from, NULL, to, NULL, COPYCHUNK, 0));
+}
+
+static ssize_t
+bysplice(int from, int to)
+{
+
+        return (splice(from, NULL, to, NULL, COPYCHUNK,
+            SPLICE_F_MOVE|SPLICE_F_MORE));
+}
+
+static ssize_t
+bysendfile(int from, int to)
+{
+
+        return (sendfile(to, from, NULL, COPYCHUNK));
+}
+
+static ssize_t
+byreadwrite(int from, int to)
+{
+        static char *buf;
+        ssize_t n;
+        ssize_t w;
+
+        if (buf == NULL)
+                buf = malloc_or_die(COPYBUFSIZ);
+        if ((n = read(from, buf, COPYBUFSIZ)) <= 0)
+                return (n);
+        for (ssize_t off = 0; off < n; off += w)
+                if ((w = write(to, buf + off, n - off)) == -1) {
+                        if (errno != EINTR)
+                                return (-1);
+                        w = 0;
+                }
+
+        return (n);
+}
+
+/*
+ * Copy everything left to read from "from" into "to".
+ *
+ * The data stays in the kernel if possible: copy_file_range() is used
+ * between regular files, splice() if one of them is a pipe and
+ * sendfile() from a regular file.  A method unsupported by the
+ * descriptors, e.g. across file systems or in append mode, is given
+ * up for the next one as long as it hasn't copied anything.
+ *
+ * Return 0 on success and -1 on error with errno set.
+ */
+int
+copy_fd(int from, int to)
+{
+        ssize_t (*methods[4])(int, int);
+        struct stat in;
+        struct stat out;
+        int nmethods;
+        ssize_t n;
+
+        if (fstat(from, &in) == -1 || fstat(to, &out) == -1)
+                return (-1);
+
+        /*
+         * Some pseudo-files show an empty size while they aren't, and
+         * copy_file_range() copies nothing from them.
+         */
+        nmethods = 0;
+        if (S_ISREG(in.st_mode) && S_ISREG(out.st_mode) && in.st_size > 0)
+                methods[nmethods++] = byrange;
+        if (S_ISFIFO(in.st_mode) || S_ISFIFO(out.st_mode))
+                methods[nmethods++] = bysplice;
+        if (S_ISREG(in.st_mode))
+                methods[nmethods++] = bysendfile;
+        methods[nmethods++] = byreadwrite;
+
+        for (int i = 0; i < nmethods; i++) {
+                _Bool copied = 0;
+
+                for (;;) {
+                        if ((n = methods[i](from, to)) > 0) {
+                                copied = 1;
+                                continue;
+                        }
+                        if (n == 0)
+                                return (0);
+                        if (errno == EINTR)
+                                continue;
+                        if (copied || i == nmethods - 1)
+                                return (-1);
+                        if (errno != EINVAL && errno != EXDEV &&
+                            errno != ENOSYS && errno != EBADF &&
+                            errno != EOPNOTSUPP)
+                                return (-1);
+                        break;
+                }
+        }
+
+        return (-1);
+}
@@ -0,0 +1,6 @@
+#ifndef ISH_COPY_H_
+#define ISH_COPY_H_
+
+extern int copy_fd(int, int);
+
+#endif  /* !ISH_COPY_H_ */
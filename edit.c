@@ -0,0 +1,633 @@
+#define _GNU_SOURCE
+
+#include <sys/ioctl.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "complete.h"
+#include "edit.h"
+#include "hist.h"
+#include "utils.h"
+
+#ifndef CTRL
+#define CTRL(c)		((c) & 0x1f)
+#endif
+#define ESC		0x1b
+#define DEL		0x7f
+#define ESCDELAY	50      /* ms to tell the escape key from a sequence */
+#define PROMPT2		"> "    /* prompt of the continuation lines */
+#define LISTMAX		200     /* most completions listed */
+
+/* Keys sent as escape sequences. */
+enum {
+        K_NONE = 256,
+        K_UP,
+        K_DOWN,
+        K_LEFT,
+        K_RIGHT,
+        K_HOME,
+        K_END,
+        K_DELETE
+};
+
+/*
+ * The line editor reads the interactive input of the lexer.  It reads
+ * the terminal in raw mode one line at a time, with the usual Emacs
+ * keys, and keeps the history.  The terminal is back in its mode while
+ * the commands run.
+ *
+ * The text is UTF-8, with a column per character.  A line wider than
+ * the terminal scrolls horizontally.
+ */
+static struct {
+        int fd;                 /* terminal, -1 if disabled */
+        char *prompt;
+        char *buf;              /* line being edited */
+        size_t len;
+        size_t pos;             /* cursor */
+        size_t cap;
+        char *saved;            /* new line while browsing the history */
+        size_t savedlen;
+        int hidx;               /* entry shown, hist_count() if new line */
+        char *out;              /* accepted line given to the lexer */
+        size_t outlen;
+        size_t outpos;
+} ed = { .fd = -1 };
+
+static inline _Bool
+iscont(int c)
+{
+
+        return ((c & 0xc0) == 0x80);    /* UTF-8 continuation byte */
+}
+
+static size_t
+width(const char *s, size_t len)
+{
+        size_t n = 0;
+
+        for (size_t i = 0; i < len; i++)
+                n += !iscont(s[i]);
+        return (n);
+}
+
+static size_t
+nextchar(size_t i)
+{
+
+        while (++i < ed.len && iscont(ed.buf[i]))
+                continue;
+        return (i);
+}
+
+static size_t
+prevchar(size_t i)
+{
+
+        while (i > 0 && iscont(ed.buf[--i]))
+                continue;
+        return (i);
+}
+
+static int
+columns(void)
+{
+        struct winsize ws;
+
+        if (ioctl(ed.fd, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0)
+                return (80);
+        return (ws.ws_col);
+}
+
+static int
+readbyte(void)
+{
+        unsigned char c;
+        ssize_t n;
+
+        while ((n = read(ed.fd, &c, 1)) == -1 && errno == EINTR)
+                continue;
+        return (n == 1 ? c: -1);
+}
+
+/*
+ * Read a key, decoding the escape sequences of the special keys.
+ *
+ * Return -1 at the end of the input.
+ */
+static int
+readkey(void)
+{
+        struct pollfd pfd;
+        int num;
+        int c;
+
+        if ((c = readbyte()) != ESC)
+                return (c);
+        pfd.fd = ed.fd;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, ESCDELAY) <= 0)
+                return (ESC);
+        if ((c = readbyte()) != '[' && c != 'O')
+                return (c == -1 ? -1: K_NONE);
+
+        num = 0;
+        while ((c = readbyte()) != -1 && ((c >= '0' && c <= '9') || c == ';'))
+                num = c == ';' ? 0: num * 10 + c - '0';
+        switch (c) {
+        case 'A':
+                return (K_UP);
+        case 'B':
+                return (K_DOWN);
+        case 'C':
+                return (K_RIGHT);
+        case 'D':
+                return (K_LEFT);
+        case 'H':
+                return (K_HOME);
+        case 'F':
+                return (K_END);
+        case '~':
+                if (num == 1 || num == 7)
+                        return (K_HOME);
+                if (num == 4 || num == 8)
+                        return (K_END);
+                if (num == 3)
+                        return (K_DELETE);
+                return (K_NONE);
+        default:
+                return (c == -1 ? -1: K_NONE);
+        }
+}
+
+static void
+output(const char *s, size_t len)
+{
+        ssize_t n;
+
+        while (len > 0) {
+                if ((n = write(ed.fd, s, len)) == -1) {
+                        if (errno == EINTR)
+                                continue;
+                        return;
+                }
+                s += n;
+                len -= n;
+        }
+}
+
+/*
+ * Draw the prompt and the part of the line around the cursor that fits
+ * in the terminal.
+ */
+static void
+refresh(const char *prompt, const char *s, size_t len, size_t pos)
+{
+        size_t avail;
+        size_t plen;
+        size_t start;
+        size_t end;
+        size_t outlen;
+        char *out;
+        FILE *fp;
+
+        plen = width(prompt, strlen(prompt));
+        avail = (size_t)columns() > plen + 1 ? columns() - plen - 1: 1;
+        for (start = 0; width(s + start, pos - start) >= avail; start++)
+                while (start + 1 < pos && iscont(s[start + 1]))
+                        start++;
+        for (end = start; end < len && width(s + start, end - start) < avail;
+             end++)
+                while (end + 1 < len && iscont(s[end + 1]))
+                        end++;
+
+        if ((fp = open_memstream(&out, &outlen)) == NULL)
+                return;
+        fprintf(fp, "\r%s%.*s\x1b[K\r", prompt, (int)(end - start), s + start);
+        if (plen + width(s + start, pos - start) > 0)
+                fprintf(fp, "\x1b[%zuC", plen + width(s + start, pos - start));
+        fclose(fp);
+        output(out, outlen);
+        free(out);
+}
+
+static void
+setline(const char *s, size_t len)
+{
+
+        if (len + 1 > ed.cap) {
+                ed.cap = len + 1 > 2 * ed.cap ? len + 1: 2 * ed.cap;
+                ed.buf = realloc_or_die(ed.buf, ed.cap);
+        }
+        memcpy(ed.buf, s, len);
+        ed.len = ed.pos = len;
+}
+
+static void
+insert(const char *s, size_t len)
+{
+
+        if (ed.len + len + 1 > ed.cap) {
+                ed.cap = ed.len + len + 1 > 2 * ed.cap ? ed.len + len + 1:
+                    2 * ed.cap;
+                ed.buf = realloc_or_die(ed.buf, ed.cap);
+        }
+        memmove(ed.buf + ed.pos + len, ed.buf + ed.pos, ed.len - ed.pos);
+        memcpy(ed.buf + ed.pos, s, len);
+        ed.len += len;
+        ed.pos += len;
+}
+
+/*
+ * Delete the text between "from" and "to" and put the cursor there.
+ */
+static void
+delete(size_t from, size_t to)
+{
+
+        memmove(ed.buf + from, ed.buf + to, ed.len - to);
+        ed.len -= to - from;
+        ed.pos = from;
+}
+
+/*
+ * Show the history entry "i", hist_count() meaning the new line.  The
+ * new line is kept aside while browsing.
+ */
+static void
+browse(int i)
+{
+        const char *s;
+        size_t len;
+
+        if (i < 0 || i > hist_count())
+                return;
+        if (ed.hidx == hist_count()) {
+                free(ed.saved);
+                ed.saved = malloc_or_die(ed.len + 1);
+                memcpy(ed.saved, ed.buf, ed.len);
+                ed.savedlen = ed.len;
+        }
+        ed.hidx = i;
+        if (i == hist_count())
+                setline(ed.saved, ed.savedlen);
+        else {
+                s = hist_get(i, &len);
+                setline(s, len);
+        }
+}
+
+/*
+ * Reverse incremental search: each key typed extends the pattern and
+ * shows the latest entry containing it, ^R shows the previous one.  The
+ * match found is put in the line by any other key, which is then
+ * processed as usual, except for ^G and escape which cancel the search.
+ *
+ * Return the key ending the search.
+ */
+static int
+search(void)
+{
+        char prompt[128];
+        char pat[64];
+        const char *s;
+        size_t patlen;
+        size_t len;
+        size_t pos;
+        _Bool failing;
+        int cur;
+        int r;
+        int c;
+
+        patlen = 0;
+        cur = -1;
+        failing = 0;
+        for (;;) {
+                snprintf(prompt, sizeof(prompt), "(%sreverse-i-search)`%.*s': ",
+                    failing ? "failing ": "", (int)patlen, pat);
+                if (cur == -1)
+                        refresh(prompt, ed.buf, ed.len, ed.pos);
+                else {
+                        s = hist_get(cur, &len);
+                        pos = (const char *)memmem(s, len, pat, patlen) - s;
+                        refresh(prompt, s, len, pos);
+                }
+
+                switch (c = readkey()) {
+                case CTRL('R'):
+                        if (cur != -1 && (r = hist_search(pat, patlen, cur))
+                            != -1)
+                                cur = r;
+                        else
+                                failing = patlen > 0;
+                        continue;
+                case DEL:
+                case CTRL('H'):
+                        if (patlen == 0)
+                                continue;
+                        if (--patlen == 0)
+                                cur = -1;
+                        else
+                                cur = hist_search(pat, patlen, hist_count());
+                        failing = patlen > 0 && cur == -1;
+                        continue;
+                case CTRL('G'):
+                case ESC:
+                        return (K_NONE);
+                }
+                if (c >= ' ' && c < K_NONE && c != DEL) {
+                        if (patlen == sizeof(pat))
+                                continue;
+                        pat[patlen++] = c;
+                        r = hist_search(pat, patlen,
+                            cur == -1 ? hist_count(): cur + 1);
+                        if (r != -1)
+                                cur = r;
+                        failing = r == -1;
+                        continue;
+                }
+
+                if (cur != -1) {
+                        s = hist_get(cur, &len);
+                        setline(s, len);
+                        ed.pos = (const char *)memmem(s, len, pat, patlen) - s;
+                        ed.hidx = cur;
+                }
+                return (c);
+        }
+}
+
+/*
+ * List the completions below the line, in columns.
+ */
+static void
+listmatches(const char **matches, size_t n)
+{
+        size_t outlen;
+        size_t ncols;
+        size_t nrows;
+        size_t wid;
+        char *out;
+        FILE *fp;
+
+        if ((fp = open_memstream(&out, &outlen)) == NULL)
+                return;
+        fputs("\r\n", fp);
+        if (n > LISTMAX)
+                fprintf(fp, "%zu possibilities\r\n", n);
+        else {
+                wid = 0;
+                for (size_t i = 0; i < n; i++)
+                        if (width(matches[i], strlen(matches[i])) + 2 > wid)
+                                wid = width(matches[i], strlen(matches[i])) + 2;
+                ncols = columns() / wid ? columns() / wid: 1;
+                nrows = (n + ncols - 1) / ncols;
+                for (size_t r = 0; r < nrows; r++) {
+                        for (size_t i = r; i < n; i += nrows) {
+                                fputs(matches[i], fp);
+                                if (i + nrows < n)
+                                        fprintf(fp, "%*s", (int)(wid - width(
+                                            matches[i], strlen(matches[i]))),
+                                            "");
+                        }
+                        fputs("\r\n", fp);
+                }
+        }
+        fclose(fp);
+        output(out, outlen);
+        free(out);
+}
+
+/*
+ * Complete the word before the cursor as far as all the candidates
+ * agree, and list them if that's already done.  A single candidate is
+ * followed by a space, unless it's a directory.
+ */
+static void
+completeword(void)
+{
+        const char **matches;
+        size_t start;
+        size_t typed;
+        size_t common;
+        size_t n;
+
+        if ((n = complete(ed.buf, ed.pos, &start, &matches)) == 0) {
+                output("\a", 1);
+                return;
+        }
+        typed = ed.pos - start;
+        common = strlen(matches[0]);
+        for (size_t i = 1; i < n; i++)
+                for (size_t j = typed; j < common; j++)
+                        if (matches[i][j] != matches[0][j]) {
+                                common = j;
+                                break;
+                        }
+        if (common > typed)
+                insert(matches[0] + typed, common - typed);
+        if (n == 1 && matches[0][common - 1] != '/')
+                insert(" ", 1);
+        else if (n > 1 && common == typed)
+                listmatches(matches, n);
+}
+
+/*
+ * Handle a key.
+ *
+ * Return 1 when the line is accepted, -1 at the end of the input and 0
+ * otherwise.
+ */
+static int
+editkey(int c)
+{
+        size_t i;
+        char ch;
+
+        switch (c) {
+        case -1:
+                return (-1);
+        case '\r':
+        case '\n':
+                return (1);
+        case CTRL('D'):
+                if (ed.len == 0)
+                        return (-1);
+                /* FALLTHROUGH */
+        case K_DELETE:
+                if (ed.pos < ed.len)
+                        delete(ed.pos, nextchar(ed.pos));
+                break;
+        case DEL:
+        case CTRL('H'):
+                if (ed.pos > 0)
+                        delete(prevchar(ed.pos), ed.pos);
+                break;
+        case CTRL('C'):
+                output("^C\r\n", 4);
+                ed.len = ed.pos = 0;
+                ed.hidx = hist_count();
+                break;
+        case CTRL('A'):
+        case K_HOME:
+                ed.pos = 0;
+                break;
+        case CTRL('E'):
+        case K_END:
+                ed.pos = ed.len;
+                break;
+        case CTRL('B'):
+        case K_LEFT:
+                ed.pos = prevchar(ed.pos);
+                break;
+        case CTRL('F'):
+        case K_RIGHT:
+                ed.pos = nextchar(ed.pos);
+                break;
+        case CTRL('K'):
+                ed.len = ed.pos;
+                break;
+        case CTRL('U'):
+                delete(0, ed.pos);
+                break;
+        case CTRL('W'):
+                for (i = ed.pos; i > 0 && ed.buf[i - 1] == ' '; i--)
+                        continue;
+                while (i > 0 && ed.buf[i - 1] != ' ')
+                        i--;
+                delete(i, ed.pos);
+                break;
+        case CTRL('L'):
+                output("\x1b[H\x1b[2J", 7);
+                break;
+        case CTRL('P'):
+        case K_UP:
+                browse(hist_prev(ed.hidx));
+                break;
+        case CTRL('N'):
+        case K_DOWN:
+                browse(hist_next(ed.hidx));
+                break;
+        case CTRL('R'):
+                return (editkey(search()));
+        case '\t':
+                completeword();
+                break;
+        default:
+                if (c < ' ' || c == DEL || c >= K_NONE)
+                        break;
+                ch = c;
+                insert(&ch, 1);
+                break;
+        }
+
+        return (0);
+}
+
+/*
+ * Read a line from the terminal in raw mode and add it to the history.
+ *
+ * Return -1 at the end of the input.
+ */
+static int
+readline(void)
+{
+        struct termios saved;
+        struct termios raw;
+        int r;
+
+        hist_sync();
+        complete_refresh();
+        ed.len = ed.pos = 0;
+        ed.hidx = hist_count();
+
+        if (tcgetattr(ed.fd, &saved) == -1)
+                return (-1);
+        raw = saved;
+        raw.c_iflag &= ~(BRKINT|ICRNL|INLCR|ISTRIP|IXON);
+        raw.c_lflag &= ~(ECHO|ICANON|IEXTEN|ISIG);
+        raw.c_cc[VMIN] = 1;
+        raw.c_cc[VTIME] = 0;
+        if (tcsetattr(ed.fd, TCSADRAIN, &raw) == -1)
+                return (-1);
+
+        do {
+                refresh(ed.prompt, ed.buf, ed.len, ed.pos);
+        } while ((r = editkey(readkey())) == 0);
+        ed.pos = ed.len;
+        refresh(ed.prompt, ed.buf, ed.len, ed.pos);
+        output("\r\n", 2);
+        tcsetattr(ed.fd, TCSADRAIN, &saved);
+
+        if (r == 1)
+                hist_add(ed.buf, ed.len);
+        return (r == 1 ? 0: -1);
+}
+
+/*
+ * Edit the lines read from the terminal "fd".
+ */
+void
+edit_init(int fd)
+{
+
+        ed.fd = fd;
+        ed.cap = 256;
+        ed.buf = malloc_or_die(ed.cap);
+        edit_prompt("");
+}
+
+_Bool
+edit_enabled(void)
+{
+
+        return (ed.fd != -1);
+}
+
+/*
+ * Set the prompt of the next line read.  The lines after it get the
+ * continuation prompt.
+ */
+void
+edit_prompt(const char *prompt)
+{
+
+        free(ed.prompt);
+        ed.prompt = strdup_or_die(prompt);
+}
+
+/*
+ * Fill the buffer of the lexer with up to "max" bytes of the lines
+ * read.
+ *
+ * Return the number of bytes read, 0 at the end of the input.
+ */
+int
+edit_input(char *buf, int max)
+{
+        size_t n;
+
+        if (ed.outpos == ed.outlen) {
+                if (readline() == -1)
+                        return (0);
+                edit_prompt(PROMPT2);
+                free(ed.out);
+                ed.out = malloc_or_die(ed.len + 1);
+                memcpy(ed.out, ed.buf, ed.len);
+                ed.out[ed.len] = '\n';
+                ed.outlen = ed.len + 1;
+                ed.outpos = 0;
+        }
+        n = ed.outlen - ed.outpos < (size_t)max ? ed.outlen - ed.outpos: max;
+        memcpy(buf, ed.out + ed.outpos, n);
+        ed.outpos += n;
+
+        return (n);
+}
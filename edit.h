@@ -0,0 +1,9 @@
+#ifndef ISH_EDIT_H_
+#define ISH_EDIT_H_
+
+extern void edit_init(int);
+extern _Bool edit_enabled(void);
+extern void edit_prompt(const char *);
+extern int edit_input(char *, int);
+
+#endif  /* !ISH_EDIT_H_ */
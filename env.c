@@ -3,6 +3,7 @@
 #include <string.h>
 
 #include "env.h"
+#include "stats.h"
 #include "utils.h"
 
 typedef struct var {
@@ -47,6 +48,7 @@ env_get(const char *name)
 {
         var_t *vp;
 
+        STATS_INC(ST_ENVGETS);
         vp = lookup(name);
         return (vp ? vp->val: NULL);
 }
@@ -99,6 +101,7 @@ env_execargs(void)
         var_t *vp;
         size_t i;        
         
+        STATS_INC(ST_ENVBUILDS);
         len = 0;        
         for (vp = environ; vp; vp = vp->next)
                 len++;
@@ -0,0 +1,759 @@
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <ctype.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "array.h"
+#include "env.h"
+#include "err.h"
+#include "expand.h"
+#include "jobs.h"
+#include "main.h"
+#include "utils.h"
+#include "wildcard.h"
+
+/*
+ * Growable string used to assemble the words produced by an
+ * expansion.
+ */
+typedef struct strbuf {
+        char *buf;
+        size_t len;
+        size_t cap;
+} strbuf_t;
+
+/*
+ * State of the expansion of a single word.
+ */
+typedef struct expstate {
+        array_t *out;           /* resulting words */
+        strbuf_t cur;           /* word being built */
+        strbuf_t pat;           /* same word as a glob pattern */
+        _Bool quoted;           /* the word is quoted */
+        _Bool keep;             /* emit the current word even if empty */
+        _Bool glob;             /* the pattern has wildcards */
+        _Bool here;             /* expanding a here-document body */
+} expstate_t;
+
+/*
+ * Output of a command substitution.
+ */
+typedef struct output {
+        char *buf;
+        size_t len;
+        _Bool mapped;           /* "buf" is a memory mapping */
+} output_t;
+
+static const char ifs[] = " \t\n";
+
+#define DRAINSIZ	(64*1024) /* minimum read size from a pipe */
+
+static void
+sb_grow(strbuf_t *sb, size_t n)
+{
+        size_t cap;
+
+        if (sb->len + n < sb->cap)
+                return;
+
+        cap = sb->cap > 0 ? sb->cap: 16;
+        while (sb->len + n >= cap)
+                cap *= 2;
+        sb->buf = realloc_or_die(sb->buf, cap);
+        sb->cap = cap;
+}
+
+static void
+sb_append(strbuf_t *sb, const char *s, size_t n)
+{
+
+        sb_grow(sb, n);
+        memcpy(sb->buf + sb->len, s, n);
+        sb->len += n;
+}
+
+static inline void
+sb_putc(strbuf_t *sb, int c)
+{
+
+        sb_grow(sb, 1);
+        sb->buf[sb->len++] = c;
+}
+
+/*
+ * Return the null-terminated content of the buffer and reset it.  The
+ * caller owns the returned string.
+ */
+static char *
+sb_finish(strbuf_t *sb)
+{
+        char *s;
+
+        sb_grow(sb, 1);
+        sb->buf[sb->len] = '\0';
+        s = sb->buf;
+        sb->buf = NULL;
+        sb->len = 0;
+        sb->cap = 0;
+
+        return (s);
+}
+
+/*
+ * Append "n" characters to the word being built.
+ *
+ * Unless the word is quoted, the characters are also added to the
+ * glob pattern of the word.  If "literal" is true, the wildcards among
+ * them are escaped there so that they only match themselves.
+ */
+static void
+put(expstate_t *st, const char *s, size_t n, _Bool literal)
+{
+
+        sb_append(&st->cur, s, n);
+        if (st->quoted)
+                return;
+        for (size_t i = 0; i < n; i++) {
+                if (wildcard_ismeta(s[i])) {
+                        if (literal)
+                                sb_putc(&st->pat, '\\');
+                        else
+                                st->glob = 1;
+                } else if (s[i] == '\\')
+                        sb_putc(&st->pat, '\\');
+                sb_putc(&st->pat, s[i]);
+        }
+}
+
+/*
+ * Add the word being built to the result, if any.
+ *
+ * A word with wildcards is replaced by the sorted list of the matching
+ * pathnames.  If nothing matches, the word is kept as is.
+ */
+static void
+emit(expstate_t *st)
+{
+        char *pat;
+
+        if (st->glob) {
+                pat = sb_finish(&st->pat);
+                if (wildcard_expand(pat, st->out) > 0) {
+                        free(pat);
+                        free(sb_finish(&st->cur));
+                        st->keep = 0;
+                        st->glob = 0;
+                        return;
+                }
+                free(pat);
+        }
+        if (st->cur.len > 0 || st->keep)
+                array_append(st->out, sb_finish(&st->cur));
+        st->pat.len = 0;
+        st->keep = 0;
+        st->glob = 0;
+}
+
+/*
+ * Return true if the given character separates words.  Null bytes do
+ * too since they can't be part of an argument.
+ */
+static inline _Bool
+isifs(int c)
+{
+
+        return (c == '\0' || strchr(ifs, c) != NULL);
+}
+
+static inline _Bool
+isnamechar(int c)
+{
+
+        return (isalnum((unsigned char)c) || c == '_');
+}
+
+/*
+ * Split the given string into words separated by blanks.
+ */
+static array_t *
+splitwords(const char *s)
+{
+        array_t *words;
+        size_t n;
+
+        words = array_new();
+        for (;;) {
+                s += strspn(s, ifs);
+                if (*s == '\0')
+                        break;
+                n = strcspn(s, ifs);
+                char *w = malloc_or_die(n + 1);
+                memcpy(w, s, n);
+                w[n] = '\0';
+                array_append(words, w);
+                s += n;
+        }
+
+        return (words);
+}
+
+/*
+ * Parse a word index of the form "[n]", "[n-m]", "[n-]", "[-m]" or
+ * "[*]".  Indexes start at 1.
+ *
+ * Return a pointer past the closing bracket or NULL if the index is
+ * malformed.
+ */
+static const char *
+parseindex(const char *p, long *fromp, long *top)
+{
+        char *end;
+
+        if (*p != '[')
+                return (NULL);
+        p++;
+        *fromp = 1;
+        *top = -1;              /* up to the last word */
+        if (*p == '*')
+                p++;
+        else {
+                if (isdigit((unsigned char)*p)) {
+                        *fromp = strtol(p, &end, 10);
+                        p = end;
+                        if (*p != '-')
+                                *top = *fromp;
+                }
+                if (*p == '-') {
+                        p++;
+                        if (isdigit((unsigned char)*p)) {
+                                *top = strtol(p, &end, 10);
+                                p = end;
+                        }
+                }
+        }
+
+        return (*p == ']' ? p + 1: NULL);
+}
+
+/*
+ * Keep the words in the given index range only.
+ */
+static void
+selectwords(array_t *words, long from, long to, const char *name)
+{
+        int n;
+
+        if (to == -1)
+                to = words->len;
+        if (from < 1 || from > to || to > words->len) {
+                warnx("%s: subscript out of range", name);
+                from = 1;
+                to = 0;
+        }
+
+        n = 0;
+        for (int i = 0; i < words->len; i++) {
+                if (i+1 >= from && i+1 <= to)
+                        words->buf[n++] = words->buf[i];
+                else
+                        free(words->buf[i]);
+        }
+        words->len = n;
+}
+
+/*
+ * Apply the ":s/old/new/" modifier to the given word.  The
+ * substitution is done for every occurrence of "old" if "global" is
+ * true, otherwise for the first one only.  An ampersand in "new" is
+ * replaced by "old".
+ */
+static char *
+substitute(const char *w, const char *old, const char *new, _Bool global)
+{
+        strbuf_t sb = { NULL, 0, 0 };
+        const size_t oldlen = strlen(old);
+        const size_t newlen = strlen(new);
+        const char *s;
+
+        if (oldlen == 0)
+                return (strdup_or_die(w));
+
+        while ((s = strstr(w, old)) != NULL) {
+                sb_append(&sb, w, s - w);
+                for (size_t i = 0; i < newlen; i++) {
+                        if (new[i] == '&')
+                                sb_append(&sb, old, oldlen);
+                        else
+                                sb_putc(&sb, new[i]);
+                }
+                w = s + oldlen;
+                if (!global)
+                        break;
+        }
+        sb_append(&sb, w, strlen(w));
+
+        return (sb_finish(&sb));
+}
+
+/*
+ * Return a null-terminated copy of the first "n" characters of "s".
+ */
+static char *
+strndup_or_die(const char *s, size_t n)
+{
+        char *d;
+
+        d = malloc_or_die(n + 1);
+        memcpy(d, s, n);
+        d[n] = '\0';
+
+        return (d);
+}
+
+/*
+ * Apply the csh modifier "mod" to the given word.
+ */
+static char *
+modify(const char *w, int mod)
+{
+        const char *slash;
+        const char *dot;
+        size_t n;
+
+        slash = strrchr(w, '/');
+        switch (mod) {
+        case 'h':               /* head: remove the last component */
+                if (slash == NULL)
+                        return (strdup_or_die(w));
+                n = slash == w ? 1: (size_t)(slash - w);
+                break;
+        case 't':               /* tail: keep the last component */
+                return (strdup_or_die(slash ? slash + 1: w));
+        case 'r':               /* root: remove the extension */
+        case 'e':               /* keep the extension only */
+                dot = strrchr(slash ? slash: w, '.');
+                if (mod == 'e')
+                        return (strdup_or_die(dot ? dot + 1: ""));
+                n = dot ? (size_t)(dot - w): strlen(w);
+                break;
+        default:
+                return (strdup_or_die(w));
+        }
+
+        return (strndup_or_die(w, n));
+}
+
+/*
+ * Parse and apply the modifiers following a variable reference to
+ * every word of "words".
+ *
+ * Return a pointer past the last modifier.
+ */
+static const char *
+applymods(const char *p, array_t *words)
+{
+        const char *s;
+        char *old;
+        char *new;
+        size_t n;
+        _Bool global;
+        int delim;
+
+        while (*p == ':') {
+                const char *q = p + 1;
+                global = *q == 'g';
+                if (global)
+                        q++;
+                if (*q == 'h' || *q == 't' || *q == 'r' || *q == 'e') {
+                        for (int i = 0; i < words->len; i++) {
+                                char *w = modify(words->buf[i], *q);
+                                free(words->buf[i]);
+                                words->buf[i] = w;
+                        }
+                        p = q + 1;
+                        continue;
+                }
+                if (*q != 's' || q[1] == '\0')
+                        break;
+
+                delim = q[1];
+                s = q + 2;
+                n = strcspn(s, (char []){delim, '\0'});
+                if (s[n] == '\0')
+                        break;
+                old = strndup_or_die(s, n);
+                s += n + 1;
+                n = strcspn(s, (char []){delim, '\0'});
+                new = strndup_or_die(s, n);
+                p = s + n;
+                if (*p == delim)
+                        p++;
+                for (int i = 0; i < words->len; i++) {
+                        char *w = substitute(words->buf[i], old, new, global);
+                        free(words->buf[i]);
+                        words->buf[i] = w;
+                }
+                free(old);
+                free(new);
+        }
+
+        return (p);
+}
+
+/*
+ * Add the given words to the expansion.  Within double quotes, they
+ * are joined by a space into the current word.  Otherwise, each one
+ * of them becomes a separate argument.
+ */
+static void
+addwords(expstate_t *st, array_t *words)
+{
+
+        for (int i = 0; i < words->len; i++) {
+                const char *w = words->buf[i];
+                if (i > 0) {
+                        if (st->quoted)
+                                put(st, " ", 1, 1);
+                        else
+                                emit(st);
+                }
+                put(st, w, strlen(w), 0);
+        }
+}
+
+/*
+ * Expand the variable reference starting right after a dollar sign.
+ *
+ * The supported forms are $name, ${name}, $#name (number of words),
+ * $?name (1 if set, 0 otherwise) and $$ (shell process id).  A name
+ * can be followed by an index such as [2] or [2-4] selecting some of
+ * the words of the value and by any number of the csh modifiers :h,
+ * :t, :r, :e and :s/old/new/.
+ *
+ * Return a pointer past the reference or NULL if there's none.
+ */
+static const char *
+expandvar(const char *p, expstate_t *st)
+{
+        char numbuf[32];
+        char name[256];
+        const char *val;
+        const char *q;
+        array_t *words;
+        _Bool braces;
+        size_t n;
+        long from;
+        long to;
+        int op;
+
+        if (*p == '$') {
+                snprintf(numbuf, sizeof(numbuf), "%ld", (long)getpid());
+                put(st, numbuf, strlen(numbuf), 1);
+                return (p + 1);
+        }
+
+        op = 0;
+        if ((*p == '#' || *p == '?') && (isnamechar(p[1]) || p[1] == '{'))
+                op = *p++;
+        braces = *p == '{';
+        if (braces)
+                p++;
+        for (n = 0; isnamechar(p[n]); n++)
+                ;
+        if (n == 0 || n >= sizeof(name))
+                return (NULL);
+        memcpy(name, p, n);
+        name[n] = '\0';
+        p += n;
+
+        val = env_get(name);
+        if (op == '?') {
+                if (braces && *p++ != '}')
+                        return (NULL);
+                put(st, val ? "1": "0", 1, 1);
+                return (p);
+        }
+
+        if (st->quoted && op == 0 && *p != '[') {
+                words = array_new();
+                if (val)
+                        array_append(words, strdup_or_die(val));
+        } else
+                words = splitwords(val ? val: "");
+        if ((q = parseindex(p, &from, &to)) != NULL) {
+                p = q;
+                selectwords(words, from, to, name);
+        }
+        p = applymods(p, words);
+        if (braces && *p++ != '}') {
+                array_free(words);
+                return (NULL);
+        }
+
+        if (op == '#') {
+                snprintf(numbuf, sizeof(numbuf), "%d", words->len);
+                put(st, numbuf, strlen(numbuf), 1);
+        } else
+                addwords(st, words);
+        array_free(words);
+
+        return (p);
+}
+
+/*
+ * Read everything from the given file descriptor into "out".
+ */
+static void
+drain(int fd, output_t *out)
+{
+        size_t cap;
+        ssize_t n;
+
+        cap = DRAINSIZ;
+        out->buf = malloc_or_die(cap);
+        for (;;) {
+                if (cap - out->len < DRAINSIZ) {
+                        cap *= 2;
+                        out->buf = realloc_or_die(out->buf, cap);
+                }
+                n = read(fd, out->buf + out->len, cap - out->len);
+                if (n == 0)
+                        break;
+                if (n == -1) {
+                        if (errno == EINTR)
+                                continue;
+                        err_sys("read");
+                }
+                out->len += n;
+        }
+}
+
+/*
+ * Run the given command line in a subshell and store its standard
+ * output in "out".
+ *
+ * The subshell writes into an anonymous memory file, which is then
+ * mapped as a whole, so the output is never copied nor grown.  If such
+ * a file can't be created, the output is read from a pipe.
+ */
+static void
+capture(const char *cmd, output_t *out)
+{
+        struct stat sb;
+        int pfd[2];
+        pid_t pid;
+        int fd;
+
+        out->buf = NULL;
+        out->len = 0;
+        out->mapped = 0;
+        fd = memfd_create("ish-subst", MFD_CLOEXEC);
+        if (fd == -1 && pipe2(pfd, O_CLOEXEC) == -1)
+                err_sys("pipe");
+
+        if ((pid = forksubshell()) == 0) {
+                /* child */
+                if (dup2(fd != -1 ? fd: pfd[1], STDOUT_FILENO) == -1)
+                        err_sys("dup2");
+                evalstr(cmd);
+                exit(0);
+        }
+
+        if (fd == -1) {
+                close_or_die(pfd[1]);
+                drain(pfd[0], out);
+                close_or_die(pfd[0]);
+        }
+        while (waitpid(pid, NULL, 0) == -1)
+                if (errno != EINTR)
+                        err_sys("waitpid");
+        if (fd == -1)
+                return;
+
+        if (fstat(fd, &sb) == -1)
+                err_sys("fstat");
+        if (sb.st_size > 0) {
+                out->buf = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE,
+                                fd, 0);
+                if (out->buf == MAP_FAILED)
+                        err_sys("mmap");
+                out->len = sb.st_size;
+                out->mapped = 1;
+        }
+        close_or_die(fd);
+}
+
+static void
+freeoutput(output_t *out)
+{
+
+        if (out->mapped)
+                munmap(out->buf, out->len);
+        else
+                free(out->buf);
+}
+
+/*
+ * Expand the command substitution starting at "p", either `cmd` or
+ * $(cmd).
+ *
+ * The trailing newlines of the output are removed.  Unquoted, it's
+ * split into words at blanks and newlines, which are taken directly
+ * from the output.  Quoted, it's kept as a single word.
+ *
+ * Return a pointer past the substitution or NULL if there's none.
+ */
+static const char *
+substcmd(const char *p, const char *end, expstate_t *st)
+{
+        output_t out;
+        const char *start;
+        const char *close;
+        const char *s;
+        const char *e;
+        char *cmd;
+
+        start = *p == '`' ? p + 1: p + 2;
+        close = memchr(start, *p == '`' ? '`': ')', end - start);
+        if (close == NULL)
+                return (NULL);
+
+        cmd = strndup_or_die(start, close - start);
+        capture(cmd, &out);
+        free(cmd);
+
+        s = out.buf;
+        e = out.buf + out.len;
+        while (e > s && e[-1] == '\n')
+                e--;
+        if (st->quoted)
+                put(st, s, e - s, 1);
+        else {
+                while (s < e) {
+                        const char *w;
+                        if (isifs(*s)) {
+                                while (s < e && isifs(*s))
+                                        s++;
+                                emit(st);
+                                continue;
+                        }
+                        for (w = s; s < e && !isifs(*s); s++)
+                                ;
+                        put(st, w, s - w, 1);
+                }
+        }
+        freeoutput(&out);
+
+        return (close + 1);
+}
+
+/*
+ * Expand the characters from "p" to "end" into the current word.
+ * "quote" is the quote character surrounding them, if any.
+ */
+static void
+expand(expstate_t *st, const char *p, const char *end, int quote)
+{
+
+        while (p < end) {
+                if (*p == '\\' && (!st->here || (p + 1 < end &&
+                    strchr("$`\\", p[1]) != NULL))) {
+                        if (++p < end)
+                                put(st, p++, 1, 1);
+                        continue;
+                }
+                if ((*p == '`' || (*p == '$' && p[1] == '(')) &&
+                    quote != '\'') {
+                        const char *next = substcmd(p, end, st);
+                        if (next) {
+                                p = next;
+                                continue;
+                        }
+                }
+                if (*p == '$' && quote != '\'') {
+                        const char *next = expandvar(p + 1, st);
+                        if (next) {
+                                p = next;
+                                continue;
+                        }
+                }
+                put(st, p++, 1, 0);
+        }
+}
+
+/*
+ * Expand a single word of a command line and append the resulting
+ * arguments to "out".
+ *
+ * Single quotes prevent any expansion.  In both quoted forms, the
+ * result is a single argument, even if it's empty.  Unquoted variable
+ * values and command substitutions are split into several arguments
+ * and unquoted words with wildcards are replaced by the matching
+ * pathnames.  In any case, escape characters are removed.
+ */
+void
+expand_word(const char *arg, array_t *out)
+{
+        expstate_t st;
+        const char *end;
+        int quote;
+
+        memset(&st, 0, sizeof(st));
+        st.out = out;
+
+        quote = 0;
+        end = arg + strlen(arg);
+        if (arg[0] == '\'' || arg[0] == '\"') {
+                quote = arg[0];
+                arg++;
+                end--;
+                st.quoted = 1;
+                st.keep = 1;
+        }
+
+        expand(&st, arg, end, quote);
+        emit(&st);
+        free(st.pat.buf);
+}
+
+/*
+ * Expand the body of a here-document and return it as a new string.
+ *
+ * The body is expanded as if it were double-quoted, except that a
+ * backslash only escapes "$", "`" and itself.
+ */
+char *
+expand_text(const char *text)
+{
+        expstate_t st;
+        array_t *out;
+        char *s;
+
+        out = array_new();
+        memset(&st, 0, sizeof(st));
+        st.out = out;
+        st.quoted = 1;
+        st.keep = 1;
+        st.here = 1;
+
+        expand(&st, text, text + strlen(text), '"');
+        emit(&st);
+        free(st.pat.buf);
+
+        s = array_get(out, 0);
+        out->len = 0;
+        array_free(out);
+
+        return (s);
+}
@@ -0,0 +1,9 @@
+#ifndef ISH_EXPAND_H_
+#define ISH_EXPAND_H_
+
+#include "array.h"
+
+extern void expand_word(const char *, array_t *);
+extern char *expand_text(const char *);
+
+#endif  /* !ISH_EXPAND_H_ */
@@ -0,0 +1,426 @@
+#define _GNU_SOURCE
+
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "err.h"
+#include "hist.h"
+#include "utils.h"
+
+#define FNV_OFFSET	UINT64_C(0xcbf29ce484222325)
+#define FNV_PRIME	UINT64_C(0x100000001b3)
+
+/*
+ * The history is a log file of command lines, one per line, shared by
+ * all the shells of the user.  It's only ever appended to, under an
+ * exclusive flock(2), and read through a shared mapping.
+ *
+ * The entries are indexed in memory in the order of the file.  Only
+ * the latest of identical lines is alive, which a hash table of the
+ * lines finds.  A trigram index makes searching instant: it maps each
+ * sequence of 3 bytes to the entries containing it, from the oldest.
+ * A match of a pattern is searched among the entries containing its
+ * rarest trigram only.
+ */
+typedef struct entry {
+        off_t off;              /* offset in the file */
+        uint32_t len;           /* length without the newline */
+        _Bool dead;             /* an identical line came later */
+} entry_t;
+
+typedef struct posting {
+        uint32_t key;           /* trigram + 1, 0 for a free slot */
+        uint32_t *ids;          /* entries containing it, in order */
+        uint32_t n;
+        uint32_t cap;
+} posting_t;
+
+static struct {
+        int fd;
+        char *map;              /* mapping of the file */
+        size_t maplen;
+        off_t indexed;          /* length of the file indexed so far */
+        entry_t *ents;
+        int nents;
+        int cap;
+        int *lines;             /* entry of each line + 1, 0 if free */
+        size_t nlines;          /* slots used in "lines" */
+        size_t linescap;        /* power of 2 */
+        posting_t *grams;
+        size_t ngrams;
+        size_t gramscap;        /* power of 2 */
+} hist = { .fd = -1 };
+
+static uint64_t
+fnv(const char *s, size_t len)
+{
+        uint64_t h = FNV_OFFSET;
+
+        while (len-- > 0) {
+                h ^= (unsigned char)*s++;
+                h *= FNV_PRIME;
+        }
+
+        return (h);
+}
+
+static inline const char *
+text(const entry_t *e)
+{
+
+        return (hist.map + e->off);
+}
+
+/*
+ * Return the slot of the line in the hash table of the lines, which
+ * is free if the line isn't there.
+ */
+static int *
+findline(const char *s, size_t len)
+{
+        size_t mask = hist.linescap - 1;
+        size_t i;
+
+        for (i = fnv(s, len) & mask; hist.lines[i]; i = (i + 1) & mask) {
+                const entry_t *e = &hist.ents[hist.lines[i] - 1];
+                if (e->len == len && !memcmp(text(e), s, len))
+                        break;
+        }
+
+        return (&hist.lines[i]);
+}
+
+static void
+growlines(void)
+{
+        int *old = hist.lines;
+        size_t oldcap = hist.linescap;
+
+        hist.linescap = oldcap ? oldcap * 2: 1024;
+        hist.lines = calloc(hist.linescap, sizeof(*hist.lines));
+        if (hist.lines == NULL)
+                err_sys("calloc");
+        for (size_t i = 0; i < oldcap; i++) {
+                if (old[i] == 0)
+                        continue;
+                const entry_t *e = &hist.ents[old[i] - 1];
+                *findline(text(e), e->len) = old[i];
+        }
+        free(old);
+}
+
+static posting_t *
+findgram(uint32_t key)
+{
+        size_t mask = hist.gramscap - 1;
+        size_t i;
+
+        for (i = (key * UINT32_C(2654435761)) & mask;
+             hist.grams[i].key && hist.grams[i].key != key;
+             i = (i + 1) & mask)
+                continue;
+
+        return (&hist.grams[i]);
+}
+
+static void
+growgrams(void)
+{
+        posting_t *old = hist.grams;
+        size_t oldcap = hist.gramscap;
+
+        hist.gramscap = oldcap ? oldcap * 2: 4096;
+        hist.grams = calloc(hist.gramscap, sizeof(*hist.grams));
+        if (hist.grams == NULL)
+                err_sys("calloc");
+        for (size_t i = 0; i < oldcap; i++)
+                if (old[i].key)
+                        *findgram(old[i].key) = old[i];
+        free(old);
+}
+
+static inline uint32_t
+gramkey(const char *s)
+{
+
+        return (((uint32_t)(unsigned char)s[0] << 16 |
+            (uint32_t)(unsigned char)s[1] << 8 |
+            (unsigned char)s[2]) + 1);
+}
+
+/*
+ * Add the record of the file at "off" to the index.
+ */
+static void
+addentry(off_t off, size_t len)
+{
+        entry_t *e;
+        int *slot;
+        int id;
+
+        if (hist.nents == hist.cap) {
+                hist.cap = hist.cap ? hist.cap * 2: 1024;
+                hist.ents = realloc_or_die(hist.ents,
+                    hist.cap * sizeof(*hist.ents));
+        }
+        id = hist.nents++;
+        e = &hist.ents[id];
+        e->off = off;
+        e->len = len;
+        e->dead = 0;
+
+        if (2 * (hist.nlines + 1) > hist.linescap)
+                growlines();
+        slot = findline(text(e), len);
+        if (*slot)
+                hist.ents[*slot - 1].dead = 1;
+        else
+                hist.nlines++;
+        *slot = id + 1;
+
+        for (size_t i = 0; i + 3 <= len; i++) {
+                posting_t *p;
+
+                if (2 * (hist.ngrams + 1) > hist.gramscap)
+                        growgrams();
+                p = findgram(gramkey(text(e) + i));
+                if (p->key == 0) {
+                        p->key = gramkey(text(e) + i);
+                        hist.ngrams++;
+                }
+                if (p->n > 0 && p->ids[p->n - 1] == (uint32_t)id)
+                        continue;       /* repeated in the line */
+                if (p->n == p->cap) {
+                        p->cap = p->cap ? p->cap * 2: 4;
+                        p->ids = realloc_or_die(p->ids,
+                            p->cap * sizeof(*p->ids));
+                }
+                p->ids[p->n++] = id;
+        }
+}
+
+static void
+reset(void)
+{
+
+        for (size_t i = 0; i < hist.gramscap; i++)
+                free(hist.grams[i].ids);
+        free(hist.grams);
+        free(hist.lines);
+        hist.grams = NULL;
+        hist.lines = NULL;
+        hist.ngrams = hist.gramscap = 0;
+        hist.nlines = hist.linescap = 0;
+        hist.nents = 0;
+        hist.indexed = 0;
+}
+
+/*
+ * Index the records appended to the file since the last time, by this
+ * shell or another one.  The file must be locked.
+ */
+static void
+catchup(void)
+{
+        struct stat sb;
+        char *nl;
+        off_t off;
+
+        if (fstat(hist.fd, &sb) == -1)
+                return;
+        if (sb.st_size < hist.indexed)
+                reset();        /* truncated */
+        if (sb.st_size == hist.indexed)
+                return;
+
+        if (hist.map == NULL)
+                hist.map = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED,
+                    hist.fd, 0);
+        else
+                hist.map = mremap(hist.map, hist.maplen, sb.st_size,
+                    MREMAP_MAYMOVE);
+        if (hist.map == MAP_FAILED) {
+                warn("history");
+                hist.map = NULL;
+                hist.maplen = 0;
+                reset();
+                return;
+        }
+        hist.maplen = sb.st_size;
+
+        for (off = hist.indexed; off < sb.st_size; off = nl - hist.map + 1) {
+                nl = memchr(hist.map + off, '\n', sb.st_size - off);
+                if (nl == NULL)
+                        break;  /* incomplete */
+                if (nl > hist.map + off)
+                        addentry(off, nl - (hist.map + off));
+        }
+        hist.indexed = off;
+}
+
+/*
+ * Open the history file and index it.  The history is disabled if it
+ * can't be opened.
+ */
+void
+hist_open(const char *path)
+{
+
+        hist.fd = open(path, O_RDWR|O_APPEND|O_CREAT|O_CLOEXEC, 0600);
+        if (hist.fd == -1) {
+                warn("history: %s", path);
+                return;
+        }
+        hist_sync();
+}
+
+/*
+ * Take in the lines added by the other shells.
+ */
+void
+hist_sync(void)
+{
+
+        if (hist.fd == -1)
+                return;
+        flock(hist.fd, LOCK_SH);
+        catchup();
+        flock(hist.fd, LOCK_UN);
+}
+
+/*
+ * Append a line to the history, unless it's blank or the same as the
+ * last one.
+ */
+void
+hist_add(const char *line, size_t len)
+{
+        struct iovec iov[2];
+        int last;
+
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == ' '))
+                len--;
+        if (hist.fd == -1 || len == 0 || memchr(line, '\n', len))
+                return;
+
+        flock(hist.fd, LOCK_EX);
+        catchup();
+        last = hist_prev(hist.nents);
+        if (last == -1 || hist.ents[last].len != len ||
+            memcmp(text(&hist.ents[last]), line, len)) {
+                iov[0].iov_base = (void *)line;
+                iov[0].iov_len = len;
+                iov[1].iov_base = "\n";
+                iov[1].iov_len = 1;
+                if (writev(hist.fd, iov, 2) == -1)
+                        warn("history");
+                catchup();
+        }
+        flock(hist.fd, LOCK_UN);
+}
+
+/*
+ * Return the number of entries, which is also the index of the empty
+ * line after the last one.
+ */
+int
+hist_count(void)
+{
+
+        return (hist.nents);
+}
+
+/*
+ * Return the text of the entry "i", not null-terminated.
+ */
+const char *
+hist_get(int i, size_t *lenp)
+{
+
+        *lenp = hist.ents[i].len;
+        return (text(&hist.ents[i]));
+}
+
+/*
+ * Return the live entry before "i", or -1.
+ */
+int
+hist_prev(int i)
+{
+
+        while (--i >= 0 && hist.ents[i].dead)
+                continue;
+        return (i);
+}
+
+/*
+ * Return the live entry after "i", or hist_count().
+ */
+int
+hist_next(int i)
+{
+
+        while (++i < hist.nents && hist.ents[i].dead)
+                continue;
+        return (i);
+}
+
+/*
+ * Return the latest live entry before "before" containing "pat", or -1.
+ */
+int
+hist_search(const char *pat, size_t len, int before)
+{
+        const posting_t *rarest;
+        const posting_t *p;
+        size_t lo;
+        size_t hi;
+
+        if (len < 3) {
+                for (int i = hist_prev(before); i >= 0; i = hist_prev(i))
+                        if (memmem(text(&hist.ents[i]), hist.ents[i].len,
+                            pat, len))
+                                return (i);
+                return (-1);
+        }
+
+        rarest = NULL;
+        for (size_t i = 0; i + 3 <= len; i++) {
+                if (hist.gramscap == 0)
+                        return (-1);
+                p = findgram(gramkey(pat + i));
+                if (p->key == 0)
+                        return (-1);
+                if (rarest == NULL || p->n < rarest->n)
+                        rarest = p;
+        }
+
+        /* Find the first entry of the list not before "before". */
+        lo = 0;
+        hi = rarest->n;
+        while (lo < hi) {
+                size_t mid = (lo + hi) / 2;
+                if (rarest->ids[mid] < (uint32_t)before)
+                        lo = mid + 1;
+                else
+                        hi = mid;
+        }
+        while (lo-- > 0) {
+                const entry_t *e = &hist.ents[rarest->ids[lo]];
+                if (!e->dead && memmem(text(e), e->len, pat, len))
+                        return (rarest->ids[lo]);
+        }
+
+        return (-1);
+}
@@ -0,0 +1,15 @@
+#ifndef ISH_HIST_H_
+#define ISH_HIST_H_
+
+#include <stddef.h>
+
+extern void hist_open(const char *);
+extern void hist_sync(void);
+extern void hist_add(const char *, size_t);
+extern int hist_count(void);
+extern const char *hist_get(int, size_t *);
+extern int hist_prev(int);
+extern int hist_next(int);
+extern int hist_search(const char *, size_t, int);
+
+#endif  /* !ISH_HIST_H_ */
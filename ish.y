@@ -11,12 +11,21 @@
 #include <pwd.h>
 
 #include "cmd.h"
+#include "utils.h"
 
 // The abstract syntax tree root.
 cmd_t *root;
 
+// Size of the pipe of the last "|[size]" separator.
+static int pipesize;
+
+// Replicas of the command after the last "|*N" separator.
+static int replicas;
+
 int yylex(void);
 int yyerror(char *);
+void heredoc_add(char **, const char *);
+void heredoc_cancel(void);
 %}
 
 %union
@@ -30,14 +39,19 @@ int yyerror(char *);
 %token 	<string>	COMMAND
 %token 	<string>	FILENAME
 %token	<int>           BACKGROUND
-%token	<int>           PIPE
-%token	<int>		PIPE_ERROR
+%token	<integer>       PIPE
+%token	<integer>	PIPE_ERROR
+%token			PIPE_TEE
+%token	<integer>	PIPE_PAR
+%token	<integer>	PIPE_PARORD
 %token	<int>           SEMICOLON
 %token	<int>		REDIRECT_IN
 %token	<int>		REDIRECT_OUT
 %token	<int>		REDIRECT_ERROR
 %token	<int>		APPEND
 %token	<int>		APPEND_ERROR
+%token	<int>		HEREDOC
+%token	<int>		HERESTRING
 %token	<string>	OPTION
 %token	<string>	STRING
 %token	<int>		LOGICAL_AND
@@ -63,9 +77,20 @@ cmd_line 	: cmd_line separator COMMAND parameters
                                         break;
                                 case PIPE:
                                 	last->mode = C_PIPE;
+                                        last->pipesize = pipesize;
                                         break;
                                 case PIPE_ERROR:
                                 	last->mode = C_PIPEERR;
+                                        last->pipesize = pipesize;
+                                        break;
+                                case PIPE_TEE:
+                                	last->mode = C_TEE;
+                                        break;
+                                case PIPE_PAR:
+                                case PIPE_PARORD:
+                                	last->mode = C_PIPE;
+                                        $4->replicas = replicas;
+                                        $4->ordered = $2 == PIPE_PARORD;
                                         break;
                                 default:
                                 	cmd_free($1);
@@ -106,8 +131,11 @@ cmd_line 	: cmd_line separator COMMAND parameters
 		;
 
 separator 	: BACKGROUND { $$ = BACKGROUND; };
-		| PIPE { $$ = PIPE; }
-		| PIPE_ERROR { $$ = PIPE_ERROR; }
+		| PIPE { $$ = PIPE; pipesize = $1; }
+		| PIPE_ERROR { $$ = PIPE_ERROR; pipesize = $1; }
+		| PIPE_TEE { $$ = PIPE_TEE; }
+		| PIPE_PAR { $$ = PIPE_PAR; replicas = $1; }
+		| PIPE_PARORD { $$ = PIPE_PARORD; replicas = $1; }
 		| SEMICOLON { $$ = SEMICOLON; }
 		;
 
@@ -116,6 +144,28 @@ parameters	: parameters OPTION
 		| parameters WORD { array_append($1->args, $2); }
 		| parameters REDIRECT_IN FILENAME { $1->filein = $3; }
                 | parameters REDIRECT_OUT FILENAME { $1->fileout = $3; }
+		| parameters HEREDOC FILENAME
+                {
+                	free($1->heredelim);
+                	$1->heredelim = $3;
+                        heredoc_add(&$1->herein, $3);
+                }
+		| parameters HEREDOC STRING
+                {
+                	free($1->heredelim);
+                	$1->heredelim = $3;
+                        heredoc_add(&$1->herein, $3);
+                }
+		| parameters HERESTRING FILENAME
+                {
+                	free($1->herein);
+                	$1->herein = $3;
+                }
+		| parameters HERESTRING STRING
+                {
+                	free($1->herein);
+                	$1->herein = $3;
+                }
 		| parameters REDIRECT_ERROR FILENAME
                 {
                 	$1->fileout = $3; 
@@ -139,6 +189,7 @@ parameters	: parameters OPTION
 
 int yyerror(char *s)
 {
+    heredoc_cancel();
     fprintf(stderr, "syntax error\n");
     return 0;
 }
@@ -1,4 +1,4 @@
-#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
 
 #include <sys/types.h>
 #include <sys/wait.h>
@@ -11,9 +11,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "err.h"
 #include "jobs.h"
+#include "meter.h"
+#include "metrics.h"
+#include "stats.h"
+#include "trace.h"
 #include "utils.h"
 
 static const int minjobsnum = 4; /* minimum number of jobs to allocate */
@@ -29,6 +34,8 @@ static struct {
 static int ttyfd = -1;    /* controlling tty file descriptor */
 static pid_t shellpgrp = -1; /* shell process group */
 static pid_t shellpid = -1;  /* shell process id */
+static _Bool jobctl = 1;     /* job control is enabled */
+static int lastst;           /* status of the last foreground command */
 
 static void
 sigaction_or_die(int signo,
@@ -52,6 +59,7 @@ handlesig(int signo, void (*handler)(int), struct sigaction *oldact)
         struct sigaction sa;
 
         sa.sa_handler = handler;
+        sa.sa_flags = 0;
         sigemptyset(&sa.sa_mask);
         sigaction_or_die(signo, &sa, oldact);
 }
@@ -108,14 +116,21 @@ termhandler(int signo)
 /*
  * Initialize various variables used for job control by the shell and
  * some of its properties.
+ *
+ * A non-interactive shell has no job control: its commands stay in its
+ * process group and it can be interrupted along with them.
  */
 void
-initjobs(void)
+initjobs(_Bool interactive)
 {
 
-        ttyfd = open_or_die(_PATH_TTY, O_RDWR | O_CLOEXEC);
         shellpgrp = getpgrp();
         shellpid = getpid();
+        if (!interactive) {
+                jobctl = 0;
+                return;
+        }
+        ttyfd = open_or_die(_PATH_TTY, O_RDWR | O_CLOEXEC);
 
         // Handle various signals.
         ignoresig(SIGQUIT);
@@ -123,12 +138,24 @@ initjobs(void)
         handlesig(SIGTERM, termhandler, NULL);
 }
 
+/*
+ * Return the descriptor of the controlling terminal, or -1 if the shell
+ * isn't interactive.
+ */
+int
+gettty(void)
+{
+
+        return (ttyfd);
+}
+
 static void
 increasebuf(void)
 {
         job_t *jp;
         int nnum;
 
+        STATS_INC(ST_JOBGROWS);
         nnum = jobs.num == 0 ? minjobsnum: jobs.num*2;
         jp = malloc_or_die(nnum * sizeof(*jp));
         memcpy(jp, jobs.buf, jobs.num*sizeof(*jp));
@@ -168,6 +195,7 @@ decreasebuf(void)
 
         if (jobs.num <= minjobsnum)
                 return;
+        STATS_INC(ST_JOBSHRINKS);
         nnum = jobs.num / 2;
         newjp = malloc_or_die(nnum * sizeof(*newjp));
 
@@ -210,7 +238,9 @@ freealljobs(void)
         jobs.all = NULL;
         jobs.free = NULL;
         jobs.num = 0;
+        jobs.nfree = 0;
         free(jobs.buf);
+        jobs.buf = NULL;
 }
 
 /*
@@ -221,6 +251,7 @@ makejob(int nprocs, char *cmd)
 {
         job_t *jp;
 
+        STATS_INC(ST_JOBSMADE);
         if (jobs.num >= jobs.nfree*2)
                 increasebuf();
 
@@ -231,7 +262,11 @@ makejob(int nprocs, char *cmd)
         jobs.all = jp;
 
         jp->cmd = cmd;
+        jp->meter = NULL;
         jp->nprocs = 0;
+        jp->start = stats_now();
+        jp->end = jp->start;
+        memset(&jp->ru, 0, sizeof(jp->ru));
         if (nprocs == 1)
                 jp->ps = &jp->ps0;
         else
@@ -240,10 +275,78 @@ makejob(int nprocs, char *cmd)
         return (jp);
 }
 
+static inline long
+jobnum(const job_t *jp)
+{
+
+        return (1 + jp-jobs.buf);
+}
+
+/*
+ * Return the exit status of the given job as in sh(1), the one of its
+ * last process unless one of them has been stopped, or -1 if unknown.
+ */
+static int
+jobstatus(const job_t *jp)
+{
+        int status;
+
+        /* E.g. if the fork() of its first process failed. */
+        if (jp->nprocs == 0)
+                return (-1);
+        status = jp->ps[jp->nprocs - 1].status;
+        for (short i = 0; i < jp->nprocs; i++)
+                if (jp->ps[i].status != -1 && WIFSTOPPED(jp->ps[i].status))
+                        status = jp->ps[i].status;
+        if (WIFEXITED(status))
+                return (WEXITSTATUS(status));
+        if (WIFSIGNALED(status))
+                return (128 + WTERMSIG(status));
+        if (WIFSTOPPED(status))
+                return (128 + WSTOPSIG(status));
+
+        return (-1);
+}
+
+static inline void
+tvadd(struct timeval *tv, const struct timeval *inc)
+{
+
+        tv->tv_sec += inc->tv_sec;
+        tv->tv_usec += inc->tv_usec;
+        if (tv->tv_usec >= 1000000) {
+                tv->tv_sec++;
+                tv->tv_usec -= 1000000;
+        }
+}
+
 /*
- * Free the resources used by the given job.
+ * Account for the resources used by a process of the job, as returned
+ * by wait4() with its status.  Only the ones of the exited processes
+ * are final.
  */
 static void
+accountproc(job_t *jp, int status, const struct rusage *ru)
+{
+
+        if (!WIFEXITED(status) && !WIFSIGNALED(status))
+                return;
+        jp->end = stats_now();
+        tvadd(&jp->ru.ru_utime, &ru->ru_utime);
+        tvadd(&jp->ru.ru_stime, &ru->ru_stime);
+        if (ru->ru_maxrss > jp->ru.ru_maxrss)
+                jp->ru.ru_maxrss = ru->ru_maxrss;
+        jp->ru.ru_minflt += ru->ru_minflt;
+        jp->ru.ru_majflt += ru->ru_majflt;
+        jp->ru.ru_nvcsw += ru->ru_nvcsw;
+        jp->ru.ru_nivcsw += ru->ru_nivcsw;
+}
+
+/*
+ * Free the resources used by the given job.  The statistics of a
+ * metered job are shown a last time.
+ */
+void
 freejob(job_t *jp)
 {
         job_t *prev;
@@ -260,6 +363,14 @@ freejob(job_t *jp)
                 }
         err_quit("freejob: job not found: %p", jp);
 found:
+        STATS_INC(ST_JOBSFREED);
+        metrics_job(jp->cmd, jobstatus(jp), jp->end - jp->start, &jp->ru);
+        if (jp->meter) {
+                fprintf(stderr, "[%ld] pipestat: %s\n", jobnum(jp), jp->cmd);
+                meter_print(stderr, jp->meter, 1);
+                meter_free(jp->meter);
+                jp->meter = NULL;
+        }
         if (jp->ps != &jp->ps0) {
                 free(jp->ps);
                 jp->ps = &jp->ps0;
@@ -311,14 +422,21 @@ setfggrp(pid_t pgrp)
  * The function has the same semantics as fork().  If "background" is
  * true, we create a background process, otherwise a foreground one.
  * The new job is added to the "jp" structure.
+ *
+ * Without job control, foreground processes stay in the process group
+ * of the shell.
  */
 pid_t
 forkshell(_Bool background, job_t *jp)
 {
         pid_t pid;
         pid_t pgrp;
+        _Bool newgrp;
         struct procstat *ps;
+        uint64_t start;
 
+        newgrp = jobctl || background;
+        start = stats_now();
         if ((pid = fork_or_die()) == 0) {
                 /* child */
                 /*
@@ -328,10 +446,10 @@ forkshell(_Bool background, job_t *jp)
                  * to the same group.
                  */
                 pgrp = jp->nprocs == 0 ? getpid(): jp->ps[0].pid;
-                if (setpgid(0, pgrp) == -1)
+                if (newgrp && setpgid(0, pgrp) == -1)
                         err_sys("setpgid");
 
-                if (!background) {
+                if (jobctl && !background) {
                         /*
                          * Each process in a pipeline must be part of
                          * of the foreground process group before
@@ -342,21 +460,55 @@ forkshell(_Bool background, job_t *jp)
 
                 // Only the main shell will need these.
                 freealljobs();
+                jobctl = 0;
                 return (pid);
         }
 
+        /*
+         * Set the process group from the parent too.  Otherwise, we
+         * might wait for the group before the child joins it.  This
+         * fails harmlessly if the child has already exec'ed.
+         */
+        pgrp = jp->nprocs == 0 ? pid: jp->ps[0].pid;
+        if (newgrp)
+                setpgid(pid, pgrp);
+
         ps = jp->ps + jp->nprocs++;
         ps->pid = pid;
         ps->status = -1;
 
+        /* Each process has its own track, named after the job. */
+        if (trace_enabled()) {
+                trace_event("fork", TR_COMPLETE, shellpid, start,
+                    stats_now() - start, jp->cmd);
+                trace_event("thread_name", TR_META, pid, start, 0, jp->cmd);
+                trace_event("process", TR_BEGIN, pid, start, 0,
+                    background ? "background": "foreground");
+        }
+
         return (pid);
 }
 
-static inline long
-jobnum(const job_t *jp)
+/*
+ * Fork a subshell that runs commands itself, e.g. for a command
+ * substitution.
+ *
+ * The function has the same semantics as fork().  The child stays in
+ * the process group of the shell and has job control disabled.
+ */
+pid_t
+forksubshell(void)
 {
+        pid_t pid;
 
-        return (1 + jp-jobs.buf);
+        if ((pid = fork_or_die()) == 0) {
+                freealljobs();
+                jobctl = 0;
+                handlesig(SIGINT, SIG_DFL, NULL);
+                handlesig(SIGQUIT, SIG_DFL, NULL);
+        }
+
+        return (pid);
 }
 
 void
@@ -466,6 +618,21 @@ prjobs(void)
         showjobs(S_ALL);
 }
 
+/*
+ * Show the statistics of the pipes of the metered jobs.
+ */
+void
+prmeters(void)
+{
+
+        for (job_t *jp = jobs.all; jp; jp = jp->next) {
+                if (jp->meter == NULL)
+                        continue;
+                fprintf(stderr, "[%ld] %s\n", jobnum(jp), jp->cmd);
+                meter_print(stderr, jp->meter, 0);
+        }
+}
+
 static procstat_t *
 findproc(pid_t pid, job_t *jp)
 {
@@ -487,6 +654,48 @@ findproc_nofail(pid_t pid, job_t *jp)
         return (ps);
 }
 
+/*
+ * Return the exit status of the last foreground command, as in
+ * sh(1): 128 plus the signal number if it was killed or stopped.
+ */
+int
+laststatus(void)
+{
+
+        return (lastst);
+}
+
+/*
+ * Set the status of a command run by the shell itself.
+ */
+void
+setlaststatus(int status)
+{
+
+        lastst = status & 0377;
+        metrics_builtin(lastst);
+}
+
+/*
+ * Give back the terminal to the shell once the given foreground job
+ * has finished or has been stopped.
+ */
+static void
+finishjob(job_t *jp)
+{
+        int status;
+
+        /* Set the shell as the new foreground group. */
+        if (jobctl)
+                setfggrp(shellpgrp);
+
+        if ((status = jobstatus(jp)) != -1)
+                lastst = status;
+
+        if (showstatus(jp, S_STOP|S_KILL|S_TERM))
+                freejob(jp);
+}
+
 /*
  * Wait for all the processes in the given job to finish.
  *
@@ -496,13 +705,36 @@ findproc_nofail(pid_t pid, job_t *jp)
 void
 waitforjob(job_t *jp)
 {
+        struct rusage ru;
         short nprocs;
-        siginfo_t info;
+        uint64_t start;
+        int status;
+        pid_t pid;
 
+        start = stats_now();
         if (jp->nprocs == 1) {
                 // We're waiting for a single foreground process.
-                if (waitpid(jp->ps->pid, &jp->ps->status, WUNTRACED) == -1)
-                        err_sys("waitpid");
+                if (wait4(jp->ps->pid, &jp->ps->status, WUNTRACED, &ru) == -1)
+                        err_sys("wait4");
+                trace_status(jp->ps->pid, jp->ps->status);
+                accountproc(jp, jp->ps->status, &ru);
+                goto done;
+        }
+
+        if (!jobctl) {
+                /*
+                 * The processes are in the process group of the
+                 * shell.  Wait for each one of them.
+                 */
+                for (short i = 0; i < jp->nprocs; i++) {
+                        procstat_t *ps = jp->ps + i;
+                        if (ps->status != -1)
+                                continue;
+                        if (wait4(ps->pid, &ps->status, WUNTRACED, &ru) == -1)
+                                err_sys("wait4");
+                        trace_status(ps->pid, ps->status);
+                        accountproc(jp, ps->status, &ru);
+                }
                 goto done;
         }
 
@@ -517,36 +749,102 @@ waitforjob(job_t *jp)
 
         assert(nprocs);
         while (nprocs-- > 0) {
-                int options = WEXITED | WSTOPPED;
                 procstat_t *ps;
                 /*
                  * All the processes in the pipeline are all part of
                  * the same process group and the first one is the
                  * leader.
                  */
-                if (waitid(P_PGID, jp->ps[0].pid, &info, options) == -1)
-                        err_sys("waitid");
-                ps = findproc_nofail(info.si_pid, jp);
-                if (info.si_code == CLD_STOPPED) {
-                        /*
-                         * All the other processes in the pipeline
-                         * have been stopped too.  So the pipeline
-                         * won't finish. We bail.
-                         */
-                        ps->status = (info.si_status << 8) | 0177;
+                if ((pid = wait4(-jp->ps[0].pid, &status, WUNTRACED, &ru))
+                    == -1)
+                        err_sys("wait4");
+                ps = findproc_nofail(pid, jp);
+                ps->status = status;
+                trace_status(pid, status);
+                /*
+                 * All the other processes in the pipeline have been
+                 * stopped too if this one has.  So the pipeline won't
+                 * finish. We bail.
+                 */
+                if (WIFSTOPPED(status))
                         break;
-                }
-                if (info.si_code == CLD_EXITED)
-                        ps->status = info.si_status << 8;
-                if (info.si_code == CLD_KILLED || info.si_code == CLD_DUMPED)
-                        ps->status = info.si_status;
+                accountproc(jp, status, &ru);
         }
 done:
-        /* Set the shell as the new foreground group. */
-        setfggrp(shellpgrp);
+        STATS_ADD(ST_WAITTIME, stats_now() - start);
+        finishjob(jp);
+}
 
-        if (showstatus(jp, S_STOP|S_KILL|S_TERM))
-                freejob(jp);
+/*
+ * Update the statuses of the processes of the given job without
+ * blocking.
+ *
+ * Return true if the job is still running, that is if some process
+ * hasn't exited and none has been stopped.
+ */
+static _Bool
+updatejob(job_t *jp)
+{
+        struct rusage ru;
+        _Bool running;
+        int status;
+        pid_t pid;
+
+        running = 0;
+        for (short i = 0; i < jp->nprocs; i++) {
+                procstat_t *ps = jp->ps + i;
+                if (ps->status != -1 && !WIFSTOPPED(ps->status) &&
+                    !WIFCONTINUED(ps->status))
+                        continue;
+                pid = wait4(ps->pid, &status, WUNTRACED|WNOHANG, &ru);
+                if (pid == -1)
+                        err_sys("wait4");
+                if (pid == 0) {
+                        ps->status = -1;
+                        running = 1;
+                        continue;
+                }
+                ps->status = status;
+                trace_status(ps->pid, status);
+                accountproc(jp, status, &ru);
+                if (WIFSTOPPED(status))
+                        return (0);
+        }
+
+        return (running);
+}
+
+/*
+ * Wait for the given job like waitforjob(), calling "tick" with "arg"
+ * about every "ms" milliseconds while it's running.
+ */
+void
+waitjobpoll(job_t *jp, void (*tick)(job_t *, void *), void *arg, int ms)
+{
+        struct timespec ts;
+        sigset_t oset;
+        sigset_t set;
+
+        /*
+         * A pending SIGCHLD ends the wait of a tick earlier.  It's
+         * discarded once unblocked.
+         */
+        sigemptyset(&set);
+        sigaddset(&set, SIGCHLD);
+        if (sigprocmask(SIG_BLOCK, &set, &oset) == -1)
+                err_sys("sigprocmask");
+        while (updatejob(jp)) {
+                tick(jp, arg);
+                ts.tv_sec = ms / 1000;
+                ts.tv_nsec = (ms % 1000) * 1000000L;
+                if (sigtimedwait(&set, NULL, &ts) == -1 &&
+                    errno != EAGAIN && errno != EINTR)
+                        err_sys("sigtimedwait");
+        }
+        if (sigprocmask(SIG_SETMASK, &oset, NULL) == -1)
+                err_sys("sigprocmask");
+
+        finishjob(jp);
 }
 
 /*
@@ -559,13 +857,14 @@ done:
 void
 reapjobs(_Bool updateonly)
 {
+        struct rusage ru;
         pid_t pid;
         int wstatus;
         job_t *jp;
         procstat_t *ps;
 
 loop:
-        pid = waitpid(-1, &wstatus, WUNTRACED|WNOHANG|WCONTINUED);
+        pid = wait4(-1, &wstatus, WUNTRACED|WNOHANG|WCONTINUED, &ru);
         if (pid == 0 || (pid == -1 && errno == ECHILD)) {
                 if (!updateonly)
                         showjobs(S_KILL|S_TERM|S_DONE);
@@ -574,16 +873,33 @@ loop:
                 return;
         }
         if (pid == -1)
-                err_sys("waitpid");
+                err_sys("wait4");
         for (jp = jobs.all; jp; jp = jp->next) {
                 if ((ps = findproc(pid, jp)) == NULL)
                         continue;
                 ps->status = wstatus;
+                trace_status(pid, wstatus);
+                accountproc(jp, wstatus, &ru);
                 goto loop;
         }
         err_quit("process %d is not found", pid);
 }
 
+/*
+ * Store the numbers of up to "max" current jobs in "ids".
+ *
+ * Return the number of jobs stored.
+ */
+int
+jobids(long *ids, int max)
+{
+        int n = 0;
+
+        for (const job_t *jp = jobs.all; jp && n < max; jp = jp->next)
+                ids[n++] = jobnum(jp);
+        return (n);
+}
+
 static job_t *
 getjob(long jobid)
 {
@@ -601,32 +917,59 @@ notfound:
 }
 
 /*
- * Kill the job identified by the given id.
- *
- * Send it a SIGTERM (if "terminate" is true) followed by a SIGCONT to
- * each process in the given job.
+ * Trace the continuation of the stopped processes of the job by the
+ * shell.
+ */
+static void
+tracecont(const job_t *jp)
+{
+
+        if (!trace_enabled())
+                return;
+        for (short i = 0; i < jp->nprocs; i++)
+                if (jp->ps[i].status != -1 && WIFSTOPPED(jp->ps[i].status))
+                        trace_event("sigcont", TR_INSTANT, jp->ps[i].pid,
+                            stats_now(), 0, NULL);
+}
+
+/*
+ * Send a SIGTERM (if "terminate" is true) followed by a SIGCONT to each
+ * process in the given job.
  *
  * Return 0 on success and -1 on failure.
  */
 int
-killjob(long jobid, _Bool terminate)
+signaljob(const job_t *jp, _Bool terminate)
 {
-        job_t *jp;
         pid_t pgid;             /* process group id */
 
-        if ((jp = getjob(jobid)) == NULL)
-                return (-1);
-
         pgid = jp->ps[0].pid;
         if ((terminate && kill(-pgid, SIGTERM) == -1) ||
             kill(-pgid, SIGCONT) == -1) {
                 warn("kill");
                 return (-1);
         }
+        tracecont(jp);
 
         return (0);
 }
 
+/*
+ * Kill the job identified by the given id.  See signaljob().
+ *
+ * Return 0 on success and -1 on failure.
+ */
+int
+killjob(long jobid, _Bool terminate)
+{
+        job_t *jp;
+
+        if ((jp = getjob(jobid)) == NULL)
+                return (-1);
+
+        return (signaljob(jp, terminate));
+}
+
 /*
  * Move the given job identified by the given id to the foreground.
  *
@@ -647,6 +990,7 @@ fgjob(long jobid)
                 warn("kill");
                 return (-1);
         }
+        tracecont(jp);
 
         fprintf(stderr, "%s\n", jp->cmd);
         waitforjob(jp);
@@ -668,3 +1012,31 @@ suspjobexist(void)
 
         return (0);        
 }
+
+/*
+ * Count the current jobs by state, the finished ones being those not
+ * reported yet, and return the size of the job table in "slots".
+ */
+void
+countjobs(int *running, int *stopped, int *done, int *slots)
+{
+        short i;
+
+        *running = *stopped = *done = 0;
+        for (const job_t *jp = jobs.all; jp; jp = jp->next) {
+                for (i = 0; i < jp->nprocs; i++) {
+                        int status = jp->ps[i].status;
+                        if (status == -1 || WIFCONTINUED(status)) {
+                                (*running)++;
+                                break;
+                        }
+                        if (WIFSTOPPED(status)) {
+                                (*stopped)++;
+                                break;
+                        }
+                }
+                if (i == jp->nprocs)
+                        (*done)++;
+        }
+        *slots = jobs.num;
+}
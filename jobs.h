@@ -1,7 +1,9 @@
 #ifndef ISH_JOBS_H_
 #define ISH_JOBS_H_
 
+#include <sys/resource.h>
 #include <sys/types.h>
+#include <stdint.h>
 #include <unistd.h>
 
 typedef struct procstat {
@@ -19,19 +21,33 @@ typedef struct job {
         short nprocs;           /* number of processes */
         pid_t pgrp;             /* job process group */
         char *cmd;              /* job command string */
+        struct meter *meter;    /* statistics of the pipes, or NULL */
+        uint64_t start;         /* ns, when the job was made */
+        uint64_t end;           /* ns, when its last process exited */
+        struct rusage ru;       /* resources used by the exited processes */
         struct job *next;       /* job used after this one */
 } job_t;
 
-extern void initjobs(void);
+extern void initjobs(_Bool);
+extern int gettty(void);
 extern job_t *makejob(int, char *);
+extern void freejob(job_t *);
 extern pid_t forkshell(_Bool, job_t *);
+extern pid_t forksubshell(void);
 extern void waitforjob(job_t *);
+extern void waitjobpoll(job_t *, void (*)(job_t *, void *), void *, int);
 extern void prbgrd(const job_t *);
+extern int laststatus(void);
+extern void setlaststatus(int);
 extern void prjobs(void);
+extern void prmeters(void);
+extern int jobids(long *, int);
 extern void reapjobs(_Bool);
+extern int signaljob(const job_t *, _Bool);
 extern int killjob(long, _Bool);
 extern int fgjob(long);
 extern void killsusjobs(void);
 extern _Bool suspjobexist(void);
+extern void countjobs(int *, int *, int *, int *);
 
 #endif  /* !ISH_JOBS_H_ */
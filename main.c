@@ -1,4 +1,4 @@
-#define _POSIX_C_SOURCE 200112L
+#define _POSIX_C_SOURCE 200809L
 
 #include <limits.h>
 #include <stdlib.h>
@@ -7,38 +7,102 @@
 #include <unistd.h>
 
 #include "cmd.h"
+#include "edit.h"
+#include "env.h"
 #include "err.h"
+#include "hist.h"
 #include "jobs.h"
+#include "main.h"
+#include "meter.h"
+#include "metrics.h"
+#include "opt.h"
+#include "stats.h"
+#include "trace.h"
 #include "utils.h"
 #include "y.tab.h"
 
 extern char **environ;
 extern cmd_t *root;
 extern void yyrestart(FILE *);
+extern int lex_eof(void);
+extern void lex_setinput(int (*)(char *, int));
+
+static _Bool dumpplan;  /* print the command lines as run */
+
+/*
+ * Parse the next command line into "root", and account for the time
+ * taken, but for the one spent waiting for the input.
+ */
+static void
+parse(void)
+{
+        uint64_t start;
+        uint64_t wait;
+
+        start = stats_now();
+        wait = stats_get(ST_READTIME);
+        trace_event("parse", TR_BEGIN, getpid(), start, 0, NULL);
+        yyparse();
+        trace_event("parse", TR_END, getpid(), stats_now(), 0, NULL);
+        STATS_ADD(ST_PARSETIME, stats_now() - start -
+            (stats_get(ST_READTIME) - wait));
+}
 
 static void
 print_prompt(void)
 {
         static char hostname[_POSIX_HOST_NAME_MAX];
+        char prompt[_POSIX_HOST_NAME_MAX + 3];
 
         if (gethostname(hostname, sizeof(hostname)) == -1)
                 err_quit("gethostname");
-        fprintf(stderr, "%s%% ", hostname);
+        snprintf(prompt, sizeof(prompt), "%s%% ", hostname);
+        if (edit_enabled())
+                edit_prompt(prompt);
+        else
+                fputs(prompt, stderr);
+}
+
+/*
+ * Return true if the shell may be replaced by its last command, i.e. if
+ * it has nothing left to do when it exits.
+ */
+static _Bool
+canexec(void)
+{
+
+        /*
+         * The trace, the metrics and the allocation statistics are
+         * written by atexit() handlers.
+         */
+#ifdef ALLOCSTATS
+        if (alloc_reporting())
+                return (0);
+#endif
+        return (!trace_enabled() && !metrics_enabled());
 }
 
+/*
+ * Run the commands read from "fp".
+ *
+ * If "last" is true, the shell exits once they have run, so the last
+ * command can replace the shell.
+ */
 static void
-cmdloop(FILE *fp, _Bool interactive)
+cmdloop(FILE *fp, _Bool interactive, _Bool last)
 {
         _Bool userwarned;
 
         userwarned = 0;
         root = NULL;
+        lex_setinput(interactive && edit_enabled() ? edit_input: NULL);
         yyrestart(fp);
         for (;;) {
                 reapjobs(0);
+                metrics_update();
                 if (interactive)
                         print_prompt();
-                yyparse();
+                parse();
                 if (root == (void *)-1) {
                         reapjobs(1);                        
                         if (interactive && !userwarned && suspjobexist()) {
@@ -50,6 +114,10 @@ cmdloop(FILE *fp, _Bool interactive)
                         break;                        
                 }
                 if (root) {
+                        root = optimize(root, last && lex_eof() &&
+                            canexec());
+                        if (dumpplan)
+                                opt_dump(stderr, root);
                         cmd_run(root);
                         cmd_free(root);
                         root = NULL;
@@ -57,6 +125,32 @@ cmdloop(FILE *fp, _Bool interactive)
         }
 }
 
+/*
+ * Parse and run the given command line.
+ *
+ * This is used by subshells, since the input of the lexer is
+ * replaced, and for "ish -c".  The shell exits right after.
+ */
+void
+evalstr(const char *s)
+{
+        size_t len;
+        char *buf;
+        FILE *fp;
+
+        /* The parser expects the line to be terminated by a newline. */
+        len = strlen(s);
+        buf = malloc_or_die(len + 2);
+        memcpy(buf, s, len);
+        buf[len++] = '\n';
+        buf[len] = '\0';
+        if ((fp = fmemopen(buf, len, "r")) == NULL)
+                err_sys("fmemopen");
+        cmdloop(fp, 0, 1);
+        fclose(fp);
+        free(buf);
+}
+
 static char *
 joinpath(const char *p1, const char *p2)
 {
@@ -86,22 +180,89 @@ loadprofile(void)
 
         fullpath = joinpath(gethomedir(), ".ishrc");
         if ((fp = fopen(fullpath, "r")) != NULL) {
-                cmdloop(fp, 0);
+                cmdloop(fp, 0, 0);
                 fclose(fp);
         }
         free(fullpath);
 }
 
+/*
+ * Open the history of the line editor, $ISH_HISTFILE or ~/.ish_history.
+ */
+static void
+loadhistory(void)
+{
+        const char *path;
+        char *fullpath;
+
+        if ((path = env_get("ISH_HISTFILE")) != NULL && *path != '\0') {
+                hist_open(path);
+                return;
+        }
+        fullpath = joinpath(gethomedir(), ".ish_history");
+        hist_open(fullpath);
+        free(fullpath);
+}
+
+static void
+usage(void)
+{
+
+        fprintf(stderr, "usage: ish [--dump-plan] [--trace file] [-m] "
+            "[-c command | file]\n");
+        exit(2);
+}
+
 int
-main(void)
+main(int argc, char *argv[])
 {
+        const char *tracefile;
+        const char *cmd;
+        FILE *fp;
+        _Bool interactive;
+
+        tracefile = NULL;
+        cmd = NULL;
+        fp = stdin;
+        for (argc--, argv++; argc > 0 && argv[0][0] == '-'; argc--, argv++) {
+                if (!strcmp(argv[0], "--dump-plan"))
+                        dumpplan = 1;
+                else if (!strcmp(argv[0], "--trace") && argc > 1) {
+                        tracefile = argv[1];
+                        argc--;
+                        argv++;
+                } else if (!strcmp(argv[0], "-m"))
+                        meter_enable(1);
+                else if (!strcmp(argv[0], "-c") && argc > 1) {
+                        cmd = argv[1];
+                        argc--;
+                        argv++;
+                } else
+                        usage();
+        }
+        if (argc > 1 || (argc == 1 && cmd))
+                usage();
+        if (argc == 1 && (fp = fopen(argv[0], "r")) == NULL)
+                err_sys("%s", argv[0]);
+        interactive = cmd == NULL && fp == stdin && isatty(STDIN_FILENO);
 
         // Don't inherit environment variables.
         environ = NULL;
 
-        initjobs();
+        stats_init();
+        metrics_init();
+        if (tracefile && trace_start(tracefile) == -1)
+                err_sys("%s", tracefile);
+        initjobs(interactive);
         loadprofile();
-        cmdloop(stdin, 1);
+        if (interactive) {
+                edit_init(gettty());
+                loadhistory();
+        }
+        if (cmd)
+                evalstr(cmd);
+        else
+                cmdloop(fp, interactive, !interactive);
 
-        return (0);
+        return (laststatus());
 }
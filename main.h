@@ -0,0 +1,6 @@
+#ifndef ISH_MAIN_H_
+#define ISH_MAIN_H_
+
+extern void evalstr(const char *);
+
+#endif  /* !ISH_MAIN_H_ */
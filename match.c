@@ -0,0 +1,366 @@
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <regex.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "match.h"
+#include "utils.h"
+
+#define INBUFSIZ	(1024*1024) /* initial input buffer size */
+#define OUTBUFSIZ	(256*1024)  /* output buffer size */
+
+/*
+ * What to look for in each line.
+ */
+typedef struct matcher {
+        const char *lit;        /* literal string */
+        size_t len;             /* length of "lit" */
+        regex_t re;             /* pattern with -E */
+        _Bool isre;             /* use "re" instead of "lit" */
+        _Bool invert;           /* select the lines not matching */
+        _Bool count;            /* only count the selected lines */
+        long nsel;              /* lines selected, exact only with -c */
+} matcher_t;
+
+/*
+ * Output buffer.  Large blocks are written directly from the input
+ * buffer.
+ */
+typedef struct outbuf {
+        char *buf;
+        size_t len;
+        int err;                /* a write error occurred */
+} outbuf_t;
+
+static void
+out_flush(outbuf_t *o)
+{
+
+        for (size_t off = 0; off < o->len && !o->err; ) {
+                ssize_t n = write(STDOUT_FILENO, o->buf + off, o->len - off);
+                if (n == -1) {
+                        if (errno == EINTR)
+                                continue;
+                        if (errno != EPIPE)
+                                warn("match: write");
+                        o->err = 1;
+                        break;
+                }
+                off += n;
+        }
+        o->len = 0;
+}
+
+static void
+out_put(outbuf_t *o, const char *s, size_t n)
+{
+
+        if (o->len + n > OUTBUFSIZ)
+                out_flush(o);
+        if (n >= OUTBUFSIZ/2) {
+                const char *save = o->buf;
+                o->buf = (char *)s;
+                o->len = n;
+                out_flush(o);
+                o->buf = (char *)save;
+                return;
+        }
+        memcpy(o->buf + o->len, s, n);
+        o->len += n;
+}
+
+/*
+ * Return the first occurrence of "pat" of length "m" in "s" of length
+ * "n", or NULL.
+ *
+ * The vector versions compare at once a block of positions with the
+ * first and the last character of "pat", and only check the middle of
+ * the candidates.  AVX2 is used when the shell is built for it, SSE2
+ * otherwise on x86-64.
+ */
+static const char *
+scan(const char *s, size_t n, const char *pat, size_t m)
+{
+        const char *p;
+        size_t i;
+
+        if (m == 0)
+                return (s);
+        if (m == 1)
+                return (memchr(s, pat[0], n));
+        if (n < m)
+                return (NULL);
+
+        i = 0;
+#if defined(__AVX2__)
+        const __m256i first = _mm256_set1_epi8(pat[0]);
+        const __m256i last = _mm256_set1_epi8(pat[m - 1]);
+        for (; i + m - 1 + 32 <= n; i += 32) {
+                __m256i bf = _mm256_loadu_si256((const __m256i *)(s + i));
+                __m256i bl = _mm256_loadu_si256(
+                    (const __m256i *)(s + i + m - 1));
+                uint32_t mask = _mm256_movemask_epi8(_mm256_and_si256(
+                    _mm256_cmpeq_epi8(first, bf),
+                    _mm256_cmpeq_epi8(last, bl)));
+                for (; mask; mask &= mask - 1) {
+                        p = s + i + __builtin_ctz(mask);
+                        if (!memcmp(p + 1, pat + 1, m - 2))
+                                return (p);
+                }
+        }
+#elif defined(__SSE2__)
+        const __m128i first = _mm_set1_epi8(pat[0]);
+        const __m128i last = _mm_set1_epi8(pat[m - 1]);
+        for (; i + m - 1 + 16 <= n; i += 16) {
+                __m128i bf = _mm_loadu_si128((const __m128i *)(s + i));
+                __m128i bl = _mm_loadu_si128(
+                    (const __m128i *)(s + i + m - 1));
+                unsigned mask = _mm_movemask_epi8(_mm_and_si128(
+                    _mm_cmpeq_epi8(first, bf),
+                    _mm_cmpeq_epi8(last, bl)));
+                for (; mask; mask &= mask - 1) {
+                        p = s + i + __builtin_ctz(mask);
+                        if (!memcmp(p + 1, pat + 1, m - 2))
+                                return (p);
+                }
+        }
+#endif
+
+        /* Scalar version, also used for the end of the block. */
+        while (i + m <= n) {
+                if ((p = memchr(s + i, pat[0], n - m + 1 - i)) == NULL)
+                        return (NULL);
+                if (p[m - 1] == pat[m - 1] && !memcmp(p + 1, pat + 1, m - 2))
+                        return (p);
+                i = p - s + 1;
+        }
+
+        return (NULL);
+}
+
+/*
+ * Return the first line of "s" matching the pattern, and store its
+ * length in "lenp".  "s" ends with a newline.
+ */
+static char *
+findline(matcher_t *mp, char *s, size_t n, size_t *lenp)
+{
+        char *start;
+        char *end;
+        const char *p;
+
+        if (mp->isre) {
+                for (start = s; start < s + n; start = end + 1) {
+                        end = memchr(start, '\n', s + n - start);
+                        *end = '\0';
+                        int r = regexec(&mp->re, start, 0, NULL, 0);
+                        *end = '\n';
+                        if (r == 0) {
+                                *lenp = end - start + 1;
+                                return (start);
+                        }
+                }
+                return (NULL);
+        }
+
+        if ((p = scan(s, n, mp->lit, mp->len)) == NULL)
+                return (NULL);
+        start = memrchr(s, '\n', p - s);
+        start = start ? start + 1: s;
+        end = memchr(p, '\n', s + n - p);
+        *lenp = end - start + 1;
+
+        return (start);
+}
+
+/*
+ * Filter the complete lines of the given block, which ends with a
+ * newline.  The literal is searched in the whole block rather than
+ * line by line.
+ */
+static void
+filter(matcher_t *mp, char *s, size_t n, outbuf_t *o)
+{
+        char *line;
+        char *end;
+        size_t len;
+
+        for (end = s + n; s < end; s = line + len) {
+                line = findline(mp, s, end - s, &len);
+                if (line == NULL) {
+                        line = end;
+                        len = 0;
+                }
+                if (mp->invert) {
+                        if (mp->count) {
+                                for (const char *p = s; (p = memchr(p, '\n',
+                                    line - p)) != NULL; p++)
+                                        mp->nsel++;
+                        } else if (line > s) {
+                                mp->nsel++;
+                                out_put(o, s, line - s);
+                        }
+                } else if (len > 0) {
+                        mp->nsel++;
+                        if (!mp->count)
+                                out_put(o, line, len);
+                }
+        }
+}
+
+/*
+ * Filter a whole file.  It's read in large blocks and only the last
+ * incomplete line of each block is moved.
+ */
+static int
+filterfile(matcher_t *mp, int fd, const char *name, outbuf_t *o)
+{
+        static char *buf;
+        static size_t cap;
+        size_t len;
+        ssize_t n;
+        char *nl;
+
+        if (buf == NULL) {
+                cap = INBUFSIZ;
+                buf = malloc_or_die(cap + 1);
+        }
+
+        len = 0;
+        for (;;) {
+                /* Make room for at least a very long line. */
+                if (len == cap) {
+                        cap *= 2;
+                        buf = realloc_or_die(buf, cap + 1);
+                }
+                if ((n = read(fd, buf + len, cap - len)) == -1) {
+                        if (errno == EINTR)
+                                continue;
+                        warn("match: %s", name);
+                        return (-1);
+                }
+                if (n == 0) {
+                        /* Terminate the last line. */
+                        if (len > 0 && buf[len - 1] != '\n')
+                                buf[len++] = '\n';
+                        filter(mp, buf, len, o);
+                        return (0);
+                }
+                len += n;
+                if ((nl = memrchr(buf + len - n, '\n', n)) == NULL)
+                        continue;
+                filter(mp, buf, nl + 1 - buf, o);
+                len -= nl + 1 - buf;
+                memmove(buf, nl + 1, len);
+                if (o->err)
+                        return (-1);
+        }
+}
+
+/*
+ * Select the lines containing a literal string, or matching an
+ * extended regular expression with -E.  Like grep, the status is 0
+ * if some lines were selected, 1 if none were and 2 on error.
+ */
+int
+matchcmd(int argc, char *argv[])
+{
+        matcher_t m;
+        outbuf_t o;
+        int status;
+        int fd;
+        int c;
+
+        memset(&m, 0, sizeof(m));
+        optind = 1;
+        opterr = 0;
+        argv--;         /* getopt() skips the command name */
+        argc++;
+        while ((c = getopt(argc, argv, "+cvE")) != -1) {
+                switch (c) {
+                case 'c':
+                        m.count = 1;
+                        break;
+                case 'v':
+                        m.invert = 1;
+                        break;
+                case 'E':
+                        m.isre = 1;
+                        break;
+                default:
+                        goto usage;
+                }
+        }
+        argc -= optind;
+        argv += optind;
+        if (argc == 0)
+                goto usage;
+
+        m.lit = *argv++;
+        m.len = strlen(m.lit);
+        argc--;
+        if (m.isre) {
+                int r = regcomp(&m.re, m.lit, REG_EXTENDED|REG_NOSUB);
+                if (r != 0) {
+                        char msg[128];
+                        regerror(r, &m.re, msg, sizeof(msg));
+                        warnx("match: %s: %s", m.lit, msg);
+                        return (2);
+                }
+        } else if (memchr(m.lit, '\n', m.len)) {
+                warnx("match: the literal can't contain a newline");
+                return (2);
+        }
+
+        o.buf = malloc_or_die(OUTBUFSIZ);
+        o.len = 0;
+        o.err = 0;
+        status = 0;
+        if (argc == 0 && filterfile(&m, STDIN_FILENO, "stdin", &o) == -1)
+                status = 2;
+        for (int i = 0; i < argc && !o.err; i++) {
+                if ((fd = open(argv[i], O_RDONLY|O_CLOEXEC)) == -1) {
+                        warn("match: %s", argv[i]);
+                        status = 2;
+                        continue;
+                }
+                if (filterfile(&m, fd, argv[i], &o) == -1)
+                        status = 2;
+                close(fd);
+        }
+        if (m.count) {
+                char num[32];
+                int n = snprintf(num, sizeof(num), "%ld\n", m.nsel);
+                out_put(&o, num, n);
+        }
+        out_flush(&o);
+        free(o.buf);
+        if (m.isre)
+                regfree(&m.re);
+
+        if (status == 0 && o.err)
+                status = 2;
+        if (status == 0 && m.nsel == 0)
+                status = 1;
+
+        return (status);
+
+usage:
+        fprintf(stderr, "usage: match [-cvE] literal [file ...]\n");
+        return (2);
+}
@@ -0,0 +1,6 @@
+#ifndef ISH_MATCH_H_
+#define ISH_MATCH_H_
+
+extern int matchcmd(int, char **);
+
+#endif  /* !ISH_MATCH_H_ */
@@ -0,0 +1,396 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cmd.h"
+#include "copy.h"
+#include "env.h"
+#include "err.h"
+#include "memo.h"
+#include "utils.h"
+
+#define FNV_OFFSET	UINT64_C(0xcbf29ce484222325)
+#define FNV_PRIME	UINT64_C(0x100000001b3)
+
+#define MEMOVERSION	"ish-memo 1"    /* changes the keys of all entries */
+#define MAXINPUTS	64
+
+/*
+ * Hash "len" bytes into "h" with FNV-1a.
+ */
+static uint64_t
+fnv(uint64_t h, const void *buf, size_t len)
+{
+        const unsigned char *p = buf;
+
+        while (len-- > 0) {
+                h ^= *p++;
+                h *= FNV_PRIME;
+        }
+
+        return (h);
+}
+
+/*
+ * Hash a string along with its terminating null byte, so that the
+ * words "ab c" and "a bc" don't hash the same.
+ */
+static inline uint64_t
+fnvstr(uint64_t h, const char *s)
+{
+
+        return (fnv(h, s, strlen(s) + 1));
+}
+
+/*
+ * Hash the name and the contents of an input file.
+ *
+ * Return -1 if it can't be read.
+ */
+static int
+hashfile(uint64_t *hp, const char *path)
+{
+        char buf[64*1024];
+        ssize_t n;
+        int fd;
+
+        if ((fd = open(path, O_RDONLY|O_CLOEXEC)) == -1) {
+                warn("memo: %s", path);
+                return (-1);
+        }
+        *hp = fnvstr(*hp, path);
+        while ((n = read(fd, buf, sizeof(buf))) != 0) {
+                if (n == -1) {
+                        if (errno == EINTR)
+                                continue;
+                        warn("memo: %s", path);
+                        close(fd);
+                        return (-1);
+                }
+                *hp = fnv(*hp, buf, n);
+        }
+        close(fd);
+
+        return (0);
+}
+
+/*
+ * Return the key of a command: the hash of everything its result is
+ * assumed to depend on, that is its words, the environment, the
+ * current directory and the contents of the declared input files.
+ */
+static int
+hashcmd(uint64_t *hp, char **argv, char **inputs, int ninputs)
+{
+        char cwd[PATH_MAX];
+        char **envp;
+        uint64_t h;
+
+        h = fnvstr(FNV_OFFSET, MEMOVERSION);
+        for (; *argv; argv++)
+                h = fnvstr(h, *argv);
+        h = fnvstr(h, "");
+        if ((envp = env_execargs()) != NULL) {
+                for (char **p = envp; *p; p++) {
+                        h = fnvstr(h, *p);
+                        free(*p);
+                }
+                free(envp);
+        }
+        h = fnvstr(h, "");
+        if (getcwd(cwd, sizeof(cwd)) != NULL)
+                h = fnvstr(h, cwd);
+        for (int i = 0; i < ninputs; i++)
+                if (hashfile(&h, inputs[i]) == -1)
+                        return (-1);
+        *hp = h;
+
+        return (0);
+}
+
+/*
+ * Create a directory and its missing parents.
+ */
+static int
+mkdirs(char *path)
+{
+
+        for (char *p = path + 1; ; p++) {
+                if (*p != '/' && *p != '\0')
+                        continue;
+                char c = *p;
+                *p = '\0';
+                int r = mkdir(path, 0700);
+                *p = c;
+                if (r == -1 && errno != EEXIST)
+                        return (-1);
+                if (c == '\0')
+                        return (0);
+        }
+}
+
+/*
+ * Return the directory of the cache, $ISH_MEMO_DIR or ~/.cache/ish/memo,
+ * creating it if needed.
+ */
+static char *
+cachedir(void)
+{
+        const char *dir;
+        const char *home;
+        char *path;
+
+        if ((dir = env_get("ISH_MEMO_DIR")) != NULL && *dir != '\0')
+                path = strdup_or_die(dir);
+        else {
+                if ((home = gethomedir()) == NULL) {
+                        warnx("memo: no home directory");
+                        return (NULL);
+                }
+                path = malloc_or_die(strlen(home) + sizeof("/.cache/ish/memo"));
+                sprintf(path, "%s/.cache/ish/memo", home);
+        }
+        if (mkdirs(path) == -1) {
+                warn("memo: %s", path);
+                free(path);
+                return (NULL);
+        }
+
+        return (path);
+}
+
+/*
+ * Store in "path" the pathname of the file "name" of the entry "entry".
+ *
+ * Return 0 on success and -1 if it's too long.
+ */
+static int
+entrypath(char path[PATH_MAX], const char *entry, const char *name)
+{
+        int n;
+
+        n = snprintf(path, PATH_MAX, "%s/%s", entry, name);
+        if (n < 0 || n >= PATH_MAX) {
+                errno = ENAMETOOLONG;
+                return (-1);
+        }
+        return (0);
+}
+
+/*
+ * Open the file "name" of the entry "entry".
+ */
+static int
+openentry(const char *entry, const char *name, int flags)
+{
+        char path[PATH_MAX];
+
+        if (entrypath(path, entry, name) == -1)
+                return (-1);
+        return (open(path, flags|O_CLOEXEC, 0600));
+}
+
+static void
+rmentry(const char *entry)
+{
+        static const char *names[] = {"out", "err", "status"};
+        char path[PATH_MAX];
+
+        for (size_t i = 0; i < sizeof(names)/sizeof(names[0]); i++)
+                if (entrypath(path, entry, names[i]) == 0)
+                        unlink(path);
+        rmdir(entry);
+}
+
+/*
+ * Write the captured outputs of a command to the standard output and
+ * error.
+ */
+static void
+replay(int out, int err)
+{
+
+        fflush(stdout);
+        if (lseek(out, 0, SEEK_SET) == -1 || copy_fd(out, STDOUT_FILENO) == -1)
+                warn("memo: stdout");
+        if (lseek(err, 0, SEEK_SET) == -1 || copy_fd(err, STDERR_FILENO) == -1)
+                warn("memo: stderr");
+}
+
+/*
+ * Replay the entry of the cache.
+ *
+ * Return the status of the command, or -1 if the entry isn't complete.
+ */
+static int
+hit(const char *entry)
+{
+        char buf[16];
+        ssize_t n;
+        int status;
+        int out;
+        int err;
+        int fd;
+
+        if ((fd = openentry(entry, "status", O_RDONLY)) == -1)
+                return (-1);
+        n = read(fd, buf, sizeof(buf) - 1);
+        close(fd);
+        if (n <= 0)
+                return (-1);
+        buf[n] = '\0';
+        status = atoi(buf);
+
+        if ((out = openentry(entry, "out", O_RDONLY)) == -1)
+                return (-1);
+        if ((err = openentry(entry, "err", O_RDONLY)) == -1) {
+                close(out);
+                return (-1);
+        }
+        replay(out, err);
+        close(out);
+        close(err);
+
+        return (status);
+}
+
+/*
+ * Run the command with its outputs captured into a new entry of the
+ * cache, and replay them once it's done.  The entry is built under a
+ * temporary name and renamed at the end, so that it's never seen
+ * partially written.  The result of a command killed or stopped isn't
+ * kept.
+ *
+ * Return the status of the command.
+ */
+static int
+miss(const char *dir, const char *entry, char **argv)
+{
+        char tmp[PATH_MAX];
+        char buf[16];
+        int saved[2];
+        int status;
+        int n;
+        int out;
+        int err;
+        int fd;
+
+        n = snprintf(tmp, sizeof(tmp), "%s.XXXXXX", entry);
+        if (n < 0 || (size_t)n >= sizeof(tmp)) {
+                errno = ENAMETOOLONG;
+                warn("memo: %s", entry);
+                return (cmd_execv(argv));
+        }
+        if (mkdtemp(tmp) == NULL) {
+                warn("memo: %s", dir);
+                return (cmd_execv(argv));
+        }
+        if ((out = openentry(tmp, "out", O_RDWR|O_CREAT|O_TRUNC)) == -1 ||
+            (err = openentry(tmp, "err", O_RDWR|O_CREAT|O_TRUNC)) == -1) {
+                warn("memo: %s", tmp);
+                rmentry(tmp);
+                return (cmd_execv(argv));
+        }
+
+        fflush(stdout);
+        if ((saved[0] = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10)) == -1 ||
+            (saved[1] = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 10)) == -1)
+                err_sys("fcntl");
+        if (dup2(out, STDOUT_FILENO) == -1 || dup2(err, STDERR_FILENO) == -1)
+                err_sys("dup2");
+        status = cmd_execv(argv);
+        fflush(stdout);
+        if (dup2(saved[0], STDOUT_FILENO) == -1 ||
+            dup2(saved[1], STDERR_FILENO) == -1)
+                err_sys("dup2");
+        close(saved[0]);
+        close(saved[1]);
+
+        replay(out, err);
+        close(out);
+        close(err);
+
+        if (status >= 128 ||
+            (fd = openentry(tmp, "status", O_WRONLY|O_CREAT|O_TRUNC)) == -1) {
+                rmentry(tmp);
+                return (status);
+        }
+        snprintf(buf, sizeof(buf), "%d\n", status);
+        if (write(fd, buf, strlen(buf)) == -1 || close(fd) == -1 ||
+            rename(tmp, entry) == -1)
+                rmentry(tmp);   /* e.g. stored meanwhile by another shell */
+
+        return (status);
+}
+
+/*
+ * memo [-f file] command [arg ...]
+ *
+ * Run a command, or replay its standard output, standard error and
+ * exit status if it has already been run with the same words, the same
+ * environment, from the same directory and with the same contents of
+ * the input files given with -f.
+ */
+int
+memocmd(int argc, char *argv[])
+{
+        char *inputs[MAXINPUTS];
+        char entry[PATH_MAX];
+        int ninputs;
+        uint64_t h;
+        char *dir;
+        int status;
+        int n;
+
+        ninputs = 0;
+        for (; argc > 0 && argv[0][0] == '-'; argc--, argv++) {
+                if (!strcmp(argv[0], "--")) {
+                        argc--;
+                        argv++;
+                        break;
+                }
+                if (strcmp(argv[0], "-f") || argc == 1)
+                        goto usage;
+                if (ninputs == MAXINPUTS) {
+                        warnx("memo: too many input files");
+                        return (2);
+                }
+                inputs[ninputs++] = argv[1];
+                argc--;
+                argv++;
+        }
+        if (argc == 0)
+                goto usage;
+
+        if (hashcmd(&h, argv, inputs, ninputs) == -1 ||
+            (dir = cachedir()) == NULL)
+                return (cmd_execv(argv));
+        n = snprintf(entry, sizeof(entry), "%s/%016" PRIx64, dir, h);
+        if (n < 0 || (size_t)n >= sizeof(entry)) {
+                errno = ENAMETOOLONG;
+                warn("memo: %s", dir);
+                free(dir);
+                return (cmd_execv(argv));
+        }
+        if ((status = hit(entry)) == -1)
+                status = miss(dir, entry, argv);
+        free(dir);
+
+        return (status);
+
+usage:
+        fprintf(stderr, "usage: memo [-f file] command [arg ...]\n");
+        return (2);
+}
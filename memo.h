@@ -0,0 +1,6 @@
+#ifndef ISH_MEMO_H_
+#define ISH_MEMO_H_
+
+extern int memocmd(int, char **);
+
+#endif  /* !ISH_MEMO_H_ */
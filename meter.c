@@ -0,0 +1,264 @@
+#define _GNU_SOURCE
+
+#include <sys/mman.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "err.h"
+#include "meter.h"
+
+#define NAMELEN		24      /* length kept of the names of the commands */
+
+/*
+ * What an interposer is doing.
+ */
+#define M_RUN		0       /* moving data */
+#define M_WAITIN	1       /* waiting for the writer */
+#define M_WAITOUT	2       /* waiting for the reader */
+
+/*
+ * Statistics of a pipe between two stages.  They're updated by its
+ * interposer and read by the shell at the same time.  The times are in
+ * nanoseconds.
+ */
+typedef struct pipemeter {
+        uint64_t bytes;         /* bytes moved */
+        uint64_t waitin;        /* time waiting for the writer */
+        uint64_t waitout;       /* time waiting for the reader */
+        uint64_t start;
+        uint64_t end;           /* 0 until the end of the input */
+        uint64_t since;         /* start of the current state */
+        int state;              /* M_* */
+        char from[NAMELEN];     /* writer */
+        char to[NAMELEN];       /* reader */
+} pipemeter_t;
+
+/*
+ * Statistics of a job, shared with its interposers.
+ */
+struct meter {
+        size_t size;            /* size of the mapping */
+        int n;
+        pipemeter_t pm[];
+};
+
+static _Bool meterall;          /* meter all the pipelines */
+
+void
+meter_enable(_Bool on)
+{
+
+        meterall = on;
+}
+
+_Bool
+meter_enabled(void)
+{
+
+        return (meterall);
+}
+
+static uint64_t
+now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+static inline uint64_t
+load(const uint64_t *p)
+{
+
+        return (__atomic_load_n(p, __ATOMIC_RELAXED));
+}
+
+static inline void
+store(uint64_t *p, uint64_t v)
+{
+
+        __atomic_store_n(p, v, __ATOMIC_RELAXED);
+}
+
+/*
+ * Return the statistics of a job of "n" pipes, in memory shared with
+ * the children of the shell.
+ */
+meter_t *
+meter_new(int n)
+{
+        meter_t *m;
+        size_t size;
+
+        size = sizeof(*m) + n * sizeof(m->pm[0]);
+        m = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS,
+            -1, 0);
+        if (m == MAP_FAILED)
+                err_sys("mmap");
+        m->size = size;
+        m->n = n;               /* the mapping is zeroed */
+
+        return (m);
+}
+
+/*
+ * Name the commands on both sides of the pipe "i".
+ */
+void
+meter_label(meter_t *m, int i, const char *from, const char *to)
+{
+
+        snprintf(m->pm[i].from, NAMELEN, "%s", from);
+        snprintf(m->pm[i].to, NAMELEN, "%s", to);
+}
+
+static void
+setstate(pipemeter_t *pm, int state)
+{
+        uint64_t t = now();
+        uint64_t *total;
+
+        total = pm->state == M_WAITIN ? &pm->waitin:
+            pm->state == M_WAITOUT ? &pm->waitout: NULL;
+        if (total)
+                store(total, load(total) + t - pm->since);
+        store(&pm->since, t);
+        __atomic_store_n(&pm->state, state, __ATOMIC_RELAXED);
+}
+
+/*
+ * Interpose on the pipe "i" of a job: move the data read from "in" to
+ * "out" and account for it, and for the time spent waiting on each
+ * side.
+ *
+ * Return 0 at the end of the input and 1 if the reader is gone.
+ */
+int
+meter_run(meter_t *m, int i, int in, int out)
+{
+        pipemeter_t *pm = &m->pm[i];
+        struct pollfd pfd;
+        ssize_t n;
+        int ret;
+
+        store(&pm->start, now());
+        store(&pm->since, pm->start);
+        for (;;) {
+                n = splice(in, NULL, out, NULL, INT_MAX,
+                    SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+                if (n > 0) {
+                        store(&pm->bytes, load(&pm->bytes) + n);
+                        continue;
+                }
+                if (n == 0) {
+                        ret = 0;
+                        break;
+                }
+                if (errno == EINTR)
+                        continue;
+                if (errno != EAGAIN) {
+                        ret = 1;
+                        break;
+                }
+
+                /* Find out which side is blocking. */
+                pfd.fd = in;
+                pfd.events = POLLIN;
+                if (poll(&pfd, 1, 0) == 1) {
+                        pfd.fd = out;
+                        pfd.events = POLLOUT;
+                        setstate(pm, M_WAITOUT);
+                } else
+                        setstate(pm, M_WAITIN);
+                while (poll(&pfd, 1, -1) == -1 && errno == EINTR)
+                        continue;
+                setstate(pm, M_RUN);
+        }
+        setstate(pm, M_RUN);
+        store(&pm->end, now());
+
+        return (ret);
+}
+
+static double
+percent(uint64_t part, uint64_t total)
+{
+
+        return (total > 0 ? 100.0 * part / total: 0);
+}
+
+/*
+ * Print the statistics of the pipes of a job, so far or once it's over
+ * if "final" is true.
+ *
+ * A stage is a bottleneck if the writer of its input keeps waiting for
+ * it, that is it's exerting backpressure.  If none is, the first one
+ * is: it doesn't produce data faster.
+ */
+void
+meter_print(FILE *fp, const meter_t *m, _Bool final)
+{
+        const char *slowest;
+        double maxwait;
+        uint64_t t;
+
+        slowest = NULL;
+        maxwait = 50;
+        fprintf(fp, "  %-24s %10s %10s %8s %8s\n", "pipe", "MB", "MB/s",
+            "starved", "blocked");
+        for (int i = 0; i < m->n; i++) {
+                const pipemeter_t *pm = &m->pm[i];
+                uint64_t start = load(&pm->start);
+                uint64_t end = load(&pm->end);
+                uint64_t since = load(&pm->since);
+                uint64_t waitin = load(&pm->waitin);
+                uint64_t waitout = load(&pm->waitout);
+                double bytes = load(&pm->bytes);
+                char name[2*NAMELEN + 4];
+
+                if (start == 0)
+                        continue;       /* not started or not a pipe */
+                t = end ? end: now();
+                if (!end) {
+                        /* Count the current wait as well. */
+                        int state = __atomic_load_n(&pm->state,
+                            __ATOMIC_RELAXED);
+                        if (state == M_WAITIN)
+                                waitin += t - since;
+                        else if (state == M_WAITOUT)
+                                waitout += t - since;
+                }
+                t -= start;
+                snprintf(name, sizeof(name), "%s | %s", pm->from, pm->to);
+                fprintf(fp, "  %-24s %10.1f %10.1f %7.0f%% %7.0f%%\n",
+                    name, bytes / 1e6, t > 0 ? bytes / 1e6 / (t / 1e9): 0,
+                    percent(waitin, t), percent(waitout, t));
+
+                if (slowest == NULL)
+                        slowest = pm->from;
+                if (percent(waitout, t) > maxwait) {
+                        maxwait = percent(waitout, t);
+                        slowest = pm->to;
+                }
+        }
+        if (slowest)
+                fprintf(fp, "  %s: %s\n", final ? "bottleneck":
+                    "bottleneck so far", slowest);
+}
+
+void
+meter_free(meter_t *m)
+{
+
+        munmap(m, m->size);
+}
@@ -0,0 +1,16 @@
+#ifndef ISH_METER_H_
+#define ISH_METER_H_
+
+#include <stdio.h>
+
+typedef struct meter meter_t;
+
+extern void meter_enable(_Bool);
+extern _Bool meter_enabled(void);
+extern meter_t *meter_new(int);
+extern void meter_label(meter_t *, int, const char *, const char *);
+extern int meter_run(meter_t *, int, int, int);
+extern void meter_print(FILE *, const meter_t *, _Bool);
+extern void meter_free(meter_t *);
+
+#endif  /* !ISH_METER_H_ */
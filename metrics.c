@@ -0,0 +1,382 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <sys/resource.h>
+#include <sys/time.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "env.h"
+#include "err.h"
+#include "jobs.h"
+#include "metrics.h"
+#include "stats.h"
+#include "utils.h"
+
+#define INTERVAL	10      /* s, between two exports by default */
+#define SLOWMS		1000    /* ms, threshold of the slow log by default */
+
+/*
+ * Metrics for the monitoring of a fleet of shells.
+ *
+ * If $ISH_METRICS is set, the metrics are written to the file
+ * ish.<pid>.prom in this directory in the Prometheus text format, e.g.
+ * for the textfile collector of the node exporter: between two commands
+ * if $ISH_METRICS_INTERVAL seconds have passed since the last time
+ * (never if 0), and when the shell exits.  Each shell has its own file,
+ * and its samples are labeled with its pid, so that the shells sharing
+ * the directory don't overwrite each other.  The file is replaced at
+ * once, so it's never read half written.
+ *
+ * If $ISH_SLOWLOG is set, the jobs which took more than $ISH_SLOWLOG_MS
+ * milliseconds, or one of whose processes used more than
+ * $ISH_SLOWLOG_RSS KiB (no limit if 0), are appended to this file, a
+ * line each.
+ */
+
+enum { K_JOB, K_BUILTIN, NKINDS };
+
+static const char *kinds[NKINDS] = {
+        [K_JOB] = "job",
+        [K_BUILTIN] = "builtin",
+};
+
+/* Upper bounds of the buckets of the spawn latencies. */
+static const struct {
+        const char *le;         /* s */
+        uint64_t ns;
+} buckets[] = {
+        {"0.00005", 50000},
+        {"0.0001", 100000},
+        {"0.00025", 250000},
+        {"0.0005", 500000},
+        {"0.001", 1000000},
+        {"0.0025", 2500000},
+        {"0.005", 5000000},
+        {"0.01", 10000000},
+        {"0.025", 25000000},
+        {"0.1", 100000000},
+};
+
+#define NBUCKETS	(sizeof(buckets) / sizeof(buckets[0]))
+
+static struct {
+        pid_t pid;                      /* of the shell */
+        uint64_t last;                  /* ns, time of the last export */
+        uint64_t commands[NKINDS];
+        uint64_t failures[NKINDS][256]; /* by exit status */
+        uint64_t spawns[NBUCKETS + 1];  /* by bucket, the last is +Inf */
+        uint64_t spawnsum;              /* ns */
+} metrics;
+
+/*
+ * Return the value of the variable "name", or NULL if it's not set or
+ * empty.
+ */
+static const char *
+envstr(const char *name)
+{
+        const char *s;
+
+        if ((s = env_get(name)) == NULL || *s == '\0')
+                return (NULL);
+        return (s);
+}
+
+/*
+ * Return the value of the variable "name" as a number, or "def" if it's
+ * not set or not a non-negative number.
+ */
+static long
+envnum(const char *name, long def)
+{
+        const char *s;
+        char *end;
+        long n;
+
+        if ((s = envstr(name)) == NULL)
+                return (def);
+        errno = 0;
+        n = strtol(s, &end, 10);
+        if (errno != 0 || *end != '\0' || n < 0)
+                return (def);
+        return (n);
+}
+
+/*
+ * Record the time taken by a fork() of the shell, in ns.
+ */
+void
+metrics_spawn(uint64_t ns)
+{
+        size_t i;
+
+        for (i = 0; i < NBUCKETS && ns > buckets[i].ns; i++)
+                ;
+        metrics.spawns[i]++;
+        metrics.spawnsum += ns;
+}
+
+static void
+count(int kind, int status)
+{
+
+        metrics.commands[kind]++;
+        if (status > 0)
+                metrics.failures[kind][status & 0377]++;
+}
+
+/*
+ * Record a builtin run by the shell itself, with its exit status.
+ */
+void
+metrics_builtin(int status)
+{
+
+        count(K_BUILTIN, status);
+}
+
+static void
+quote(FILE *fp, const char *s)
+{
+
+        putc('"', fp);
+        for (; *s; s++) {
+                if (*s == '"' || *s == '\\')
+                        fprintf(fp, "\\%c", *s);
+                else if (*s == '\n')
+                        fputs("\\n", fp);
+                else
+                        putc(*s, fp);
+        }
+        putc('"', fp);
+}
+
+static inline long
+tvms(const struct timeval *tv)
+{
+
+        return (tv->tv_sec * 1000L + tv->tv_usec / 1000);
+}
+
+/*
+ * Append the job to the slow log if it's over the thresholds.  The line
+ * is written at once, so the shells can share the log.
+ */
+static void
+slowlog(const char *cmd, int status, uint64_t wall, const struct rusage *ru)
+{
+        const char *path;
+        struct timespec ts;
+        struct tm tm;
+        char date[32];
+        size_t len;
+        char *buf;
+        long rss;
+        FILE *fp;
+        int fd;
+
+        if ((path = envstr("ISH_SLOWLOG")) == NULL)
+                return;
+        rss = envnum("ISH_SLOWLOG_RSS", 0);
+        if (wall / 1000000 <= (uint64_t)envnum("ISH_SLOWLOG_MS", SLOWMS) &&
+            (rss == 0 || ru->ru_maxrss <= rss))
+                return;
+
+        clock_gettime(CLOCK_REALTIME, &ts);
+        gmtime_r(&ts.tv_sec, &tm);
+        strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", &tm);
+        if ((fp = open_memstream(&buf, &len)) == NULL)
+                err_sys("open_memstream");
+        fprintf(fp, "time=%s pid=%ld status=%d wall_ms=%" PRIu64
+            " user_ms=%ld sys_ms=%ld maxrss_kb=%ld cmd=", date,
+            (long)metrics.pid, status, wall / 1000000, tvms(&ru->ru_utime),
+            tvms(&ru->ru_stime), ru->ru_maxrss);
+        quote(fp, cmd);
+        putc('\n', fp);
+        fclose(fp);
+
+        if ((fd = open(path, O_WRONLY|O_APPEND|O_CREAT|O_CLOEXEC, 0666))
+            == -1)
+                warn("%s", path);
+        else {
+                if (write(fd, buf, len) != (ssize_t)len)
+                        warn("%s", path);
+                close(fd);
+        }
+        free(buf);
+}
+
+/*
+ * Record a finished job, with its exit status as in sh(1), the time
+ * since it was started in ns and the resources used by its processes.
+ */
+void
+metrics_job(const char *cmd, int status, uint64_t wall,
+    const struct rusage *ru)
+{
+
+        count(K_JOB, status);
+        slowlog(cmd, status, wall, ru);
+}
+
+static void
+writemetrics(FILE *fp)
+{
+        char pid[32];           /* label of every sample */
+        int running;
+        int stopped;
+        int done;
+        int slots;
+        uint64_t n;
+
+        snprintf(pid, sizeof(pid), "pid=\"%ld\"", (long)metrics.pid);
+
+        fprintf(fp, "# HELP ish_commands_total Commands run, by kind.\n"
+            "# TYPE ish_commands_total counter\n");
+        for (int k = 0; k < NKINDS; k++)
+                fprintf(fp, "ish_commands_total{%s,kind=\"%s\"} %" PRIu64
+                    "\n", pid, kinds[k], metrics.commands[k]);
+
+        fprintf(fp, "# HELP ish_command_failures_total Commands which "
+            "failed, by kind and exit status.\n"
+            "# TYPE ish_command_failures_total counter\n");
+        for (int k = 0; k < NKINDS; k++)
+                for (int st = 1; st < 256; st++)
+                        if (metrics.failures[k][st] != 0)
+                                fprintf(fp, "ish_command_failures_total"
+                                    "{%s,kind=\"%s\",status=\"%d\"} %"
+                                    PRIu64 "\n", pid, kinds[k], st,
+                                    metrics.failures[k][st]);
+
+        fprintf(fp, "# HELP ish_exec_failures_total Commands which "
+            "couldn't be executed.\n"
+            "# TYPE ish_exec_failures_total counter\n"
+            "ish_exec_failures_total{%s} %" PRIu64 "\n", pid,
+            stats_get(ST_EXECFAILS));
+
+        fprintf(fp, "# HELP ish_spawn_latency_seconds Time taken by "
+            "fork() in the shell.\n"
+            "# TYPE ish_spawn_latency_seconds histogram\n");
+        n = 0;
+        for (size_t i = 0; i < NBUCKETS; i++) {
+                n += metrics.spawns[i];
+                fprintf(fp, "ish_spawn_latency_seconds_bucket"
+                    "{%s,le=\"%s\"} %" PRIu64 "\n", pid, buckets[i].le, n);
+        }
+        n += metrics.spawns[NBUCKETS];
+        fprintf(fp, "ish_spawn_latency_seconds_bucket{%s,le=\"+Inf\"} %"
+            PRIu64 "\n", pid, n);
+        fprintf(fp, "ish_spawn_latency_seconds_sum{%s} %.9f\n", pid,
+            metrics.spawnsum / 1e9);
+        fprintf(fp, "ish_spawn_latency_seconds_count{%s} %" PRIu64 "\n",
+            pid, n);
+
+        countjobs(&running, &stopped, &done, &slots);
+        fprintf(fp, "# HELP ish_jobs Current jobs, by state.\n"
+            "# TYPE ish_jobs gauge\n"
+            "ish_jobs{%s,state=\"running\"} %d\n"
+            "ish_jobs{%s,state=\"stopped\"} %d\n"
+            "ish_jobs{%s,state=\"done\"} %d\n", pid, running, pid, stopped,
+            pid, done);
+        fprintf(fp, "# HELP ish_job_queue_depth Jobs waiting to be reaped "
+            "or reported.\n"
+            "# TYPE ish_job_queue_depth gauge\n"
+            "ish_job_queue_depth{%s} %d\n", pid, running + stopped + done);
+        fprintf(fp, "# HELP ish_job_table_slots Size of the job table.\n"
+            "# TYPE ish_job_table_slots gauge\n"
+            "ish_job_table_slots{%s} %d\n", pid, slots);
+}
+
+/*
+ * Write the metrics to the file of the shell in the directory "dir",
+ * through a temporary file renamed to it.
+ */
+static void
+export(const char *dir)
+{
+        size_t len;
+        char *path;
+        char *tmp;
+        FILE *fp;
+        int error;
+
+        len = strlen(dir) + 64;
+        path = malloc_or_die(len);
+        tmp = malloc_or_die(len);
+        snprintf(path, len, "%s/ish.%ld.prom", dir, (long)metrics.pid);
+        snprintf(tmp, len, "%s.tmp", path);
+        if ((fp = fopen(tmp, "w")) == NULL) {
+                warn("%s", tmp);
+                goto out;
+        }
+        writemetrics(fp);
+        error = ferror(fp);
+        if (fclose(fp) == EOF || error) {
+                warn("%s", tmp);
+                unlink(tmp);
+                goto out;
+        }
+        if (rename(tmp, path) == -1) {
+                warn("%s", path);
+                unlink(tmp);
+        }
+out:
+        free(path);
+        free(tmp);
+}
+
+/*
+ * Return true if the metrics are exported by this process.
+ */
+_Bool
+metrics_enabled(void)
+{
+
+        return (getpid() == metrics.pid && envstr("ISH_METRICS") != NULL);
+}
+
+/*
+ * Write the metrics if it's time.  Called by the shell between two
+ * commands.
+ */
+void
+metrics_update(void)
+{
+        uint64_t now;
+        long interval;
+
+        if (!metrics_enabled())
+                return;
+        interval = envnum("ISH_METRICS_INTERVAL", INTERVAL);
+        now = stats_now();
+        if (interval == 0 ||
+            now - metrics.last < (uint64_t)interval * 1000000000)
+                return;
+        metrics.last = now;
+        export(envstr("ISH_METRICS"));
+}
+
+static void
+metricsexit(void)
+{
+
+        if (metrics_enabled())
+                export(envstr("ISH_METRICS"));
+}
+
+void
+metrics_init(void)
+{
+
+        metrics.pid = getpid();
+        metrics.last = stats_now();
+        atexit(metricsexit);
+}
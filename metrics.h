@@ -0,0 +1,15 @@
+#ifndef ISH_METRICS_H_
+#define ISH_METRICS_H_
+
+#include <sys/resource.h>
+
+#include <stdint.h>
+
+extern void metrics_init(void);
+extern void metrics_spawn(uint64_t);
+extern void metrics_builtin(int);
+extern void metrics_job(const char *, int, uint64_t, const struct rusage *);
+extern void metrics_update(void);
+extern _Bool metrics_enabled(void);
+
+#endif  /* !ISH_METRICS_H_ */
@@ -0,0 +1,209 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bltin.h"
+#include "cmd.h"
+#include "opt.h"
+#include "utils.h"
+
+/*
+ * Return true if the word is left unchanged by the expansion.
+ */
+static _Bool
+isliteral(const char *w)
+{
+
+        return (strpbrk(w, "$`'\"\\*?[]{}~") == NULL &&
+            !cmd_isprocsubst(w));
+}
+
+static inline _Bool
+hasredirs(const cmd_t *c)
+{
+
+        return (c->filein || c->fileout || c->herein || c->heredelim);
+}
+
+static inline _Bool
+ispiped(const cmd_t *c)
+{
+
+        return (c && (c->mode == C_PIPE || c->mode == C_PIPEERR ||
+            c->mode == C_TEE));
+}
+
+static _Bool
+hasprocsubst(const cmd_t *c)
+{
+
+        for (int i = 0; i < c->args->len; i++)
+                if (cmd_isprocsubst(array_get(c->args, i)))
+                        return (1);
+
+        return (0);
+}
+
+/*
+ * Return true if the command is a builtin run from the shell.
+ */
+static _Bool
+isbltin(const cmd_t *c)
+{
+
+        return (isliteral(c->name) && lookupbltin(c->name) &&
+            !(bltinflags(c->name) & BLT_FORK) && !hasprocsubst(c));
+}
+
+static void
+unlink1(cmd_t **pp)
+{
+        cmd_t *c = *pp;
+
+        *pp = c->next;
+        c->next = NULL;
+        cmd_free(c);
+}
+
+/*
+ * Return true if a command after "c" in the line runs in the
+ * foreground, so that it sets the exit status after "c".
+ */
+static _Bool
+hasnextstatus(const cmd_t *c)
+{
+
+        for (c = c->next; c; c = c->next)
+                if (c->mode == C_SEQ)
+                        return (1);
+
+        return (0);
+}
+
+/*
+ * Rewrite "cat file | cmd" into "cmd <file", which saves a process and
+ * a copy of the data through a pipe.  The file must be a literal and
+ * "cmd" must be forked, so that an open error is reported from its own
+ * process.
+ */
+static _Bool
+rmcat(cmd_t **pp)
+{
+        cmd_t *c = *pp;
+        cmd_t *next = c->next;
+        const char *file;
+
+        if (strcmp(c->name, "cat") || c->mode != C_PIPE ||
+            c->args->len != 1 || hasredirs(c))
+                return (0);
+        file = array_get(c->args, 0);
+        if (file[0] == '-' || !isliteral(file))
+                return (0);
+        if (hasredirs(next) || !isliteral(next->name) || isbltin(next) ||
+            next->replicas > 1)
+                return (0);
+
+        next->filein = strdup_or_die(file);
+        unlink1(pp);
+
+        return (1);
+}
+
+/*
+ * Rewrite the command line before running it.
+ *
+ * - A pipeline starting with "cat file" reads the file directly.
+ * - "true" commands run in sequence are removed if a later command of
+ *   the line sets the exit status in their place.
+ * - Builtins run in sequence are marked CF_BLTSEQ so that they share
+ *   the saving of the standard descriptors.
+ * - If "last" is true, the shell exits after this command line, so its
+ *   last command is marked CF_EXEC if it's an external command: the
+ *   shell process is replaced by it instead of waiting for it.
+ *
+ * Return the new command line, which may be empty.
+ */
+cmd_t *
+optimize(cmd_t *c, _Bool last)
+{
+        cmd_t **pp;
+        cmd_t *prev;
+
+        prev = NULL;
+        for (pp = &c; *pp; ) {
+                cmd_t *cur = *pp;
+                _Bool first = !ispiped(prev);
+
+                if (first && ispiped(cur) && rmcat(pp))
+                        continue;
+                if (first && cur->mode == C_SEQ && !hasredirs(cur) &&
+                    !strcmp(cur->name, "true") && cur->args->len == 0 &&
+                    hasnextstatus(cur)) {
+                        unlink1(pp);
+                        continue;
+                }
+                prev = cur;
+                pp = &cur->next;
+        }
+
+        prev = NULL;
+        for (cmd_t *cur = c; cur; prev = cur, cur = cur->next) {
+                cur->flags = 0;
+                if (ispiped(prev) || cur->mode != C_SEQ)
+                        continue;
+                if (isbltin(cur)) {
+                        /* Only mark sequences of at least two. */
+                        if (prev && (prev->flags & CF_BLTSEQ))
+                                cur->flags |= CF_BLTSEQ;
+                        else if (cur->next && cur->next->mode == C_SEQ &&
+                            isbltin(cur->next))
+                                cur->flags |= CF_BLTSEQ;
+                } else if (last && cur->next == NULL && !hasprocsubst(cur))
+                        cur->flags |= CF_EXEC;
+        }
+
+        return (c);
+}
+
+/*
+ * Print the command line as rewritten by optimize(), one command per
+ * line, along with how it's run.
+ */
+void
+opt_dump(FILE *fp, const cmd_t *c)
+{
+        const cmd_t *prev;
+        const char *how;
+        char par[16];
+
+        fprintf(fp, "plan:\n");
+        for (prev = NULL; c; prev = c, c = c->next) {
+                cmd_t one = *c;
+                char *s;
+
+                if (c->flags & CF_EXEC)
+                        how = "exec";
+                else if (c->flags & CF_BLTSEQ)
+                        how = "bltseq";
+                else if (!ispiped(prev) && !ispiped(c) &&
+                    c->mode == C_SEQ && isbltin(c))
+                        how = "shell";
+                else if (c->replicas > 1) {
+                        snprintf(par, sizeof(par), "par*%d%s", c->replicas,
+                            c->ordered ? "o": "");
+                        how = par;
+                } else
+                        how = "fork";
+
+                one.next = NULL;
+                s = cmd_str(&one);
+                fprintf(fp, "  %-6s  %s%s\n", how, s,
+                    c->mode == C_PIPE ? " |":
+                    c->mode == C_PIPEERR ? " |&":
+                    c->mode == C_TEE ? " |+":
+                    c->mode == C_BGRD ? " &": "");
+                free(s);
+        }
+}
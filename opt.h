@@ -0,0 +1,11 @@
+#ifndef ISH_OPT_H_
+#define ISH_OPT_H_
+
+#include <stdio.h>
+
+#include "cmd.h"
+
+extern cmd_t *optimize(cmd_t *, _Bool);
+extern void opt_dump(FILE *, const cmd_t *);
+
+#endif  /* !ISH_OPT_H_ */
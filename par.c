@@ -0,0 +1,456 @@
+#define _GNU_SOURCE
+
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "err.h"
+#include "par.h"
+#include "utils.h"
+
+#define BLKSIZ		(64*1024)       /* block size of the unordered mode */
+#define ORDBLKSIZ	(1024*1024)     /* block size of the ordered mode */
+
+/*
+ * A replicated stage "|*N cmd" runs N copies of cmd.  A splitter
+ * process reads the input of the stage and deals it out to the replicas
+ * in blocks of whole lines, and a merger process gathers their outputs
+ * into the output of the stage.
+ *
+ * Without ordering, each block goes to whichever replica is ready, and
+ * the outputs are merged line by line as they come.
+ *
+ * With "|*No", the blocks are dealt in turn and the merger reads the
+ * outputs in the same turn.  Since the output of a block can't be told
+ * apart in the output of a long-running command, each replica is a
+ * worker running the command once per block, from and to a memfd.  The
+ * blocks and their outputs are sent framed by their length.
+ *
+ * Each replica i is connected by 4 descriptors in the array returned by
+ * par_open(), in this order: its input, the splitter side of it, the
+ * merger side of its output, and its output.
+ */
+#define IN(fds, i)	((fds)[4*(i)])
+#define SPLIT(fds, i)	((fds)[4*(i) + 1])
+#define MERGE(fds, i)	((fds)[4*(i) + 2])
+#define OUT(fds, i)	((fds)[4*(i) + 3])
+
+typedef uint64_t frame_t;       /* length of a block in the ordered mode */
+
+/*
+ * Create the pipes of a stage of "n" replicas.
+ */
+int *
+par_open(int n)
+{
+        int *fds;
+
+        fds = malloc_or_die(4 * n * sizeof(*fds));
+        for (int i = 0; i < n; i++) {
+                if (pipe2(&IN(fds, i), O_CLOEXEC) == -1 ||
+                    pipe2(&MERGE(fds, i), O_CLOEXEC) == -1)
+                        err_sys("pipe2");
+        }
+
+        return (fds);
+}
+
+/*
+ * Close the pipes of a stage once all its processes are forked.
+ */
+void
+par_close(int *fds, int n)
+{
+
+        for (int i = 0; i < 4 * n; i++)
+                close_or_die(fds[i]);
+        free(fds);
+}
+
+/*
+ * Close the descriptors of the pipes not used by "role".
+ */
+static void
+closeunused(int *fds, int n, int role)
+{
+
+        for (int i = 0; i < n; i++) {
+                if (role != PAR_REPLICA + i) {
+                        close_or_die(IN(fds, i));
+                        close_or_die(OUT(fds, i));
+                }
+                if (role != PAR_SPLITTER)
+                        close_or_die(SPLIT(fds, i));
+                if (role != PAR_MERGER)
+                        close_or_die(MERGE(fds, i));
+        }
+}
+
+/*
+ * Read exactly "len" bytes, unless the end of the input comes first.
+ *
+ * Return the number of bytes read, or -1 on error.
+ */
+static ssize_t
+readall(int fd, void *buf, size_t len)
+{
+        size_t off;
+        ssize_t n;
+
+        for (off = 0; off < len; off += n) {
+                if ((n = read(fd, (char *)buf + off, len - off)) == -1) {
+                        if (errno != EINTR)
+                                return (-1);
+                        n = 0;
+                } else if (n == 0)
+                        break;
+        }
+
+        return (off);
+}
+
+/*
+ * Write "len" bytes.  Return the number of bytes written, less than
+ * "len" on error.
+ */
+static size_t
+writeall(int fd, const void *buf, size_t len)
+{
+        size_t off;
+        ssize_t n;
+
+        for (off = 0; off < len; off += n) {
+                if ((n = write(fd, (const char *)buf + off, len - off)) == -1) {
+                        if (errno != EINTR)
+                                break;
+                        n = 0;
+                }
+        }
+
+        return (off);
+}
+
+/*
+ * Copy "len" bytes from "in" to "out", with splice() if one of them is
+ * a pipe.
+ *
+ * Return 0 on success and -1 on error or at an early end of "in".
+ */
+static int
+copyn(int in, int out, size_t len)
+{
+        char buf[8192];
+        _Bool nosplice = 0;
+        ssize_t n;
+
+        while (len > 0) {
+                if (!nosplice) {
+                        n = splice(in, NULL, out, NULL, len, SPLICE_F_MOVE);
+                        if (n == -1 && errno == EINVAL) {
+                                nosplice = 1;
+                                continue;
+                        }
+                } else {
+                        n = read(in, buf, len < sizeof(buf) ? len: sizeof(buf));
+                        if (n > 0 && writeall(out, buf, n) != (size_t)n)
+                                return (-1);
+                }
+                if (n == -1 && errno == EINTR)
+                        continue;
+                if (n <= 0)
+                        return (-1);
+                len -= n;
+        }
+
+        return (0);
+}
+
+/*
+ * Send a block to one of the "*np" replicas of "outs", the first ready
+ * one from "*nextp" onwards without ordering, or the replica "*nextp"
+ * with ordering.  A replica gone without ordering is dropped and the
+ * rest of the block sent to another one.
+ *
+ * Return -1 if the block can't be sent.
+ */
+static int
+sendblock(int *outs, int *np, int *nextp, const char *buf, size_t len,
+    _Bool ordered)
+{
+        struct pollfd pfds[PAR_MAX];
+        frame_t hdr = len;
+        size_t w;
+        int i;
+
+        if (ordered) {
+                i = *nextp;
+                *nextp = (i + 1) % *np;
+                if (writeall(outs[i], &hdr, sizeof(hdr)) != sizeof(hdr) ||
+                    writeall(outs[i], buf, len) != len)
+                        return (-1);
+                return (0);
+        }
+
+        while (len > 0 && *np > 0) {
+                for (i = 0; i < *np; i++) {
+                        pfds[i].fd = outs[(*nextp + i) % *np];
+                        pfds[i].events = POLLOUT;
+                }
+                if (poll(pfds, *np, -1) == -1) {
+                        if (errno == EINTR)
+                                continue;
+                        return (-1);
+                }
+                for (i = 0; i < *np && pfds[i].revents == 0; i++)
+                        continue;
+                i = (*nextp + i) % *np;
+                *nextp = (i + 1) % *np;
+
+                w = writeall(outs[i], buf, len);
+                buf += w;
+                len -= w;
+                if (len > 0) {
+                        close(outs[i]);
+                        outs[i] = outs[--*np];
+                        *nextp = 0;
+                }
+        }
+
+        return (len > 0 ? -1: 0);
+}
+
+/*
+ * Deal out the input to the replicas in blocks of whole lines.  An
+ * unterminated last line makes a block on its own.
+ */
+static int
+split(int in, int *outs, int n, _Bool ordered)
+{
+        size_t blksiz = ordered ? ORDBLKSIZ: BLKSIZ;
+        size_t cap = 2 * blksiz;
+        size_t len = 0;
+        char *buf;
+        char *nl;
+        int next = 0;
+        ssize_t r;
+
+        buf = malloc_or_die(cap);
+        for (;;) {
+                if (len == cap)
+                        buf = realloc_or_die(buf, cap *= 2);
+                if ((r = read(in, buf + len, cap - len)) == -1) {
+                        if (errno == EINTR)
+                                continue;
+                        return (1);
+                }
+                if (r == 0)
+                        break;
+                len += r;
+                if (len < blksiz ||
+                    (nl = memrchr(buf + len - r, '\n', r)) == NULL)
+                        continue;
+
+                if (sendblock(outs, &n, &next, buf, nl + 1 - buf,
+                    ordered) == -1)
+                        return (1);
+                len -= nl + 1 - buf;
+                memmove(buf, nl + 1, len);
+        }
+        if (len > 0 && sendblock(outs, &n, &next, buf, len, ordered) == -1)
+                return (1);
+
+        return (0);
+}
+
+/*
+ * Partial output of a replica without ordering.
+ */
+typedef struct pending {
+        char *buf;
+        size_t len;
+        size_t cap;
+} pending_t;
+
+/*
+ * Gather the outputs of the replicas into "out" without ordering.  The
+ * lines are kept whole: the end of a read after its last newline waits
+ * for the next read of the same replica.
+ */
+static int
+mergeany(int *ins, int n, int out)
+{
+        struct pollfd pfds[PAR_MAX];
+        pending_t pend[PAR_MAX];
+        pending_t *p;
+        char *nl;
+        ssize_t r;
+        int nopen;
+
+        for (int i = 0; i < n; i++) {
+                pfds[i].fd = ins[i];
+                pfds[i].events = POLLIN;
+                pend[i].cap = BLKSIZ;
+                pend[i].buf = malloc_or_die(pend[i].cap);
+                pend[i].len = 0;
+        }
+
+        for (nopen = n; nopen > 0; ) {
+                if (poll(pfds, n, -1) == -1) {
+                        if (errno == EINTR)
+                                continue;
+                        return (1);
+                }
+                for (int i = 0; i < n; i++) {
+                        if (pfds[i].fd == -1 || pfds[i].revents == 0)
+                                continue;
+                        p = &pend[i];
+                        if (p->len == p->cap)
+                                p->buf = realloc_or_die(p->buf, p->cap *= 2);
+                        r = read(pfds[i].fd, p->buf + p->len,
+                            p->cap - p->len);
+                        if (r == -1 && errno == EINTR)
+                                continue;
+                        if (r <= 0) {
+                                /* Flush an unterminated last line. */
+                                if (writeall(out, p->buf, p->len) != p->len)
+                                        return (1);
+                                close(pfds[i].fd);
+                                pfds[i].fd = -1;
+                                nopen--;
+                                continue;
+                        }
+                        p->len += r;
+                        if ((nl = memrchr(p->buf + p->len - r, '\n', r)) ==
+                            NULL)
+                                continue;
+                        if (writeall(out, p->buf, nl + 1 - p->buf) !=
+                            (size_t)(nl + 1 - p->buf))
+                                return (1);
+                        p->len -= nl + 1 - p->buf;
+                        memmove(p->buf, nl + 1, p->len);
+                }
+        }
+
+        return (0);
+}
+
+/*
+ * Gather the outputs of the blocks into "out" in the order they were
+ * dealt out.  The replicas run out of blocks in turn as well.
+ */
+static int
+mergeordered(int *ins, int n, int out)
+{
+        frame_t hdr;
+        ssize_t r;
+
+        for (int i = 0; ; i = (i + 1) % n) {
+                if ((r = readall(ins[i], &hdr, sizeof(hdr))) == 0)
+                        return (0);
+                if (r != sizeof(hdr) || copyn(ins[i], out, hdr) == -1)
+                        return (1);
+        }
+}
+
+/*
+ * Replica of the ordered mode: run the command on each block read from
+ * the standard input, and send its output to the standard output.
+ *
+ * Return the last non-zero status of the command, or 0.
+ */
+static int
+worker(void (*run)(void *), void *arg)
+{
+        frame_t hdr;
+        ssize_t r;
+        pid_t pid;
+        int status;
+        int ret;
+        int in;
+        int out;
+
+        ret = 0;
+        while ((r = readall(STDIN_FILENO, &hdr, sizeof(hdr))) != 0) {
+                if (r != sizeof(hdr))
+                        return (1);
+                if ((in = memfd_create("ish-block", MFD_CLOEXEC)) == -1)
+                        err_sys("memfd_create");
+                if ((out = memfd_create("ish-block", MFD_CLOEXEC)) == -1)
+                        err_sys("memfd_create");
+                if (copyn(STDIN_FILENO, in, hdr) == -1 ||
+                    lseek(in, 0, SEEK_SET) == -1)
+                        return (1);
+
+                if ((pid = fork_or_die()) == 0) {
+                        /* child */
+                        if (dup2(in, STDIN_FILENO) == -1 ||
+                            dup2(out, STDOUT_FILENO) == -1)
+                                err_sys("dup2");
+                        run(arg);       /* doesn't return */
+                }
+                close_or_die(in);
+                while (waitpid(pid, &status, 0) == -1)
+                        if (errno != EINTR)
+                                err_sys("waitpid");
+                if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+                        ret = WIFEXITED(status) ? WEXITSTATUS(status):
+                            128 + WTERMSIG(status);
+
+                hdr = lseek(out, 0, SEEK_END);
+                if (lseek(out, 0, SEEK_SET) == -1 ||
+                    writeall(STDOUT_FILENO, &hdr, sizeof(hdr)) !=
+                    sizeof(hdr) || copyn(out, STDOUT_FILENO, hdr) == -1)
+                        return (1);
+                close_or_die(out);
+        }
+
+        return (ret);
+}
+
+/*
+ * Run the process "role" of a stage of "n" replicas.  Its standard input
+ * and output are those of the stage.  A replica runs the command with
+ * run(arg), which doesn't return.
+ */
+void
+par_run(int *fds, int n, int role, _Bool ordered, void (*run)(void *),
+    void *arg)
+{
+        int ends[PAR_MAX];
+
+        closeunused(fds, n, role);
+        switch (role) {
+        case PAR_SPLITTER:
+                close_or_die(STDOUT_FILENO);
+                signal(SIGPIPE, SIG_IGN);
+                for (int i = 0; i < n; i++)
+                        ends[i] = SPLIT(fds, i);
+                exit(split(STDIN_FILENO, ends, n, ordered));
+        case PAR_MERGER:
+                close_or_die(STDIN_FILENO);
+                for (int i = 0; i < n; i++)
+                        ends[i] = MERGE(fds, i);
+                exit(ordered ? mergeordered(ends, n, STDOUT_FILENO):
+                    mergeany(ends, n, STDOUT_FILENO));
+        default:
+                role -= PAR_REPLICA;
+                if (dup2(IN(fds, role), STDIN_FILENO) == -1 ||
+                    dup2(OUT(fds, role), STDOUT_FILENO) == -1)
+                        err_sys("dup2");
+                close_or_die(IN(fds, role));
+                close_or_die(OUT(fds, role));
+                if (ordered)
+                        exit(worker(run, arg));
+                run(arg);
+                exit(1);        /* NOTREACHED */
+        }
+}
@@ -0,0 +1,17 @@
+#ifndef ISH_PAR_H_
+#define ISH_PAR_H_
+
+#define PAR_MAX		64      /* maximum number of replicas of a stage */
+
+/*
+ * Processes of a replicated stage.  Replica i is PAR_REPLICA + i.
+ */
+#define PAR_SPLITTER	0
+#define PAR_MERGER	1
+#define PAR_REPLICA	2
+
+extern int *par_open(int);
+extern void par_close(int *, int);
+extern void par_run(int *, int, int, _Bool, void (*)(void *), void *);
+
+#endif  /* !ISH_PAR_H_ */
@@ -0,0 +1,333 @@
+#define _GNU_SOURCE
+
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <ctype.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "jobs.h"
+#include "pipe.h"
+#include "utils.h"
+
+#define FULLTICKS	3       /* ticks a pipe stays full before growing */
+
+static long defsize;            /* size of the pipelines pipes, if not 0 */
+static long growmax;            /* maximum size of a grown pipe, if not 0 */
+
+/*
+ * Parse a pipe size: a number of bytes optionally followed by K, M or
+ * G.  "endp" is set to the first character after it if not NULL.
+ *
+ * Return -1 if there's no valid size.
+ */
+long
+pipe_parsesize(const char *s, const char **endp)
+{
+        long n;
+        char *end;
+        int shift;
+
+        if (!isdigit((unsigned char)*s))
+                return (-1);
+        errno = 0;
+        n = strtol(s, &end, 10);
+        if (errno)
+                return (-1);
+        shift = 0;
+        switch (*end) {
+        case 'k': case 'K':
+                shift = 10;
+                end++;
+                break;
+        case 'm': case 'M':
+                shift = 20;
+                end++;
+                break;
+        case 'g': case 'G':
+                shift = 30;
+                end++;
+                break;
+        }
+        if (n > (1L<<30) >> shift)
+                return (-1);
+        n <<= shift;
+        if (endp)
+                *endp = end;
+
+        return (n);
+}
+
+void
+pipe_getconf(long *sizep, long *maxp)
+{
+
+        *sizep = defsize;
+        *maxp = growmax;
+}
+
+/*
+ * Set the size of the pipes between the commands of the pipelines,
+ * and the maximum size they can grow to automatically.  0 means the
+ * default size and no growth.
+ */
+void
+pipe_setconf(long size, long max)
+{
+
+        defsize = size;
+        growmax = max;
+}
+
+_Bool
+pipe_autogrow(void)
+{
+
+        return (growmax > 0);
+}
+
+/*
+ * Return the maximum size of a pipe for an unprivileged process.
+ */
+static long
+maxsize(void)
+{
+        static long max;
+        FILE *fp;
+
+        if (max == 0) {
+                max = 1024*1024;
+                if ((fp = fopen("/proc/sys/fs/pipe-max-size", "r")) != NULL) {
+                        if (fscanf(fp, "%ld", &max) != 1)
+                                max = 1024*1024;
+                        fclose(fp);
+                }
+        }
+
+        return (max);
+}
+
+/*
+ * Change the size of the pipe of the given descriptor to "size", or to
+ * the size set by pipe_setconf() if it's 0.  A size too large for the
+ * user is reduced to the maximum.  Failures are silently ignored: the
+ * pipe keeps working as is.
+ */
+void
+pipe_resize(int fd, long size)
+{
+
+        if (size == 0 && (size = defsize) == 0)
+                return;
+        if (fcntl(fd, F_SETPIPE_SZ, (int)size) == -1 && errno == EPERM &&
+            size > maxsize())
+                fcntl(fd, F_SETPIPE_SZ, (int)maxsize());
+}
+
+/*
+ * State of the automatic growth of the pipes of a job.
+ */
+typedef struct growstate {
+        int nprocs;
+        int *full;              /* ticks the input of each process was full */
+} growstate_t;
+
+void *
+pipe_growstart(const job_t *jp)
+{
+        growstate_t *gs;
+
+        gs = malloc_or_die(sizeof(*gs));
+        gs->nprocs = jp->nprocs;
+        gs->full = malloc_or_die(jp->nprocs * sizeof(*gs->full));
+        memset(gs->full, 0, jp->nprocs * sizeof(*gs->full));
+
+        return (gs);
+}
+
+void
+pipe_growend(void *arg)
+{
+        growstate_t *gs = arg;
+
+        free(gs->full);
+        free(gs);
+}
+
+/*
+ * Called periodically while waiting for a job.  A pipe which has been
+ * found nearly full for a few ticks in a row means that its writer
+ * keeps blocking on a slower reader.  Its size is then doubled, up to
+ * the maximum set by pipe_setconf(), so that both sides exchange
+ * larger batches.
+ *
+ * The shell doesn't keep the pipes of the job, whose ends it must not
+ * hold.  Each one is opened shortly through the standard input of its
+ * reader in /proc.
+ */
+void
+pipe_growtick(job_t *jp, void *arg)
+{
+        growstate_t *gs = arg;
+        char path[64];
+        struct stat sb;
+        int navail;
+        int size;
+        int fd;
+
+        for (int i = 0; i < jp->nprocs && i < gs->nprocs; i++) {
+                if (jp->ps[i].status != -1)
+                        continue;
+                snprintf(path, sizeof(path), "/proc/%d/fd/0",
+                    (int)jp->ps[i].pid);
+                if ((fd = open(path, O_RDONLY|O_NONBLOCK|O_CLOEXEC)) == -1)
+                        continue;
+                if (fstat(fd, &sb) == -1 || !S_ISFIFO(sb.st_mode) ||
+                    ioctl(fd, FIONREAD, &navail) == -1 ||
+                    (size = fcntl(fd, F_GETPIPE_SZ)) == -1) {
+                        close(fd);
+                        continue;
+                }
+                if (navail < size - size/4)
+                        gs->full[i] = 0;
+                else if (++gs->full[i] >= FULLTICKS && size < growmax) {
+                        pipe_resize(fd, size*2 < growmax ? size*2: growmax);
+                        gs->full[i] = 0;
+                }
+                close(fd);
+        }
+}
+
+/*
+ * Move "*lenp" bytes from the pipe "in" to "out".
+ *
+ * Return -1 if "out" can't be written anymore, "*lenp" being left to
+ * the number of bytes not moved.
+ */
+static int
+spliceall(int in, int out, size_t *lenp)
+{
+        ssize_t n;
+
+        while (*lenp > 0) {
+                n = splice(in, NULL, out, NULL, *lenp, SPLICE_F_MOVE);
+                if (n == -1) {
+                        if (errno == EINTR)
+                                continue;
+                        return (-1);
+                }
+                *lenp -= n;
+        }
+
+        return (0);
+}
+
+/*
+ * Throw away "len" bytes of the pipe "in".
+ */
+static void
+discard(int in, size_t len)
+{
+        char buf[8192];
+        ssize_t n;
+
+        while (len > 0) {
+                n = read(in, buf, len < sizeof(buf) ? len: sizeof(buf));
+                if (n == -1 && errno == EINTR)
+                        continue;
+                if (n <= 0)
+                        return;
+                len -= n;
+        }
+}
+
+/*
+ * Move everything read from the pipe "in" to the pipe "out".
+ *
+ * Return 0 once "in" is at its end, and 1 if "out" is gone.
+ */
+static int
+forward(int in, int out)
+{
+        ssize_t n;
+
+        for (;;) {
+                n = splice(in, NULL, out, NULL, INT_MAX, SPLICE_F_MOVE);
+                if (n == 0)
+                        return (0);
+                if (n == -1 && errno != EINTR)
+                        return (1);
+        }
+}
+
+/*
+ * Copy everything read from the pipe "in" to each of the "n" pipes of
+ * "outs" without copying it through user space.  This is the helper
+ * process of a "|+" fan-out.
+ *
+ * tee(2) always duplicates from the beginning of a pipe, so the data
+ * is duplicated into a private pipe as large as "in", where it always
+ * fits whole, and then moved to an output in as many parts as needed.
+ * It's removed from "in" when moved to the last output.  An output
+ * whose reader is gone is dropped.
+ *
+ * Return 0 once "in" is at its end, and 1 if all the outputs are gone.
+ */
+int
+pipe_tee(int in, int *outs, int n)
+{
+        ssize_t len;
+        size_t left;
+        int priv[2];
+        int size;
+        _Bool copied;
+
+        if (pipe(priv) == -1)
+                return (1);
+        if ((size = fcntl(in, F_GETPIPE_SZ)) != -1)
+                fcntl(priv[1], F_SETPIPE_SZ, size);
+
+        for (;;) {
+                if (n == 1)
+                        return (forward(in, outs[0]));
+
+                /* Wait for data, leaving it in "in". */
+                len = tee(in, priv[1], INT_MAX, 0);
+                if (len == -1 && errno == EINTR)
+                        continue;
+                if (len <= 0)
+                        return (0);
+
+                copied = 1;
+                for (int i = 0; i < n - 1; ) {
+                        if (!copied && tee(in, priv[1], len, 0) != len)
+                                return (1);
+                        copied = 0;
+                        left = len;
+                        if (spliceall(priv[0], outs[i], &left) == -1) {
+                                discard(priv[0], left);
+                                close(outs[i]);
+                                outs[i] = outs[--n];
+                                continue;
+                        }
+                        i++;
+                }
+                if (copied)
+                        discard(priv[0], len);
+
+                left = len;
+                if (spliceall(in, outs[n - 1], &left) == -1) {
+                        discard(in, left);
+                        close(outs[--n]);
+                        if (n == 0)
+                                return (1);
+                }
+        }
+}
@@ -0,0 +1,16 @@
+#ifndef ISH_PIPE_H_
+#define ISH_PIPE_H_
+
+#include "jobs.h"
+
+extern long pipe_parsesize(const char *, const char **);
+extern void pipe_getconf(long *, long *);
+extern void pipe_setconf(long, long);
+extern _Bool pipe_autogrow(void);
+extern void pipe_resize(int, long);
+extern void *pipe_growstart(const job_t *);
+extern void pipe_growtick(job_t *, void *);
+extern void pipe_growend(void *);
+extern int pipe_tee(int, int *, int);
+
+#endif  /* !ISH_PIPE_H_ */
@@ -0,0 +1,110 @@
+#define _GNU_SOURCE
+
+#include <sys/mman.h>
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "err.h"
+#include "stats.h"
+
+static const char *names[ST_NCOUNTERS] = {
+        [ST_FORKS] = "forks",
+        [ST_EXECFAILS] = "exec_failures",
+        [ST_BUILTINS] = "builtins",
+        [ST_PATHLOOKUPS] = "path_lookups",
+        [ST_PROBES] = "path_probes",
+        [ST_ENVGETS] = "env_gets",
+        [ST_ENVBUILDS] = "env_builds",
+        [ST_JOBSMADE] = "jobs_made",
+        [ST_JOBSFREED] = "jobs_freed",
+        [ST_JOBGROWS] = "jobtab_grows",
+        [ST_JOBSHRINKS] = "jobtab_shrinks",
+        [ST_TOKENS] = "tokens",
+        [ST_LINES] = "lines",
+        [ST_PARSETIME] = "parse_ns",
+        [ST_SPAWNTIME] = "spawn_ns",
+        [ST_WAITTIME] = "wait_ns",
+        [ST_READTIME] = "read_ns",
+};
+
+/* Counted privately until stats_init(), e.g. by the benchmarks. */
+static uint64_t initial[ST_NCOUNTERS];
+
+uint64_t *stats_counters = initial;
+
+/*
+ * Move the counters to memory shared with the children to come.
+ */
+void
+stats_init(void)
+{
+        uint64_t *p;
+
+        p = mmap(NULL, sizeof(initial), PROT_READ|PROT_WRITE,
+            MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED)
+                err_sys("mmap");
+        memcpy(p, initial, sizeof(initial));
+        stats_counters = p;
+}
+
+uint64_t
+stats_now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+uint64_t
+stats_get(counter_t c)
+{
+
+        return (__atomic_load_n(&stats_counters[c], __ATOMIC_RELAXED));
+}
+
+/*
+ * The stats builtin: print the counters, as JSON with -j, or reset them
+ * with -r.
+ */
+int
+statscmd(int argc, char *argv[])
+{
+        _Bool json;
+
+        if (argc > 1)
+                goto usage;
+        json = 0;
+        if (argc == 1) {
+                if (!strcmp(argv[0], "-r")) {
+                        for (int i = 0; i < ST_NCOUNTERS; i++)
+                                __atomic_store_n(&stats_counters[i], 0,
+                                    __ATOMIC_RELAXED);
+                        return (0);
+                }
+                if (strcmp(argv[0], "-j"))
+                        goto usage;
+                json = 1;
+        }
+
+        for (int i = 0; i < ST_NCOUNTERS; i++) {
+                if (json)
+                        printf("%s\"%s\": %" PRIu64, i ? ", ": "{", names[i],
+                            stats_get(i));
+                else
+                        printf("%-16s %" PRIu64 "\n", names[i], stats_get(i));
+        }
+        if (json)
+                printf("}\n");
+        fflush(stdout);
+        return (0);
+
+usage:
+        fprintf(stderr, "usage: stats [-j | -r]\n");
+        return (2);
+}
@@ -0,0 +1,45 @@
+#ifndef ISH_STATS_H_
+#define ISH_STATS_H_
+
+#include <stdint.h>
+
+/*
+ * Counters of the stats builtin.  The times are in nanoseconds.
+ */
+typedef enum counter {
+        ST_FORKS,
+        ST_EXECFAILS,
+        ST_BUILTINS,
+        ST_PATHLOOKUPS,
+        ST_PROBES,              /* faccessat() of the PATH lookups */
+        ST_ENVGETS,
+        ST_ENVBUILDS,           /* environments built for execve() */
+        ST_JOBSMADE,
+        ST_JOBSFREED,
+        ST_JOBGROWS,            /* resizes of the job table */
+        ST_JOBSHRINKS,
+        ST_TOKENS,
+        ST_LINES,
+        ST_PARSETIME,
+        ST_SPAWNTIME,           /* in fork() */
+        ST_WAITTIME,            /* for the foreground jobs */
+        ST_READTIME,            /* for the input, while parsing */
+        ST_NCOUNTERS
+} counter_t;
+
+extern uint64_t *stats_counters;
+
+/*
+ * The counters are shared with the children of the shell, which count
+ * e.g. the failures of execve().
+ */
+#define STATS_ADD(c, n)							\
+        __atomic_fetch_add(&stats_counters[(c)], (n), __ATOMIC_RELAXED)
+#define STATS_INC(c)		STATS_ADD((c), 1)
+
+extern void stats_init(void);
+extern uint64_t stats_now(void);
+extern uint64_t stats_get(counter_t);
+extern int statscmd(int, char **);
+
+#endif  /* !ISH_STATS_H_ */
@@ -0,0 +1,359 @@
+#define _GNU_SOURCE
+
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "stats.h"
+#include "trace.h"
+
+#define NEVENTS		8192    /* events buffered */
+#define NAMELEN		16
+#define ARGLEN		96
+#define FLUSHMS		20      /* period of the flusher */
+#define BUFLEN		65536   /* output buffered */
+
+/*
+ * Trace of the jobs in the Chrome trace-event format, which Perfetto
+ * and chrome://tracing read.  All the events belong to the shell, and
+ * each process of a job gets a track of its own: the stages of a
+ * pipeline show in parallel.
+ *
+ * The events are written by the shell and its children to a ring
+ * shared with them, without locks: a writer claims a slot by moving
+ * the head forward, fills it and publishes it by setting its sequence
+ * number.  An event is dropped if the ring is full.  A thread of the
+ * shell writes the published events to the file in order.  It doesn't
+ * use stdio, whose buffers a child exiting would flush again.
+ */
+typedef struct event {
+        uint64_t seq;           /* position + 1 once published */
+        uint64_t ts;            /* ns */
+        uint64_t dur;
+        pid_t tid;
+        char ph;
+        char name[NAMELEN];
+        char arg[ARGLEN];
+} event_t;
+
+typedef struct ring {
+        uint64_t head;          /* next slot to claim */
+        uint64_t tail;          /* next slot to write out */
+        uint64_t dropped;
+        event_t ev[NEVENTS];
+} ring_t;
+
+static struct {
+        ring_t *ring;           /* NULL if not tracing */
+        pid_t pid;              /* of the shell */
+        int fd;
+        char buf[BUFLEN];
+        size_t len;
+        pthread_t flusher;
+        int stop;
+        _Bool first;            /* no event written yet */
+} trace;
+
+_Bool
+trace_enabled(void)
+{
+
+        return (trace.ring != NULL);
+}
+
+/*
+ * Record an event of phase "ph" on the track of process "tid", at
+ * "ts" ns and lasting "dur" ns for a complete event.  "arg" may be
+ * NULL.
+ */
+void
+trace_event(const char *name, int ph, pid_t tid, uint64_t ts, uint64_t dur,
+    const char *arg)
+{
+        ring_t *r = trace.ring;
+        event_t *ev;
+        uint64_t h;
+
+        if (r == NULL)
+                return;
+        h = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+        do {
+                if (h - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >=
+                    NEVENTS) {
+                        __atomic_fetch_add(&r->dropped, 1, __ATOMIC_RELAXED);
+                        return;
+                }
+        } while (!__atomic_compare_exchange_n(&r->head, &h, h + 1, 1,
+            __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+        ev = &r->ev[h % NEVENTS];
+        ev->ts = ts;
+        ev->dur = dur;
+        ev->tid = tid;
+        ev->ph = ph;
+        snprintf(ev->name, sizeof(ev->name), "%s", name);
+        snprintf(ev->arg, sizeof(ev->arg), "%s", arg ? arg: "");
+        __atomic_store_n(&ev->seq, h + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Record the change of status of the process "pid", as returned by
+ * wait().
+ */
+void
+trace_status(pid_t pid, int status)
+{
+        char arg[32];
+
+        if (trace.ring == NULL)
+                return;
+        if (WIFSTOPPED(status)) {
+                snprintf(arg, sizeof(arg), "%s", strsignal(WSTOPSIG(status)));
+                trace_event("stopped", TR_INSTANT, pid, stats_now(), 0, arg);
+        } else if (WIFCONTINUED(status))
+                trace_event("continued", TR_INSTANT, pid, stats_now(), 0,
+                    NULL);
+        else {
+                if (WIFEXITED(status))
+                        snprintf(arg, sizeof(arg), "exit %d",
+                            WEXITSTATUS(status));
+                else
+                        snprintf(arg, sizeof(arg), "%s",
+                            strsignal(WTERMSIG(status)));
+                trace_event("process", TR_END, pid, stats_now(), 0, arg);
+        }
+}
+
+static void
+flushbuf(void)
+{
+        ssize_t n;
+
+        for (size_t off = 0; off < trace.len; off += n)
+                if ((n = write(trace.fd, trace.buf + off, trace.len - off))
+                    == -1) {
+                        if (errno == EINTR) {
+                                n = 0;
+                                continue;
+                        }
+                        warn("trace");
+                        break;
+                }
+        trace.len = 0;
+}
+
+static void
+out(const char *fmt, ...)
+{
+        va_list ap;
+        int n;
+
+        va_start(ap, fmt);
+        n = vsnprintf(trace.buf + trace.len, BUFLEN - trace.len, fmt, ap);
+        va_end(ap);
+        if (n >= 0 && (size_t)n >= BUFLEN - trace.len) {
+                /* An event is much shorter than the buffer. */
+                flushbuf();
+                va_start(ap, fmt);
+                n = vsnprintf(trace.buf, BUFLEN, fmt, ap);
+                va_end(ap);
+        }
+        if (n > 0)
+                trace.len += n;
+}
+
+/*
+ * Return "s" quoted for JSON, in a static buffer.
+ */
+static const char *
+quote(const char *s)
+{
+        static char buf[2 + 6 * ARGLEN];
+        char *p;
+
+        p = buf;
+        *p++ = '"';
+        for (; *s; s++) {
+                if (*s == '"' || *s == '\\') {
+                        *p++ = '\\';
+                        *p++ = *s;
+                } else if ((unsigned char)*s < ' ')
+                        p += sprintf(p, "\\u%04x", *s);
+                else
+                        *p++ = *s;
+        }
+        *p++ = '"';
+        *p = '\0';
+
+        return (buf);
+}
+
+static void
+writeevent(const event_t *ev)
+{
+
+        out("%s{\"name\": %s", trace.first ? "\n": ",\n", quote(ev->name));
+        trace.first = 0;
+        out(", \"ph\": \"%c\", \"ts\": %.3f, \"pid\": %ld, \"tid\": %ld",
+            ev->ph, ev->ts / 1e3, (long)trace.pid, (long)ev->tid);
+        if (ev->ph == TR_COMPLETE)
+                out(", \"dur\": %.3f", ev->dur / 1e3);
+        if (ev->ph == TR_INSTANT)
+                out(", \"s\": \"t\"");
+        if (ev->arg[0] != '\0')
+                out(", \"args\": {\"%s\": %s}",
+                    ev->ph == TR_META ? "name": "detail", quote(ev->arg));
+        out("}");
+}
+
+/*
+ * Write out the events published in order.  If "all" is true, the
+ * slots claimed but never published, e.g. by a process killed in
+ * between, are skipped.
+ */
+static void
+drain(_Bool all)
+{
+        ring_t *r = trace.ring;
+        uint64_t head;
+        uint64_t t;
+        event_t *ev;
+
+        t = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+        head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        for (; t < head; t++) {
+                ev = &r->ev[t % NEVENTS];
+                if (__atomic_load_n(&ev->seq, __ATOMIC_ACQUIRE) == t + 1)
+                        writeevent(ev);
+                else if (all)
+                        r->dropped++;
+                else
+                        break;
+                __atomic_store_n(&r->tail, t + 1, __ATOMIC_RELEASE);
+        }
+}
+
+static void *
+flush(void *arg)
+{
+        struct timespec ts = {0, FLUSHMS * 1000000L};
+
+        (void)arg;
+        while (!__atomic_load_n(&trace.stop, __ATOMIC_ACQUIRE)) {
+                drain(0);
+                flushbuf();
+                nanosleep(&ts, NULL);
+        }
+
+        return (NULL);
+}
+
+/*
+ * Stop tracing and complete the file.
+ */
+void
+trace_stop(void)
+{
+        ring_t *r = trace.ring;
+
+        if (r == NULL || getpid() != trace.pid)
+                return;
+        __atomic_store_n(&trace.stop, 1, __ATOMIC_RELEASE);
+        pthread_join(trace.flusher, NULL);
+        drain(1);
+        trace.ring = NULL;      /* no more events */
+        out("\n],\n\"otherData\": {\"dropped\": %llu}}\n",
+            (unsigned long long)r->dropped);
+        flushbuf();
+        if (close(trace.fd) == -1)
+                warn("trace");
+        munmap(r, sizeof(*r));
+}
+
+/*
+ * Start tracing to the file "path", stopping the current trace.
+ *
+ * Return 0 on success and -1 on failure.
+ */
+int
+trace_start(const char *path)
+{
+        static _Bool registered;
+        sigset_t set;
+        sigset_t oset;
+        ring_t *r;
+        int fd;
+
+        trace_stop();
+        if ((fd = open(path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0666)) == -1)
+                return (-1);
+        r = mmap(NULL, sizeof(*r), PROT_READ|PROT_WRITE,
+            MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+        if (r == MAP_FAILED) {
+                close(fd);
+                return (-1);
+        }
+
+        trace.fd = fd;
+        trace.pid = getpid();
+        trace.first = 1;
+        trace.stop = 0;
+        trace.len = 0;
+        out("{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+        trace.ring = r;
+        trace_event("thread_name", TR_META, trace.pid, 0, 0, "ish");
+
+        /* The signals are handled by the shell, not by the flusher. */
+        sigfillset(&set);
+        pthread_sigmask(SIG_SETMASK, &set, &oset);
+        errno = pthread_create(&trace.flusher, NULL, flush, NULL);
+        pthread_sigmask(SIG_SETMASK, &oset, NULL);
+        if (errno != 0) {
+                trace.ring = NULL;
+                munmap(r, sizeof(*r));
+                close(fd);
+                return (-1);
+        }
+        if (!registered) {
+                atexit(trace_stop);
+                registered = 1;
+        }
+
+        return (0);
+}
+
+/*
+ * The settrace builtin: trace the jobs to a file, or stop tracing
+ * without argument.
+ */
+int
+settracecmd(int argc, char *argv[])
+{
+
+        if (argc > 1) {
+                fprintf(stderr, "usage: settrace [file]\n");
+                return (2);
+        }
+        if (argc == 0) {
+                trace_stop();
+                return (0);
+        }
+        if (trace_start(argv[0]) == -1) {
+                warn("settrace: %s", argv[0]);
+                return (1);
+        }
+
+        return (0);
+}
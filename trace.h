@@ -0,0 +1,25 @@
+#ifndef ISH_TRACE_H_
+#define ISH_TRACE_H_
+
+#include <sys/types.h>
+
+#include <stdint.h>
+
+/*
+ * Phases of the trace events, as in the Chrome trace-event format.
+ */
+#define TR_BEGIN	'B'
+#define TR_END		'E'
+#define TR_COMPLETE	'X'     /* with a duration */
+#define TR_INSTANT	'i'
+#define TR_META		'M'
+
+extern int trace_start(const char *);
+extern void trace_stop(void);
+extern _Bool trace_enabled(void);
+extern void trace_event(const char *, int, pid_t, uint64_t, uint64_t,
+    const char *);
+extern void trace_status(pid_t, int);
+extern int settracecmd(int, char **);
+
+#endif  /* !ISH_TRACE_H_ */
@@ -11,8 +11,15 @@
 #include <unistd.h>
 
 #include "err.h"
+#include "metrics.h"
+#include "stats.h"
 #include "utils.h"
 
+/* The functions themselves, which the accounting doesn't go through. */
+#undef malloc_or_die
+#undef realloc_or_die
+#undef strdup_or_die
+
 void *
 malloc_or_die(size_t size)
 {
@@ -34,10 +41,19 @@ realloc_or_die(void *ptr, size_t size)
 pid_t
 fork_or_die(void)
 {
+        uint64_t start;
+        uint64_t ns;
         pid_t pid;
 
+        start = stats_now();
         if ((pid = fork()) == -1)
                 err_sys("fork");
+        if (pid != 0) {
+                ns = stats_now() - start;
+                STATS_INC(ST_FORKS);
+                STATS_ADD(ST_SPAWNTIME, ns);
+                metrics_spawn(ns);
+        }
 
         return (pid);        
 }
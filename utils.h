@@ -19,4 +19,6 @@ extern int open_or_die(const char *, int, ...);
 extern char *strdup_or_die(const char *);
 extern const char *gethomedir(void);
 
+#include "alloc.h"
+
 #endif  /* !ISH_UTILS_H_ */
@@ -0,0 +1,372 @@
+#define _GNU_SOURCE
+
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <dirent.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bltin.h"
+#include "cmd.h"
+#include "jobs.h"
+#include "utils.h"
+#include "watch.h"
+
+#define DEBOUNCE	100     /* default quiet time ending a burst, in ms */
+#define TICK		50      /* period of the checks while running, in ms */
+
+#define EVENTS	(IN_MODIFY|IN_CLOSE_WRITE|IN_CREATE|IN_DELETE|IN_MOVED_FROM| \
+    IN_MOVED_TO|IN_DELETE_SELF|IN_MOVE_SELF)
+
+/*
+ * Last known state of a watched file.  An event only means a change if
+ * the state of its file has changed.
+ */
+typedef struct filesig {
+        char *path;
+        struct timespec mtime;
+        off_t size;
+        ino_t ino;
+        _Bool exists;
+} filesig_t;
+
+typedef struct watcher {
+        int fd;                 /* inotify descriptor */
+        char **paths;           /* path of each watch descriptor */
+        int npaths;
+        filesig_t *sigs;
+        int nsigs;
+        int debounce;           /* in ms */
+        _Bool changed;          /* a change has been seen */
+        _Bool rerun;            /* the command was canceled for a change */
+        job_t *jp;              /* running command line, or NULL */
+} watcher_t;
+
+static volatile sig_atomic_t interrupted;
+
+static void
+oninterrupt(int signo)
+{
+
+        interrupted = signo;
+}
+
+/*
+ * Record the state of the file "path".
+ *
+ * Return true if it's different from the last one recorded, or if
+ * there was none.
+ */
+static _Bool
+recordsig(watcher_t *w, const char *path)
+{
+        filesig_t cur;
+        struct stat sb;
+        filesig_t *sp;
+
+        memset(&cur, 0, sizeof(cur));
+        if (stat(path, &sb) == 0) {
+                cur.exists = 1;
+                cur.mtime = sb.st_mtim;
+                cur.size = sb.st_size;
+                cur.ino = sb.st_ino;
+        }
+
+        for (sp = w->sigs; sp < w->sigs + w->nsigs; sp++)
+                if (!strcmp(sp->path, path))
+                        break;
+        if (sp == w->sigs + w->nsigs) {
+                w->sigs = realloc_or_die(w->sigs,
+                    (w->nsigs + 1) * sizeof(*w->sigs));
+                sp = w->sigs + w->nsigs++;
+                sp->path = strdup_or_die(path);
+        } else if (sp->exists == cur.exists && sp->size == cur.size &&
+            sp->ino == cur.ino && sp->mtime.tv_sec == cur.mtime.tv_sec &&
+            sp->mtime.tv_nsec == cur.mtime.tv_nsec)
+                return (0);
+
+        cur.path = sp->path;
+        *sp = cur;
+        return (1);
+}
+
+/*
+ * Store in "path" the pathname of the entry "name" of the directory
+ * "dir".
+ *
+ * Return -1 if it's too long.
+ */
+static int
+subpath(char path[PATH_MAX], const char *dir, const char *name)
+{
+        int n;
+
+        n = snprintf(path, PATH_MAX, "%s/%s", dir, name);
+        return (n < 0 || n >= PATH_MAX ? -1: 0);
+}
+
+/*
+ * Watch "path", and the files of its directory if it's one.
+ *
+ * Return -1 if it can't be watched.
+ */
+static int
+addwatch(watcher_t *w, const char *path)
+{
+        char sub[PATH_MAX];
+        struct dirent *de;
+        DIR *dir;
+        int wd;
+
+        if ((wd = inotify_add_watch(w->fd, path, EVENTS)) == -1)
+                return (-1);
+        if (wd >= w->npaths) {
+                w->paths = realloc_or_die(w->paths,
+                    (wd + 1) * sizeof(*w->paths));
+                while (w->npaths <= wd)
+                        w->paths[w->npaths++] = NULL;
+        }
+        free(w->paths[wd]);
+        w->paths[wd] = strdup_or_die(path);
+        recordsig(w, path);
+
+        if ((dir = opendir(path)) == NULL)
+                return (0);
+        while ((de = readdir(dir)) != NULL) {
+                if (!strcmp(de->d_name, ".") ||
+                    !strcmp(de->d_name, "..") ||
+                    subpath(sub, path, de->d_name) == -1)
+                        continue;
+                recordsig(w, sub);
+        }
+        closedir(dir);
+
+        return (0);
+}
+
+/*
+ * Read the events available within "ms" milliseconds, -1 meaning no
+ * limit, and record whether they changed a file.
+ *
+ * Return 1 if there were events, 0 if there were none and -1 if
+ * interrupted.
+ */
+static int
+readevents(watcher_t *w, int ms)
+{
+        char buf[64 * (sizeof(struct inotify_event) + NAME_MAX + 1)];
+        const struct inotify_event *ev;
+        struct pollfd pfd;
+        char path[PATH_MAX];
+        char *wpath;
+        ssize_t n;
+
+        pfd.fd = w->fd;
+        pfd.events = POLLIN;
+        if ((n = poll(&pfd, 1, ms)) <= 0)
+                return (n == -1 && errno == EINTR ? -1: 0);
+        if ((n = read(w->fd, buf, sizeof(buf))) == -1)
+                return (errno == EINTR ? -1: 0);
+
+        for (char *p = buf; p < buf + n; p += sizeof(*ev) + ev->len) {
+                ev = (const struct inotify_event *)p;
+                if (ev->wd < 0 || ev->wd >= w->npaths ||
+                    (wpath = w->paths[ev->wd]) == NULL)
+                        continue;
+                if (ev->mask & IN_IGNORED) {
+                        /*
+                         * The file was deleted or replaced, as editors
+                         * do when saving.  Watch the new one.
+                         */
+                        w->paths[ev->wd] = NULL;
+                        if (addwatch(w, wpath) == -1)
+                                warn("watch: %s", wpath);
+                        if (recordsig(w, wpath))
+                                w->changed = 1;
+                        free(wpath);
+                        continue;
+                }
+                if (ev->len > 0) {
+                        if (subpath(path, wpath, ev->name) == -1)
+                                continue;
+                        wpath = path;
+                }
+                if (recordsig(w, wpath))
+                        w->changed = 1;
+        }
+
+        return (1);
+}
+
+/*
+ * Wait up to "ms" milliseconds for a burst of events, and then for its
+ * end: no event for the debounce time.
+ *
+ * Return true if a watched file has changed.
+ */
+static _Bool
+waitchange(watcher_t *w, int ms)
+{
+        _Bool changed;
+        int r;
+
+        if ((r = readevents(w, ms)) == 1)
+                while ((r = readevents(w, w->debounce)) == 1)
+                        continue;
+        if (r == -1)
+                return (0);
+
+        changed = w->changed;
+        w->changed = 0;
+        return (changed);
+}
+
+/*
+ * Called while the command line runs.  It's canceled by a change, or
+ * if the watch itself is interrupted.
+ */
+static void
+tick(job_t *jp, void *arg)
+{
+        watcher_t *w = arg;
+
+        if (w->rerun)
+                return;         /* already canceled */
+        if (interrupted || waitchange(w, 0)) {
+                w->rerun = !interrupted;
+                signaljob(jp, 1);
+        }
+}
+
+/*
+ * Run the command "argv", shown as "line", in a job of its own and wait
+ * for it.  It doesn't own the terminal: its input is /dev/null.
+ */
+static void
+run(watcher_t *w, int argc, char **argv, const char *line)
+{
+        builtin_t func;
+        job_t *jp;
+        int fd;
+
+        jp = makejob(1, strdup_or_die(line));
+        if (forkshell(1, jp) == 0) {
+                /* child */
+                signal(SIGINT, SIG_DFL);
+                signal(SIGTERM, SIG_DFL);
+                close_or_die(w->fd);
+                if ((fd = open("/dev/null", O_RDONLY)) != -1) {
+                        dup2(fd, STDIN_FILENO);
+                        close(fd);
+                }
+                if ((func = lookupbltin(argv[0])) != NULL)
+                        exit(func(argc - 1, argv + 1));
+                cmd_exec(argv); /* doesn't return */
+        }
+
+        w->jp = jp;
+        w->rerun = 0;
+        waitjobpoll(jp, tick, w, TICK);
+        w->jp = NULL;
+}
+
+static void
+freewatcher(watcher_t *w)
+{
+
+        close(w->fd);
+        for (int i = 0; i < w->npaths; i++)
+                free(w->paths[i]);
+        free(w->paths);
+        for (int i = 0; i < w->nsigs; i++)
+                free(w->sigs[i].path);
+        free(w->sigs);
+}
+
+/*
+ * watch [-d ms] path ... -- command [arg ...]
+ *
+ * Run the command made of the words after "--", then run it again
+ * each time a file changes in the given paths, or in the directories
+ * among them.  Events are coalesced until none comes for the debounce
+ * time, 100ms by default.  A command line still running when a change
+ * comes is terminated first.
+ */
+int
+watchcmd(int argc, char *argv[])
+{
+        struct sigaction sa;
+        watcher_t w;
+        char *line;
+        size_t len;
+        int npaths;
+        int i;
+
+        memset(&w, 0, sizeof(w));
+        w.debounce = DEBOUNCE;
+        if (argc >= 2 && !strcmp(argv[0], "-d")) {
+                if ((w.debounce = atoi(argv[1])) < 0)
+                        goto usage;
+                argc -= 2;
+                argv += 2;
+        }
+        for (npaths = 0; npaths < argc && strcmp(argv[npaths], "--"); npaths++)
+                continue;
+        if (npaths == 0 || npaths >= argc - 1)
+                goto usage;
+
+        if ((w.fd = inotify_init1(IN_CLOEXEC)) == -1) {
+                warn("watch: inotify_init1");
+                return (1);
+        }
+        for (i = 0; i < npaths; i++)
+                if (addwatch(&w, argv[i]) == -1) {
+                        warn("watch: %s", argv[i]);
+                        freewatcher(&w);
+                        return (1);
+                }
+
+        len = 0;
+        for (i = npaths + 1; i < argc; i++)
+                len += strlen(argv[i]) + 1;
+        line = malloc_or_die(len);
+        line[0] = '\0';
+        for (i = npaths + 1; i < argc; i++) {
+                strcat(line, argv[i]);
+                if (i < argc - 1)
+                        strcat(line, " ");
+        }
+
+        /* Terminate the running command line before exiting. */
+        sa.sa_handler = oninterrupt;
+        sa.sa_flags = 0;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGINT, &sa, NULL);
+        sigaction(SIGTERM, &sa, NULL);
+
+        while (!interrupted) {
+                run(&w, argc - npaths - 1, argv + npaths + 1, line);
+                if (w.rerun)
+                        continue;
+                while (!interrupted && !waitchange(&w, -1))
+                        continue;
+        }
+        free(line);
+        freewatcher(&w);
+
+        return (128 + interrupted);
+
+usage:
+        fprintf(stderr, "usage: watch [-d ms] path ... -- command [arg ...]\n");
+        return (2);
+}
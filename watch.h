@@ -0,0 +1,6 @@
+#ifndef ISH_WATCH_H_
+#define ISH_WATCH_H_
+
+extern int watchcmd(int, char **);
+
+#endif  /* !ISH_WATCH_H_ */
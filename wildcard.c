@@ -0,0 +1,562 @@
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "array.h"
+#include "utils.h"
+#include "wildcard.h"
+
+#define DENTBUFSIZ	(64*1024) /* getdents64() buffer size */
+#define NBUCKETS	64        /* directory cache hash buckets */
+
+/*
+ * Directory entry as returned by the getdents64 system call.
+ */
+struct linux_dirent64 {
+        uint64_t d_ino;
+        int64_t d_off;
+        unsigned short d_reclen;
+        unsigned char d_type;
+        char d_name[];
+};
+
+/*
+ * Listing of a directory.  All the names are stored one after the
+ * other in a single block.
+ */
+typedef struct dirlist {
+        char *path;             /* directory pathname */
+        char *names;            /* null-terminated entry names */
+        size_t *off;            /* offset of each name in "names" */
+        unsigned char *type;    /* type of each entry */
+        size_t n;               /* number of entries */
+        struct dirlist *next;   /* next listing in the same bucket */
+} dirlist_t;
+
+/*
+ * Listings of the directories read while expanding the words of a
+ * command line.  They are reused until wildcard_flush() is called.
+ */
+static dirlist_t *dircache[NBUCKETS];
+
+/*
+ * Return true if and only if the given character is a wildcard.
+ */
+_Bool
+wildcard_ismeta(int c)
+{
+
+        return (c == '*' || c == '?' || c == '[');
+}
+
+
+/*
+ * Match the character "c" against the bracket expression starting at
+ * "p", right after the opening bracket.
+ *
+ * Return a pointer past the closing bracket or NULL if there's none.
+ * "matchp" is set to the result.
+ */
+static const char *
+matchbracket(const char *p, int c, _Bool *matchp)
+{
+        _Bool negate;
+        _Bool match;
+        int lo;
+        int hi;
+
+        negate = *p == '!' || *p == '^';
+        if (negate)
+                p++;
+        match = 0;
+        for (_Bool first = 1; first || *p != ']'; first = 0) {
+                if (*p == '\0')
+                        return (NULL);
+                if (*p == '\\' && p[1])
+                        p++;
+                lo = (unsigned char)*p++;
+                hi = lo;
+                if (*p == '-' && p[1] && p[1] != ']') {
+                        p++;
+                        if (*p == '\\' && p[1])
+                                p++;
+                        hi = (unsigned char)*p++;
+                }
+                if (c >= lo && c <= hi)
+                        match = 1;
+        }
+        *matchp = match != negate;
+
+        return (p + 1);
+}
+
+/*
+ * Return true if the pattern "s" has any wildcard.  A bracket is only
+ * one if it's closed: otherwise, it matches itself.
+ */
+static _Bool
+hasmeta(const char *s)
+{
+        _Bool match;
+
+        for (; *s; s++) {
+                if (*s == '\\' && s[1])
+                        s++;
+                else if (*s == '[') {
+                        if (matchbracket(s + 1, 0, &match) != NULL)
+                                return (1);
+                } else if (wildcard_ismeta(*s))
+                        return (1);
+        }
+
+        return (0);
+}
+
+/*
+ * Return true if and only if the string "s" matches the pattern "pat".
+ *
+ * The pattern may contain the wildcards "*", "?" and "[...]".  Any
+ * character escaped by a backslash matches itself only.  Slashes are
+ * not treated specially.
+ */
+_Bool
+wildcard_match(const char *pat, const char *s)
+{
+        const char *starpat;
+        const char *stars;
+        const char *next;
+        _Bool match;
+
+        starpat = NULL;
+        stars = NULL;
+        while (*s) {
+                switch (*pat) {
+                case '*':
+                        while (*pat == '*')
+                                pat++;
+                        if (*pat == '\0')
+                                return (1);
+                        starpat = pat;
+                        stars = s;
+                        continue;
+                case '?':
+                        pat++;
+                        s++;
+                        continue;
+                case '[':
+                        next = matchbracket(pat + 1, (unsigned char)*s, &match);
+                        if (next == NULL) {
+                                /* Unterminated bracket: match a '['. */
+                                if (*s != '[')
+                                        goto backtrack;
+                                pat++;
+                                s++;
+                                continue;
+                        }
+                        if (!match)
+                                goto backtrack;
+                        pat = next;
+                        s++;
+                        continue;
+                case '\\':
+                        if (pat[1])
+                                pat++;
+                        /* FALLTHROUGH */
+                default:
+                        if (*pat != *s)
+                                goto backtrack;
+                        pat++;
+                        s++;
+                        continue;
+                }
+        backtrack:
+                /* Let the last star absorb one more character. */
+                if (starpat == NULL)
+                        return (0);
+                pat = starpat;
+                s = ++stars;
+        }
+        while (*pat == '*')
+                pat++;
+
+        return (*pat == '\0');
+}
+
+static unsigned
+hashpath(const char *s)
+{
+        unsigned h;
+
+        h = 5381;
+        while (*s)
+                h = h*33 + (unsigned char)*s++;
+
+        return (h % NBUCKETS);
+}
+
+/*
+ * Read the given directory with getdents64.
+ *
+ * Return NULL if it can't be opened.
+ */
+static dirlist_t *
+readdirlist(const char *path)
+{
+        static char *dentbuf;
+        dirlist_t *dl;
+        size_t namescap;
+        size_t namesz;
+        size_t cap;
+        long nread;
+        int fd;
+
+        fd = openat(AT_FDCWD, *path ? path: ".",
+                    O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+        if (fd == -1)
+                return (NULL);
+        if (dentbuf == NULL)
+                dentbuf = malloc_or_die(DENTBUFSIZ);
+
+        dl = malloc_or_die(sizeof(*dl));
+        dl->path = strdup_or_die(path);
+        dl->n = 0;
+        cap = 64;
+        dl->off = malloc_or_die(cap * sizeof(*dl->off));
+        dl->type = malloc_or_die(cap);
+        namescap = 1024;
+        namesz = 0;
+        dl->names = malloc_or_die(namescap);
+        while ((nread = syscall(SYS_getdents64, fd, dentbuf, DENTBUFSIZ)) > 0) {
+                for (long pos = 0; pos < nread; ) {
+                        struct linux_dirent64 *d = (void *)(dentbuf + pos);
+                        size_t len = strlen(d->d_name) + 1;
+
+                        pos += d->d_reclen;
+                        if (d->d_name[0] == '.' && (d->d_name[1] == '\0' ||
+                            (d->d_name[1] == '.' && d->d_name[2] == '\0')))
+                                continue;
+                        if (dl->n == cap) {
+                                cap *= 2;
+                                dl->off = realloc_or_die(dl->off,
+                                                cap * sizeof(*dl->off));
+                                dl->type = realloc_or_die(dl->type, cap);
+                        }
+                        if (namesz + len > namescap) {
+                                while (namesz + len > namescap)
+                                        namescap *= 2;
+                                dl->names = realloc_or_die(dl->names, namescap);
+                        }
+                        memcpy(dl->names + namesz, d->d_name, len);
+                        dl->off[dl->n] = namesz;
+                        dl->type[dl->n++] = d->d_type;
+                        namesz += len;
+                }
+        }
+        close(fd);
+
+        return (dl);
+}
+
+/*
+ * Return the listing of the given directory, reading it if it's not
+ * already in the cache.  An empty path stands for the current
+ * directory.
+ */
+static dirlist_t *
+getdirlist(const char *path)
+{
+        dirlist_t *dl;
+        unsigned h;
+
+        h = hashpath(path);
+        for (dl = dircache[h]; dl; dl = dl->next)
+                if (!strcmp(dl->path, path))
+                        return (dl);
+
+        if ((dl = readdirlist(path)) == NULL)
+                return (NULL);
+        dl->next = dircache[h];
+        dircache[h] = dl;
+
+        return (dl);
+}
+
+/*
+ * Forget all the cached directory listings.
+ */
+void
+wildcard_flush(void)
+{
+        dirlist_t *next;
+
+        for (int i = 0; i < NBUCKETS; i++) {
+                for (dirlist_t *dl = dircache[i]; dl; dl = next) {
+                        next = dl->next;
+                        free(dl->path);
+                        free(dl->names);
+                        free(dl->off);
+                        free(dl->type);
+                        free(dl);
+                }
+                dircache[i] = NULL;
+        }
+}
+
+/*
+ * Pathname being built while walking the directories.
+ */
+typedef struct pathbuf {
+        char *buf;
+        size_t len;
+        size_t cap;
+} pathbuf_t;
+
+static void
+pathpush(pathbuf_t *pb, const char *s, size_t n)
+{
+
+        if (pb->len + n + 1 > pb->cap) {
+                while (pb->len + n + 1 > pb->cap)
+                        pb->cap *= 2;
+                pb->buf = realloc_or_die(pb->buf, pb->cap);
+        }
+        memcpy(pb->buf + pb->len, s, n);
+        pb->len += n;
+        pb->buf[pb->len] = '\0';
+}
+
+/*
+ * Return true if the entry "i" of the listing is a directory.
+ * Symbolic links are followed unless "nofollow" is true.
+ */
+static _Bool
+isdir(const dirlist_t *dl, size_t i, pathbuf_t *pb, _Bool nofollow)
+{
+        struct stat sb;
+        int flags;
+
+        if (dl->type[i] == DT_DIR)
+                return (1);
+        if (dl->type[i] != DT_UNKNOWN && (dl->type[i] != DT_LNK || nofollow))
+                return (0);
+
+        flags = nofollow ? AT_SYMLINK_NOFOLLOW: 0;
+        if (fstatat(AT_FDCWD, pb->buf, &sb, flags) == -1)
+                return (0);
+
+        return (S_ISDIR(sb.st_mode));
+}
+
+/*
+ * Remove the escape characters of a pattern without wildcards.
+ */
+static void
+unescape(char *s)
+{
+        char *d;
+
+        for (d = s; *s; s++) {
+                if (*s == '\\' && s[1])
+                        s++;
+                *d++ = *s;
+        }
+        *d = '\0';
+}
+
+/*
+ * Add to "out" all the pathnames under "pb" matching the pattern
+ * components "comps[i]" to "comps[ncomps-1]".
+ *
+ * The "**" component matches any number of directories, including
+ * none.  Hidden entries are only matched by components starting with
+ * a dot.
+ */
+static void
+walk(pathbuf_t *pb, char **comps, int i, int ncomps, array_t *out)
+{
+        const size_t len = pb->len;
+        const char *comp = comps[i];
+        const _Bool last = i == ncomps-1;
+        struct stat sb;
+        dirlist_t *dl;
+
+        if (!hasmeta(comp)) {
+                char *lit = strdup_or_die(comp);
+                unescape(lit);
+                pathpush(pb, lit, strlen(lit));
+                free(lit);
+                if (!last) {
+                        pathpush(pb, "/", 1);
+                        walk(pb, comps, i+1, ncomps, out);
+                } else if (fstatat(AT_FDCWD, pb->buf, &sb,
+                                   AT_SYMLINK_NOFOLLOW) == 0)
+                        array_append(out, strdup_or_die(pb->buf));
+                goto done;
+        }
+
+        if ((dl = getdirlist(pb->buf)) == NULL)
+                return;
+
+        if (!strcmp(comp, "**")) {
+                walk(pb, comps, i+1, ncomps, out);
+                for (size_t j = 0; j < dl->n; j++) {
+                        const char *name = dl->names + dl->off[j];
+                        if (name[0] == '.')
+                                continue;
+                        pathpush(pb, name, strlen(name));
+                        if (isdir(dl, j, pb, 1)) {
+                                pathpush(pb, "/", 1);
+                                walk(pb, comps, i, ncomps, out);
+                        }
+                        pb->len = len;
+                        pb->buf[len] = '\0';
+                }
+                return;
+        }
+
+        for (size_t j = 0; j < dl->n; j++) {
+                const char *name = dl->names + dl->off[j];
+                if (name[0] == '.' && comp[0] != '.')
+                        continue;
+                if (!wildcard_match(comp, name))
+                        continue;
+                pathpush(pb, name, strlen(name));
+                if (last)
+                        array_append(out, strdup_or_die(pb->buf));
+                else if (isdir(dl, j, pb, 0)) {
+                        pathpush(pb, "/", 1);
+                        walk(pb, comps, i+1, ncomps, out);
+                }
+                pb->len = len;
+                pb->buf[len] = '\0';
+        }
+done:
+        pb->len = len;
+        pb->buf[len] = '\0';
+}
+
+static inline int
+charat(const char *s, size_t depth)
+{
+
+        return ((unsigned char)s[depth]);
+}
+
+static inline void
+swap(char **a, size_t i, size_t j)
+{
+        char *t;
+
+        t = a[i];
+        a[i] = a[j];
+        a[j] = t;
+}
+
+/*
+ * Sort the strings with a multikey quicksort.  All of them are known
+ * to share their first "depth" characters.
+ *
+ * Each partitioning step only looks at a single character of each
+ * string, so common prefixes, typical of pathnames, are never
+ * compared twice.
+ */
+static void
+sortstrings(char **a, size_t n, size_t depth)
+{
+        size_t lt;
+        size_t gt;
+        size_t i;
+        int pivot;
+
+        while (n > 1) {
+                if (n < 8) {
+                        for (i = 1; i < n; i++)
+                                for (size_t j = i; j > 0 &&
+                                     strcmp(a[j-1] + depth, a[j] + depth) > 0;
+                                     j--)
+                                        swap(a, j-1, j);
+                        return;
+                }
+
+                swap(a, 0, n/2);
+                pivot = charat(a[0], depth);
+                lt = 0;
+                gt = n;
+                /* a[0..lt) < pivot, a[lt..i) == pivot, a[gt..n) > pivot */
+                for (i = 1; i < gt; ) {
+                        int c = charat(a[i], depth);
+                        if (c < pivot)
+                                swap(a, lt++, i++);
+                        else if (c > pivot)
+                                swap(a, i, --gt);
+                        else
+                                i++;
+                }
+                sortstrings(a, lt, depth);
+                sortstrings(a + gt, n - gt, depth);
+                if (pivot == 0)
+                        return;
+                a += lt;
+                n = gt - lt;
+                depth++;
+        }
+}
+
+/*
+ * Expand the given pattern into the pathnames matching it.  The
+ * matches are appended to "out" in lexicographic order.
+ *
+ * Return the number of matches.
+ */
+int
+wildcard_expand(const char *pattern, array_t *out)
+{
+        array_t *comps;
+        pathbuf_t pb;
+        char *pat;
+        char *p;
+        int first;
+        int n;
+
+        /* Spare the walk, e.g. to the "[" builtin. */
+        if (!hasmeta(pattern))
+                return (0);
+        pat = strdup_or_die(pattern);
+        comps = array_new();
+        p = pat;
+        pb.cap = 256;
+        pb.buf = malloc_or_die(pb.cap);
+        pb.len = 0;
+        pb.buf[0] = '\0';
+        if (*p == '/') {
+                pathpush(&pb, "/", 1);
+                while (*p == '/')
+                        p++;
+        }
+        for (char *s; (s = strsep(&p, "/")) != NULL; )
+                array_append(comps, strdup_or_die(s));
+
+        /* A trailing "**" matches everything below. */
+        if (!strcmp(array_get(comps, comps->len-1), "**"))
+                array_append(comps, strdup_or_die("*"));
+
+        first = out->len;
+        walk(&pb, (char **)comps->buf, 0, comps->len, out);
+        n = out->len - first;
+        sortstrings((char **)out->buf + first, n, 0);
+
+        array_free(comps);
+        free(pb.buf);
+        free(pat);
+
+        return (n);
+}
@@ -0,0 +1,11 @@
+#ifndef ISH_WILDCARD_H_
+#define ISH_WILDCARD_H_
+
+#include "array.h"
+
+extern _Bool wildcard_ismeta(int);
+extern _Bool wildcard_match(const char *, const char *);
+extern int wildcard_expand(const char *, array_t *);
+extern void wildcard_flush(void);
+
+#endif  /* !ISH_WILDCARD_H_ */